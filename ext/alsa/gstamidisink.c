@@ -38,7 +38,7 @@ enum
 static GstStaticPadTemplate sink_factory = GST_STATIC_PAD_TEMPLATE ("sink",
     GST_PAD_SINK,
     GST_PAD_ALWAYS,
-    GST_STATIC_CAPS ("audio/x-gst-midi, bufferlength=(fraction) 1024/44100")
+    GST_STATIC_CAPS (GST_MIDI_CAPS)
     );
 
 GST_BOILERPLATE (GstaMIDISink, gst_amidisink, GstElement, GST_TYPE_BASE_SINK);
@@ -170,6 +170,20 @@ gst_amidisink_get_property (GObject * object, guint prop_id,
 
 /* GstElement vmethod implementations */
 
+/* sends data as one sysex event without copying it */
+static void
+gst_amidisink_send_sysex (GstaMIDISink *sink, const guint8 *data, guint len)
+{
+  snd_seq_event_t a_event;
+
+  snd_seq_ev_clear (&a_event);
+  snd_seq_ev_set_sysex (&a_event, len, (void *) data);
+  snd_seq_ev_set_direct (&a_event);
+  snd_seq_ev_set_source (&a_event, sink->a_port);
+  snd_seq_ev_set_subs (&a_event);
+  snd_seq_event_output_direct (sink->a_seq, &a_event);
+}
+
 /* chain function
  * this function does the actual processing
  */
@@ -184,6 +198,13 @@ gst_amidisink_render (GstBaseSink * bsink, GstBuffer * buf)
   gboolean events_left = TRUE;
   GstClockTime last;
   const guint8* event;
+  const guint8* sysex;
+  guint8 status;
+  guint len;
+  if (!gst_midi_buffer_validate (in)) {
+    GST_ELEMENT_ERROR (sink, STREAM, DECODE, (NULL), ("invalid midi buffer"));
+    return GST_FLOW_ERROR;
+  }
   gst_midi_iter_init (&iter, in);
   snd_seq_event_t *a_event;
 
@@ -246,12 +267,24 @@ gst_amidisink_render (GstBaseSink * bsink, GstBuffer * buf)
         a_event->data.control.value = gst_midi_event_get_byte1 (event);
         break;
       case GST_MIDI_SYSTEM:
-        a_event = g_malloc(sizeof(snd_seq_event_t));
-        if ( !a_event ) goto err;
-        snd_seq_ev_clear(a_event);
-        snd_seq_ev_set_fixed(a_event);
-        a_event->type = SND_SEQ_EVENT_SYSEX;
-        //snd_seq_ev_set_variable(event, Len, Buff);
+        sysex = gst_midi_buffer_get_sysex (in, event, &status, &len);
+        if (sysex == NULL)
+          break;
+        /* escaped sysex data goes out as is, a sysex message needs its 
+         * F0 in front of the payload as receivers expect one event. The
+         * payload doesn't have it, so it's copied behind one into memory
+         * that is kept for the next message. */
+        if (status == 0xF0) {
+          if (sink->sysex_size < len + 1) {
+            sink->sysex_size = MAX (len + 1, 2 * sink->sysex_size);
+            sink->sysex = g_realloc (sink->sysex, sink->sysex_size);
+          }
+          sink->sysex[0] = 0xF0;
+          memcpy (sink->sysex + 1, sysex, len);
+          gst_amidisink_send_sysex (sink, sink->sysex, len + 1);
+        } else {
+          gst_amidisink_send_sysex (sink, sysex, len);
+        }
         break;
       default:
         gst_midi_event_dump (event);
@@ -264,7 +297,6 @@ gst_amidisink_render (GstBaseSink * bsink, GstBuffer * buf)
       snd_seq_ev_set_source(a_event, sink->a_port);
       snd_seq_ev_set_subs(a_event);
       snd_seq_event_output_direct(sink->a_seq, a_event);
-      snd_seq_drain_output(sink->a_seq);
 #if 0
       snd_seq_real_time_t CurTime={0,0};//=(gst_midi_iter_get_time (&iter))
       snd_seq_ev_set_source(a_event, sink->a_port);
@@ -328,6 +360,9 @@ gst_aplaymidi_change_state (GstElement * element, GstStateChange transition )
     case GST_STATE_CHANGE_READY_TO_NULL:
       break;
     case GST_STATE_CHANGE_PAUSED_TO_READY:
+      g_free (sink->sysex);
+      sink->sysex = NULL;
+      sink->sysex_size = 0;
       // disconnect from midi port
       if( sink->a_queue >= 0 ){
         if( snd_seq_free_queue( sink->a_seq, sink->a_queue ) < 0 )
@@ -32,6 +32,9 @@ struct _GstaMIDISink
 
   gint a_port,a_queue;
   snd_seq_t * a_seq;
+
+  guint8 *sysex;       /* F0 and the payload of the last sysex message */
+  guint sysex_size;    /* bytes allocated for it */
 };
 
 struct _GstaMIDISinkClass 
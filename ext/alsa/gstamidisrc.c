@@ -17,6 +17,8 @@
 
 #include "gstmidibuffer.h"
 #include <alsa/asoundlib.h>
+#include <fcntl.h>
+#include <unistd.h>
 
 #include <gst/gst.h>
 
@@ -44,7 +46,7 @@ enum
 static GstStaticPadTemplate src_factory = GST_STATIC_PAD_TEMPLATE ("src",
     GST_PAD_SRC,
     GST_PAD_ALWAYS,
-    GST_STATIC_CAPS ("audio/x-gst-midi, bufferlength=(fraction) 1024/44100")
+    GST_STATIC_CAPS (GST_MIDI_CAPS)
     );
 
 GST_BOILERPLATE (GstaMIDISrc, gst_amidisrc, GstPushSrc,
@@ -58,6 +60,11 @@ static void gst_amidisrc_get_property (GObject * object, guint prop_id,
 static gboolean gst_amidisrc_is_seekable (GstBaseSrc * push_src);
 static gboolean gst_amidisrc_start (GstBaseSrc * bsrc);
 static gboolean gst_amidisrc_stop (GstBaseSrc * bsrc);
+static gboolean gst_amidisrc_unlock (GstBaseSrc * bsrc);
+static gboolean gst_amidisrc_unlock_stop (GstBaseSrc * bsrc);
+static gboolean gst_amidisrc_set_caps (GstBaseSrc * bsrc, GstCaps * caps);
+static void gst_amidisrc_fixate (GstBaseSrc * bsrc, GstCaps * caps);
+static gboolean gst_amidisrc_query (GstBaseSrc * bsrc, GstQuery * query);
 static GstFlowReturn gst_amidisrc_create (GstPushSrc * psrc, GstBuffer ** outbuf);
 static GstStateChangeReturn gst_amidisrc_change_state (GstElement * element, GstStateChange transition );
 
@@ -116,7 +123,12 @@ gst_amidisrc_class_init (GstaMIDISrcClass * klass)
 
   gstbasesrc_class->start = GST_DEBUG_FUNCPTR ( gst_amidisrc_start );
   gstbasesrc_class->stop = GST_DEBUG_FUNCPTR ( gst_amidisrc_stop );
+  gstbasesrc_class->unlock = GST_DEBUG_FUNCPTR ( gst_amidisrc_unlock );
+  gstbasesrc_class->unlock_stop = GST_DEBUG_FUNCPTR ( gst_amidisrc_unlock_stop );
   gstbasesrc_class->is_seekable = gst_amidisrc_is_seekable;
+  gstbasesrc_class->set_caps = GST_DEBUG_FUNCPTR ( gst_amidisrc_set_caps );
+  gstbasesrc_class->fixate = GST_DEBUG_FUNCPTR ( gst_amidisrc_fixate );
+  gstbasesrc_class->query = GST_DEBUG_FUNCPTR ( gst_amidisrc_query );
 }
 
 /* initialize the new element
@@ -133,6 +145,15 @@ gst_amidisrc_init (GstaMIDISrc * src,
   src->client = -1;
   src->port   = -1;
   src->silent = FALSE;
+  src->a_parser = NULL;
+  src->pool = NULL;
+  src->layout = GST_MIDI_LAYOUT_ABSOLUTE;
+  src->buf_num = GST_MIDI_BUFFER_LENGTH_NUM;
+  src->buf_denom = GST_MIDI_BUFFER_LENGTH_DENOM;
+  src->control[0] = src->control[1] = -1;
+  src->flushing = FALSE;
+
+  gst_base_src_set_live (GST_BASE_SRC (src), TRUE);
 }
 
 static void
@@ -189,15 +210,74 @@ gst_amidisrc_get_property (GObject * object, guint prop_id,
 /* GstElement vmethod implementations */
 static gboolean gst_amidisrc_start (GstBaseSrc * bsrc)
 {
-	//GstaMIDISrc *src = GST_AMIDISRC (bsrc);
-	// TODO: start capturing midi events
-	printf("***Here: %s:%d\n",__FILE__,__LINE__);
+	GstaMIDISrc *src = GST_AMIDISRC (bsrc);
+
+	if (snd_seq_nonblock (src->a_seq, 1) < 0)
+		return FALSE;
+	/* large enough for every channel event */
+	if (snd_midi_event_new (16, &src->a_parser) < 0)
+		return FALSE;
+	snd_midi_event_no_status (src->a_parser, 1);
+	if (pipe (src->control) < 0) {
+		src->control[0] = src->control[1] = -1;
+		snd_midi_event_free (src->a_parser);
+		src->a_parser = NULL;
+		GST_ELEMENT_ERROR (src, RESOURCE, OPEN_READ_WRITE, (NULL),
+				("could not create the control pipe"));
+		return FALSE;
+	}
+	fcntl (src->control[0], F_SETFL, O_NONBLOCK);
+	fcntl (src->control[1], F_SETFL, O_NONBLOCK);
+	src->flushing = FALSE;
+	src->pool = gst_midi_buffer_pool_new ();
+	src->time = GST_CLOCK_TIME_NONE;
+	src->clock_base = GST_CLOCK_TIME_NONE;
 	return TRUE;
 }
 static gboolean gst_amidisrc_stop (GstBaseSrc * bsrc)
 {
-	// TODO: stop capturing midi events
-	printf("***Here: %s:%d\n",__FILE__,__LINE__);
+	GstaMIDISrc *src = GST_AMIDISRC (bsrc);
+
+	if (src->a_parser) {
+		snd_midi_event_free (src->a_parser);
+		src->a_parser = NULL;
+	}
+	if (src->pool) {
+		gst_midi_buffer_pool_free (src->pool);
+		src->pool = NULL;
+	}
+	if (src->control[0] >= 0) {
+		close (src->control[0]);
+		close (src->control[1]);
+		src->control[0] = src->control[1] = -1;
+	}
+	return TRUE;
+}
+
+/* makes create() return until unlock_stop, the pipe wakes up its poll */
+static gboolean gst_amidisrc_unlock (GstBaseSrc * bsrc)
+{
+	GstaMIDISrc *src = GST_AMIDISRC (bsrc);
+	const gchar wake = 0;
+
+	GST_OBJECT_LOCK (src);
+	src->flushing = TRUE;
+	if (src->control[1] >= 0 && write (src->control[1], &wake, 1) < 0)
+		GST_DEBUG_OBJECT (src, "control pipe is full");
+	GST_OBJECT_UNLOCK (src);
+	return TRUE;
+}
+
+static gboolean gst_amidisrc_unlock_stop (GstBaseSrc * bsrc)
+{
+	GstaMIDISrc *src = GST_AMIDISRC (bsrc);
+	gchar wake[16];
+
+	GST_OBJECT_LOCK (src);
+	src->flushing = FALSE;
+	if (src->control[0] >= 0)
+		while (read (src->control[0], wake, sizeof (wake)) > 0);
+	GST_OBJECT_UNLOCK (src);
 	return TRUE;
 }
 
@@ -207,32 +287,148 @@ gst_amidisrc_is_seekable (GstBaseSrc * push_src)
 	return FALSE;
 }
 
+/* a buffer is pushed when the time it covers is over, so it is one buffer
+ * length late */
+static GstClockTime
+gst_amidisrc_get_latency (GstaMIDISrc *src)
+{
+	return gst_util_uint64_scale_int (GST_SECOND, src->buf_num, 
+			src->buf_denom);
+}
+
+static gboolean
+gst_amidisrc_set_caps (GstBaseSrc * bsrc, GstCaps * caps)
+{
+	GstaMIDISrc *src = GST_AMIDISRC (bsrc);
+	GstClockTime latency;
+	gboolean changed;
+	gint num, denom;
+
+	gst_midi_buffer_length_from_caps (caps, &num, &denom);
+	GST_OBJECT_LOCK (src);
+	latency = gst_amidisrc_get_latency (src);
+	src->buf_num = num;
+	src->buf_denom = denom;
+	src->layout = gst_midi_layout_from_caps (caps);
+	changed = latency != gst_amidisrc_get_latency (src);
+	GST_OBJECT_UNLOCK (src);
+
+	/* let the pipeline ask for the new latency */
+	if (changed)
+		gst_element_post_message (GST_ELEMENT (src), 
+				gst_message_new_latency (GST_OBJECT (src)));
+	return TRUE;
+}
+
+static gboolean
+gst_amidisrc_query (GstBaseSrc * bsrc, GstQuery * query)
+{
+	GstaMIDISrc *src = GST_AMIDISRC (bsrc);
+	GstClockTime latency;
+
+	switch (GST_QUERY_TYPE (query)) {
+		case GST_QUERY_LATENCY:
+			GST_OBJECT_LOCK (src);
+			latency = gst_amidisrc_get_latency (src);
+			GST_OBJECT_UNLOCK (src);
+			GST_DEBUG_OBJECT (src, "latency %" GST_TIME_FORMAT, 
+					GST_TIME_ARGS (latency));
+			gst_query_set_latency (query, TRUE, latency, latency);
+			return TRUE;
+		default:
+			return GST_BASE_SRC_CLASS (parent_class)->query (bsrc, query);
+	}
+}
+
+/* use the default length unless downstream asks for another one */
+static void
+gst_amidisrc_fixate (GstBaseSrc * bsrc, GstCaps * caps)
+{
+	gst_midi_caps_fixate (caps);
+}
+
+/* running time of the element or time since capturing started if there is 
+ * no clock */
+static GstClockTime
+gst_amidisrc_get_time (GstaMIDISrc * src)
+{
+	GstClock *clock;
+	GstClockTime now, base;
+
+	clock = gst_element_get_clock (GST_ELEMENT (src));
+	if (clock) {
+		base = GST_ELEMENT (src)->base_time;
+		now = gst_clock_get_time (clock);
+	} else {
+		clock = gst_system_clock_obtain ();
+		now = gst_clock_get_time (clock);
+		if (!GST_CLOCK_TIME_IS_VALID (src->clock_base))
+			src->clock_base = now;
+		base = src->clock_base;
+	}
+	gst_object_unref (clock);
+
+	return now > base ? now - base : 0;
+}
 
 static GstFlowReturn gst_amidisrc_create (GstPushSrc * psrc, GstBuffer ** outbuf)
 {
-	//GstaMIDISrc *src = GST_AMIDISRC (psrc);
-
-	/**
-	*outbuf = gst_buffer_new ();
-	GST_BUFFER_SIZE (*outbuf) = buffer->len;
-	GST_BUFFER_MALLOCDATA (*outbuf) = buffer->data;
-	GST_BUFFER_DATA (*outbuf) = GST_BUFFER_MALLOCDATA (*outbuf);
-	GST_BUFFER_OFFSET (*outbuf) = src->read_offset;
-	GST_BUFFER_OFFSET_END (*outbuf) =
-	      src->read_offset + GST_BUFFER_SIZE (*outbuf);
-	**/
-
-
-	//TODO:
-	printf("***Here: %s:%d\n",__FILE__,__LINE__);
-#if 0
-	snd_seq_event_t *a_event=NULL;
-	snd_seq_event_input(src->a_seq,&a_event);
-	if(a_event){
-		// convert to audio/x-gst-midi format and push on psrc.
+	GstaMIDISrc *src = GST_AMIDISRC (psrc);
+	GstMidiBuffer *buf;
+	snd_seq_event_t *a_event;
+	GstClockTime now, end;
+	struct pollfd *fds;
+	guint8 data[16];
+	gboolean flushing;
+	glong len;
+	gint n_fds;
+
+	if (!GST_CLOCK_TIME_IS_VALID (src->time))
+		src->time = gst_amidisrc_get_time (src);
+	end = src->time + gst_util_uint64_scale_int (GST_SECOND, src->buf_num, 
+			src->buf_denom);
+	buf = gst_midi_buffer_pool_acquire (src->pool, src->time, end - src->time,
+			src->layout);
+
+	/* the control pipe comes last */
+	n_fds = snd_seq_poll_descriptors_count (src->a_seq, POLLIN);
+	fds = g_newa (struct pollfd, n_fds + 1);
+	snd_seq_poll_descriptors (src->a_seq, fds, n_fds, POLLIN);
+	fds[n_fds].fd = src->control[0];
+	fds[n_fds].events = POLLIN;
+	fds[n_fds].revents = 0;
+
+	/* collect all events arriving until the buffer is full */
+	while ((now = gst_amidisrc_get_time (src)) < end) {
+		GST_OBJECT_LOCK (src);
+		flushing = src->flushing;
+		GST_OBJECT_UNLOCK (src);
+		if (flushing)
+			goto flushing;
+		if (snd_seq_event_input_pending (src->a_seq, 1) == 0 &&
+				poll (fds, n_fds + 1, (end - now + GST_MSECOND - 1) / GST_MSECOND) <= 0)
+			continue;
+		now = MIN (gst_amidisrc_get_time (src), end - 1);
+		while (snd_seq_event_input (src->a_seq, &a_event) >= 0 && a_event) {
+			len = snd_midi_event_decode (src->a_parser, data, sizeof (data), a_event);
+			/* system events aren't supported yet */
+			if (len <= 1 || data[0] >= 0xF0)
+				continue;
+			gst_midi_buffer_append (buf, now, data, len);
+		}
 	}
-#endif
+
+	src->time = end;
+	*outbuf = gst_midi_buffer_finish (buf);
+	gst_buffer_set_caps (*outbuf, GST_PAD_CAPS (GST_BASE_SRC_PAD (src)));
 	return GST_FLOW_OK;
+
+flushing:
+	GST_DEBUG_OBJECT (src, "flushing");
+	gst_midi_buffer_free (buf);
+	/* start again from the time capturing resumes */
+	src->time = GST_CLOCK_TIME_NONE;
+	return GST_FLOW_WRONG_STATE;
 }
 static GstStateChangeReturn
 gst_amidisrc_change_state (GstElement * element, GstStateChange transition )
@@ -269,9 +465,6 @@ gst_amidisrc_change_state (GstElement * element, GstStateChange transition )
 				return GST_STATE_CHANGE_FAILURE;
 		}
       break;
-    case GST_STATE_CHANGE_READY_TO_PAUSED:
-		return GST_STATE_CHANGE_NO_PREROLL;
-      break;
     default:
       break;
   }
@@ -297,9 +490,6 @@ gst_amidisrc_change_state (GstElement * element, GstStateChange transition )
 		if( snd_seq_close( src->a_seq ) < 0 )
 			return GST_STATE_CHANGE_FAILURE;
       break;
-	 case GST_STATE_CHANGE_PLAYING_TO_PAUSED:
-		return GST_STATE_CHANGE_NO_PREROLL;
-		break;
     default:
       break;
   }
@@ -31,6 +31,16 @@ struct _GstaMIDISrc
 
   gint a_port,a_queue;
   snd_seq_t * a_seq;
+  snd_midi_event_t * a_parser;	/* turns sequencer events into midi data */
+
+  GstMidiBufferPool *pool;	/* pool buffers are taken from */
+  GstMidiLayout layout;		/* negotiated buffer layout */
+  guint buf_num, buf_denom;	/* length of a buffer in seconds */
+  GstClockTime time;		/* start time of the next buffer */
+  GstClockTime clock_base;	/* start time when running without clock */
+  gint control[2];		/* pipe waking up create() or -1 */
+  gboolean flushing;		/* if create() has to return, protected by
+				   the object lock */
 };
 
 struct _GstaMIDISrcClass 
@@ -21,6 +21,7 @@
 #  include "config.h"
 #endif
 
+#include <string.h>
 #include <fluidsynth.h>
 #include "gstmidibuffer.h"
 
@@ -31,14 +32,34 @@
 /* Filter signals and args */
 enum {
   ARG_0,
-  ARG_SOUNDFONT
+  ARG_SOUNDFONT,
+  ARG_RATE,
+  ARG_PERIOD_SIZE,
+  ARG_CPU_CORES,
+  ARG_POLYPHONY,
+  ARG_SYNTHS
 };
 
+#define DEFAULT_RATE 44100
+/* the defaults of fluidsynth */
+#define DEFAULT_CPU_CORES 1
+#define DEFAULT_POLYPHONY 256
+#define DEFAULT_SYNTHS 1
+/* one synth per midi channel at most */
+#define MAX_SYNTHS 16
+/* samples below this count as silence, about -120 dB */
+#define SILENCE_LEVEL 1e-6
+/* how long the output needs to be silent with no voices playing before the
+ * synth is not asked to render anymore, in 1/n seconds */
+#define QUIET_TIME 20
+/* so buffers stay within the bufferlength midi caps allow */
+#define MAX_PERIOD_SIZE 262144
+
 static GstStaticPadTemplate gst_fluidsynth_sink_template =
 GST_STATIC_PAD_TEMPLATE ("sink",
     GST_PAD_SINK,
     GST_PAD_ALWAYS,
-    GST_STATIC_CAPS ("audio/x-gst-midi, bufferlength=(fraction) 1024/44100")
+    GST_STATIC_CAPS (GST_MIDI_CAPS)
     );
 
 static GstStaticPadTemplate gst_fluidsynth_src_template =
@@ -47,7 +68,7 @@ static GstStaticPadTemplate gst_fluidsynth_src_template =
     GST_PAD_ALWAYS,
 	 GST_STATIC_CAPS (
 		 "audio/x-raw-float, "
-			 "rate = (int) 44100, "
+			 "rate = (int) { 44100, 48000, 96000 }, "
 			 "channels = (int) 2, "
 			 "endianness = (int) BYTE_ORDER, "
 			 "width = (int) 32 "
@@ -72,13 +93,18 @@ static void gst_fluidsynth_get_property (GObject *object, guint prop_id,
 		GValue *value, GParamSpec *pspec);
 
 static GstFlowReturn gst_fluidsynth_chain (GstPad * pad, GstBuffer * data);
+static gboolean gst_fluidsynth_sink_setcaps (GstPad * pad, GstCaps * caps);
+static GstCaps *gst_fluidsynth_sink_getcaps (GstPad * pad);
+static gboolean gst_fluidsynth_sink_event (GstPad * pad, GstEvent * event);
 static GstStateChangeReturn gst_fluidsynth_change_state (GstElement * element,
 		GstStateChange transition );
 static gboolean gst_fluidsynth_process_event (fluid_synth_t *synth, 
-		const guint8* event);
+		GstBuffer *buf, const guint8* event);
 
 static void gst_fluidsynth_start (GstFluidsynth *synth);
+static gboolean gst_fluidsynth_open (GstFluidsynth *synth, gint rate);
 static void gst_fluidsynth_end (GstFluidsynth *synth);
+static void gst_fluidsynth_worker (gpointer item, gpointer user_data);
 static void gst_fluidsynth_dispose (GObject *object);
 
 static void
@@ -115,8 +141,29 @@ gst_fluidsynth_class_init (GstFluidsynthClass * klass)
   
   g_object_class_install_property (object_class, ARG_SOUNDFONT,
       g_param_spec_string ("soundfont", "soundfont",
-	  "path to soundfont to be used",
+	  "path to soundfont to be used, every synth loads its own copy of it, "
+	  "so the memory it takes grows with the number of synths",
 	  NULL, G_PARAM_READWRITE));
+  g_object_class_install_property (object_class, ARG_RATE,
+      g_param_spec_int ("rate", "rate",
+	  "sample rate to output, the nearest one downstream allows is used",
+	  1, G_MAXINT, DEFAULT_RATE, G_PARAM_READWRITE));
+  g_object_class_install_property (object_class, ARG_PERIOD_SIZE,
+      g_param_spec_uint ("period-size", "period size",
+	  "number of frames to output per buffer, 0 for as long as the midi "
+	  "buffers upstream sends", 0, MAX_PERIOD_SIZE, 0, G_PARAM_READWRITE));
+  g_object_class_install_property (object_class, ARG_CPU_CORES,
+      g_param_spec_int ("cpu-cores", "cpu cores",
+	  "number of threads rendering voices",
+	  1, 256, DEFAULT_CPU_CORES, G_PARAM_READWRITE));
+  g_object_class_install_property (object_class, ARG_POLYPHONY,
+      g_param_spec_int ("polyphony", "polyphony",
+	  "number of voices that can play at the same time",
+	  1, 65535, DEFAULT_POLYPHONY, G_PARAM_READWRITE));
+  g_object_class_install_property (object_class, ARG_SYNTHS,
+      g_param_spec_uint ("synths", "synths",
+	  "number of synths the midi channels are split between, they render "
+	  "in parallel", 1, MAX_SYNTHS, DEFAULT_SYNTHS, G_PARAM_READWRITE));
 }
 
 static void
@@ -128,9 +175,12 @@ gst_fluidsynth_init (GstFluidsynth * fluidsynth,
 	/* Sink pad setup */
   fluidsynth->sink = gst_pad_new_from_template
 	  (gst_element_class_get_pad_template (klass, "sink"), "sink");
-  gst_pad_use_fixed_caps (fluidsynth->sink);
+	gst_pad_set_getcaps_function (fluidsynth->sink,
+			GST_DEBUG_FUNCPTR(gst_fluidsynth_sink_getcaps));
 	gst_pad_set_setcaps_function (fluidsynth->sink,
-			GST_DEBUG_FUNCPTR(gst_pad_set_caps));
+			GST_DEBUG_FUNCPTR(gst_fluidsynth_sink_setcaps));
+	gst_pad_set_event_function (fluidsynth->sink,
+			GST_DEBUG_FUNCPTR(gst_fluidsynth_sink_event));
 	gst_pad_set_chain_function (fluidsynth->sink,
 			GST_DEBUG_FUNCPTR(gst_fluidsynth_chain));
 	gst_element_add_pad (GST_ELEMENT (fluidsynth), fluidsynth->sink);
@@ -142,27 +192,147 @@ gst_fluidsynth_init (GstFluidsynth * fluidsynth,
 	gst_pad_set_setcaps_function (fluidsynth->src,
 			GST_DEBUG_FUNCPTR(gst_pad_set_caps));
 	gst_element_add_pad (GST_ELEMENT (fluidsynth), fluidsynth->src);
+
+	fluidsynth->rate = DEFAULT_RATE;
+	fluidsynth->cpu_cores = DEFAULT_CPU_CORES;
+	fluidsynth->polyphony = DEFAULT_POLYPHONY;
+	fluidsynth->synths = DEFAULT_SYNTHS;
+	fluidsynth->jobs_lock = g_mutex_new ();
+	fluidsynth->jobs_done = g_cond_new ();
 }
 
 /**
- * Sets up the fluidsynth stuff. Loads a soundfont if one was specified. 
+ * Resets the state for a new stream. The synth is only set up once the 
+ * sample rate is known. 
  */
 static void
 gst_fluidsynth_start (GstFluidsynth *synth)
+{
+  g_assert (synth->parts == NULL);
+  synth->samplerate = 0;
+  synth->samples = 0;
+  synth->segment_start = 0;
+  synth->discont = TRUE;
+  synth->buffer_length = gst_util_uint64_scale_int (GST_SECOND,
+      GST_MIDI_BUFFER_LENGTH_NUM, GST_MIDI_BUFFER_LENGTH_DENOM);
+}
+
+/* creates a synth rendering at rate with the soundfont if one was specified */
+static fluid_synth_t *
+gst_fluidsynth_new_synth (GstFluidsynth *synth, gint rate)
 {
   fluid_settings_t *settings;
+  fluid_synth_t *fluid;
 
-  g_assert (synth->synth == NULL);
   settings = new_fluid_settings ();
-  synth->synth = new_fluid_synth (settings);
-  if (synth->soundfont) {
-    if (fluid_synth_sfload (synth->synth, synth->soundfont, 1) < 0) {
+  if (settings == NULL)
+    return NULL;
+  fluid_settings_setnum (settings, "synth.sample-rate", rate);
+  /* versions without multi-core rendering ignore the setting */
+  fluid_settings_setint (settings, "synth.cpu-cores", synth->cpu_cores);
+  fluid_settings_setint (settings, "synth.polyphony", synth->polyphony);
+  fluid = new_fluid_synth (settings);
+  if (fluid == NULL)
+    delete_fluid_settings (settings);
+  return fluid;
+}
+
+/**
+ * Makes the parts play the soundfont that was set last. This runs in the 
+ * streaming thread, where nothing else uses the parts. The new soundfont 
+ * replaces the old one only if every part could load it, otherwise all 
+ * parts keep the old one and the property is set back to it.
+ */
+static void
+gst_fluidsynth_load_soundfont (GstFluidsynth *synth)
+{
+  GstFluidsynthPart *part;
+  gchar *soundfont;
+  gint *ids;
+  guint i;
+
+  GST_OBJECT_LOCK (synth);
+  if (!synth->soundfont_changed) {
+    GST_OBJECT_UNLOCK (synth);
+    return;
+  }
+  synth->soundfont_changed = FALSE;
+  soundfont = g_strdup (synth->soundfont);
+  GST_OBJECT_UNLOCK (synth);
+
+  ids = g_new (gint, synth->n_parts);
+  for (i = 0; i < synth->n_parts; i++) {
+    ids[i] = -1;
+    if (soundfont && 
+	(ids[i] = fluid_synth_sfload (synth->parts[i].synth, soundfont, 1)) < 0)
+      break;
+  }
+  if (i < synth->n_parts) {
+    while (i-- > 0)
+      fluid_synth_sfunload (synth->parts[i].synth, ids[i], 1);
+    GST_ELEMENT_WARNING (synth, RESOURCE, READ, (NULL),
+	("could not load soundfont %s", soundfont));
+    GST_OBJECT_LOCK (synth);
+    /* unless another one was set meanwhile */
+    if (!synth->soundfont_changed) {
       g_free (synth->soundfont);
-      synth->soundfont = NULL;
-      g_object_notify (G_OBJECT (synth), "soundfont");
+      synth->soundfont = g_strdup (synth->loaded_soundfont);
+    }
+    GST_OBJECT_UNLOCK (synth);
+    g_object_notify (G_OBJECT (synth), "soundfont");
+    g_free (soundfont);
+  } else {
+    for (i = 0; i < synth->n_parts; i++) {
+      part = &synth->parts[i];
+      if (part->sfont_id >= 0)
+	fluid_synth_sfunload (part->synth, part->sfont_id, 1);
+      part->sfont_id = ids[i];
     }
+    g_free (synth->loaded_soundfont);
+    synth->loaded_soundfont = soundfont;
   }
-  synth->expected = 0;
+  g_free (ids);
+}
+
+/**
+ * Sets up the fluidsynth stuff to render at rate. The midi channels are 
+ * split between the synths, channel n is played by part n % synths. With 
+ * more than one part, workers render them in parallel.
+ */
+static gboolean
+gst_fluidsynth_open (GstFluidsynth *synth, gint rate)
+{
+  GstFluidsynthPart *part;
+  guint i, channel;
+
+  g_assert (synth->parts == NULL);
+  synth->n_parts = synth->synths;
+  synth->parts = g_new0 (GstFluidsynthPart, synth->n_parts);
+  for (i = 0; i < synth->n_parts; i++) {
+    part = &synth->parts[i];
+    part->element = synth;
+    part->sfont_id = -1;
+    for (channel = i; channel < 16; channel += synth->n_parts)
+      part->channels |= 1 << channel;
+    part->synth = gst_fluidsynth_new_synth (synth, rate);
+    if (part->synth == NULL) {
+      gst_fluidsynth_end (synth);
+      return FALSE;
+    }
+  }
+  if (synth->n_parts > 1) {
+    synth->workers = g_thread_pool_new (gst_fluidsynth_worker, synth,
+	synth->n_parts, FALSE, NULL);
+    if (synth->workers == NULL)
+      GST_WARNING_OBJECT (synth, "could not start %u threads, rendering "
+	  "all synths in the streaming thread", synth->n_parts);
+  }
+  synth->samplerate = rate;
+  /* the new synths have no soundfont yet */
+  GST_OBJECT_LOCK (synth);
+  synth->soundfont_changed = TRUE;
+  GST_OBJECT_UNLOCK (synth);
+  return TRUE;
 }
 
 /**
@@ -172,17 +342,36 @@ static void
 gst_fluidsynth_end (GstFluidsynth *synth)
 {
   fluid_settings_t *settings;
+  guint i;
 
-  g_assert (synth->synth != NULL);
-  settings = fluid_synth_get_settings (synth->synth);
-  delete_fluid_synth (synth->synth);
-  synth->synth = NULL;
-  delete_fluid_settings (settings);
+  if (synth->parts == NULL)
+    return;
+  if (synth->workers) {
+    g_thread_pool_free (synth->workers, FALSE, TRUE);
+    synth->workers = NULL;
+  }
+  for (i = 0; i < synth->n_parts; i++) {
+    if (synth->parts[i].synth) {
+      settings = fluid_synth_get_settings (synth->parts[i].synth);
+      delete_fluid_synth (synth->parts[i].synth);
+      delete_fluid_settings (settings);
+    }
+    g_free (synth->parts[i].data);
+  }
+  g_free (synth->parts);
+  synth->parts = NULL;
+  synth->n_parts = 0;
+  g_free (synth->loaded_soundfont);
+  synth->loaded_soundfont = NULL;
 }
 
 static gboolean
-gst_fluidsynth_process_event (fluid_synth_t *synth, const guint8* event)
+gst_fluidsynth_process_event (fluid_synth_t *synth, GstBuffer *buf, const guint8* event)
 {
+  const guint8 *sysex;
+  guint8 status;
+  guint len;
+
   switch (gst_midi_event_get_type (event)) {
     case GST_MIDI_NOTE_ON:
       if (fluid_synth_noteon (synth, gst_midi_event_get_channel (event),
@@ -209,6 +398,16 @@ gst_fluidsynth_process_event (fluid_synth_t *synth, const guint8* event)
             gst_midi_event_get_byte1 (event)) != 0)
         goto err;
       break;
+    case GST_MIDI_SYSTEM:
+      sysex = gst_midi_buffer_get_sysex (buf, event, &status, &len);
+      /* only complete messages, fluidsynth wants them without F0 and F7 */
+      if (sysex == NULL || status != 0xF0)
+        break;
+      if (len > 0 && sysex[len - 1] == 0xF7)
+        len--;
+      if (fluid_synth_sysex (synth, (const char *) sysex, len, NULL, NULL, NULL, 0) != 0)
+        goto err;
+      break;
     default:
       gst_midi_event_dump (event);
       break;
@@ -220,66 +419,458 @@ err:
   return FALSE;
 }
 
-static GstFlowReturn
-gst_fluidsynth_chain (GstPad * pad, GstBuffer * data)
+/* the caps the src pad is going to use, with the rate closest to the one
+ * asked for */
+static GstCaps *
+gst_fluidsynth_src_fixed_caps (GstFluidsynth *synth)
+{
+	GstCaps *caps;
+
+	caps = gst_pad_get_allowed_caps (synth->src);
+	if (caps == NULL)
+		caps = gst_caps_copy (gst_pad_get_pad_template_caps (synth->src));
+	if (gst_caps_is_empty (caps)) {
+		gst_caps_unref (caps);
+		return NULL;
+	}
+	gst_caps_truncate (caps);
+	gst_structure_fixate_field_nearest_int (gst_caps_get_structure (caps, 0),
+			"rate", synth->rate);
+	gst_pad_fixate_caps (synth->src, caps);
+	return caps;
+}
+
+/* the rate the src pad uses or is going to use */
+static gint
+gst_fluidsynth_get_rate (GstFluidsynth *synth)
+{
+	GstCaps *caps;
+	gint rate;
+
+	if (synth->samplerate > 0)
+		return synth->samplerate;
+	caps = gst_fluidsynth_src_fixed_caps (synth);
+	if (caps == NULL)
+		return synth->rate;
+	if (!gst_structure_get_int (gst_caps_get_structure (caps, 0), "rate", &rate))
+		rate = synth->rate;
+	gst_caps_unref (caps);
+	return rate;
+}
+
+/* sets the src caps and the synth up for them */
+static gboolean
+gst_fluidsynth_negotiate (GstFluidsynth *synth)
+{
+	GstCaps *caps;
+	gint rate;
+
+	caps = gst_fluidsynth_src_fixed_caps (synth);
+	if (caps == NULL)
+		return FALSE;
+	if (!gst_structure_get_int (gst_caps_get_structure (caps, 0), "rate", &rate) ||
+			!gst_pad_set_caps (synth->src, caps)) {
+		gst_caps_unref (caps);
+		return FALSE;
+	}
+	gst_caps_unref (caps);
+	GST_DEBUG_OBJECT (synth, "rendering at %d Hz", rate);
+	if (!gst_fluidsynth_open (synth, rate)) {
+		GST_ELEMENT_ERROR (synth, LIBRARY, INIT, (NULL), 
+				("could not create a synth"));
+		return FALSE;
+	}
+	return TRUE;
+}
+
+/* asks for buffers of period_size frames if it is set */
+static GstCaps *
+gst_fluidsynth_sink_getcaps (GstPad * pad)
 {
-	GstClockTime last;
-	GstMidiIter iter;
-	GstBuffer *out, *in = GST_BUFFER (data);
 	GstFluidsynth *synth = GST_FLUIDSYNTH (gst_pad_get_parent (pad));
-	gboolean events_left = TRUE;
+	GstCaps *caps;
+
+	caps = gst_caps_copy (gst_pad_get_pad_template_caps (pad));
+	if (synth->period_size > 0) {
+		gst_caps_set_simple (caps, "bufferlength", GST_TYPE_FRACTION, 
+				(gint) synth->period_size, gst_fluidsynth_get_rate (synth), NULL);
+	}
+	gst_object_unref (synth);
+	return caps;
+}
+
+static gboolean
+gst_fluidsynth_sink_setcaps (GstPad * pad, GstCaps * caps)
+{
+	GstFluidsynth *synth = GST_FLUIDSYNTH (gst_pad_get_parent (pad));
+	gint num, denom;
+
+	gst_midi_buffer_length_from_caps (caps, &num, &denom);
+	synth->buffer_length = gst_util_uint64_scale_int (GST_SECOND, num, denom);
+	gst_object_unref (synth);
+	return TRUE;
+}
+
+/* Stops all voices after a flush, so notes whose note offs were flushed 
+ * don't keep sounding, and puts the parts back to rendering. */
+static void
+gst_fluidsynth_reset (GstFluidsynth *synth)
+{
 	guint i;
-	GstFlowReturn ret;
 
-	g_assert (synth->synth);
-	gst_midi_iter_init (&iter, in);
-	last = in->timestamp;
-	while ((GstClockTimeDiff) last - synth->expected > GST_USECOND) {
-		/* empty buffers */
-		/* buffer size = sample size * channels * samples per buffer */
-		ret = gst_pad_alloc_buffer (synth->src, GST_BUFFER_OFFSET_NONE, 1024*2*sizeof(float), GST_PAD_CAPS (synth->src), &out);
-		if( ret != GST_FLOW_OK ){
-			return ret;
+	for (i = 0; i < synth->n_parts; i++) {
+		fluid_synth_system_reset (synth->parts[i].synth);
+		synth->parts[i].quiet = FALSE;
+		synth->parts[i].silent = 0;
+	}
+}
+
+/* samples are counted from the start of the segment */
+static gboolean
+gst_fluidsynth_sink_event (GstPad * pad, GstEvent * event)
+{
+	GstFluidsynth *synth = GST_FLUIDSYNTH (gst_pad_get_parent (pad));
+	GstFormat format;
+	gint64 start;
+	gboolean ret;
+
+	if (GST_EVENT_TYPE (event) == GST_EVENT_FLUSH_STOP) {
+		/* serialized, so nothing is rendering */
+		gst_fluidsynth_reset (synth);
+	} else if (GST_EVENT_TYPE (event) == GST_EVENT_NEWSEGMENT) {
+		gst_event_parse_new_segment (event, NULL, NULL, &format, &start, 
+				NULL, NULL);
+		if (format == GST_FORMAT_TIME) {
+			synth->segment_start = start;
+			synth->discont = TRUE;
+		}
+	}
+	ret = gst_pad_event_default (pad, event);
+	gst_object_unref (synth);
+	return ret;
+}
+
+/* number of the sample that is played at time */
+static inline guint64
+gst_fluidsynth_sample (GstFluidsynth *synth, GstClockTime time)
+{
+	return gst_util_uint64_scale_int (time, synth->samplerate, GST_SECOND);
+}
+
+/* time the sample is played at */
+static inline GstClockTime
+gst_fluidsynth_time (GstFluidsynth *synth, guint64 sample)
+{
+	return gst_util_uint64_scale_int (sample, GST_SECOND, synth->samplerate);
+}
+
+/* the first time that is played in sample, times are rounded down so this
+ * can be one more than gst_fluidsynth_time() */
+static inline GstClockTime
+gst_fluidsynth_sample_start (GstFluidsynth *synth, guint64 sample)
+{
+	GstClockTime time = gst_fluidsynth_time (synth, sample);
+
+	if (gst_fluidsynth_sample (synth, time) < sample)
+		time++;
+	return time;
+}
+
+/* Renders frames of the part into data. Once no voice has been playing and 
+ * the output has been silent for a while, so reverb and chorus tails are 
+ * gone, silence is written without asking the synth. gap is unset if 
+ * anything was rendered. */
+static gboolean
+gst_fluidsynth_render (GstFluidsynthPart *part, float *data, guint frames)
+{
+	guint j;
+
+	if (part->quiet) {
+		memset (data, 0, frames * 2 * sizeof (float));
+		return TRUE;
+	}
+	part->gap = FALSE;
+	if (fluid_synth_write_float (part->synth, frames, 
+				data, 0, 2, data, 1, 2) != 0)
+		return FALSE;
+	if (fluid_synth_get_active_voice_count (part->synth) > 0) {
+		part->silent = 0;
+		return TRUE;
+	}
+	for (j = 0; j < 2 * frames; j++) {
+		if (data[j] > SILENCE_LEVEL || data[j] < -SILENCE_LEVEL) {
+			part->silent = 0;
+			return TRUE;
 		}
+	}
+	part->silent += frames;
+	if (part->silent >= (guint) part->element->samplerate / QUIET_TIME) {
+		GST_LOG_OBJECT (part->element, "synth %d is quiet", 
+				(gint) (part - part->element->parts));
+		part->quiet = TRUE;
+	}
+	return TRUE;
+}
+
+/* if the part plays event, system messages go to all parts */
+static inline gboolean
+gst_fluidsynth_part_plays (GstFluidsynthPart *part, const GstMidiEvent *event)
+{
+	return gst_midi_event_get_type (event) == GST_MIDI_SYSTEM ||
+		(part->channels & (1 << gst_midi_event_get_channel (event)));
+}
+
+/* events of the part make it render again */
+static void
+gst_fluidsynth_process_batch (GstFluidsynthPart *part, GstBuffer *buf, 
+		GstMidiBatch *batch, guint n)
+{
+	gboolean played = FALSE;
+	guint j;
+
+	for (j = 0; j < n; j++) {
+		if (!gst_fluidsynth_part_plays (part, batch->events[j]))
+			continue;
+		gst_fluidsynth_process_event (part->synth, buf, batch->events[j]);
+		played = TRUE;
+	}
+	if (played) {
+		part->quiet = FALSE;
+		part->silent = 0;
+	}
+}
+
+/* Renders the next job_frames frames of the part with the events of job_in.
+ * Events are handled right before the sample they happen in, the samples up
+ * to the next event of the part are rendered at once. Part 0 renders into 
+ * job_out, the others into their data for mixing. */
+static void
+gst_fluidsynth_part_render (GstFluidsynthPart *part)
+{
+	GstFluidsynth *synth = part->element;
+	GstBuffer *in = synth->job_in;
+	const GstMidiEvent *event;
+	GstClockTime next;
+	GstMidiIter iter;
+	GstMidiBatch batch;
+	guint64 sample;
+	guint i, n, span;
+	float *data;
+
+	part->gap = TRUE;
+	part->failed = FALSE;
+	if (part == synth->parts)
+		data = synth->job_out ? (float *) GST_BUFFER_DATA (synth->job_out) : NULL;
+	else
+		data = part->data;
+	if (in)
+		gst_midi_iter_init (&iter, in);
+	for (i = 0; i < synth->job_frames; i += span) {
+		sample = synth->samples + i;
+		next = GST_CLOCK_TIME_NONE;
+		if (in) {
+			do {
+				n = gst_midi_iter_next_batch (&iter, &batch, 
+						gst_fluidsynth_sample_start (synth, sample + 1));
+				gst_fluidsynth_process_batch (part, in, &batch, n);
+			} while (n == GST_MIDI_BATCH_SIZE);
+			/* only events of the part end a span */
+			while ((event = gst_midi_iter_get_event (&iter)) && 
+					!gst_fluidsynth_part_plays (part, event))
+				gst_midi_iter_next (&iter);
+			next = gst_midi_iter_get_time (&iter);
+		}
+		if (GST_CLOCK_TIME_IS_VALID (next))
+			span = MIN (gst_fluidsynth_sample (synth, next) - sample, 
+					synth->job_frames - i);
+		else
+			span = synth->job_frames - i;
+		if (!gst_fluidsynth_render (part, data + 2 * i, span)) {
+			part->failed = TRUE;
+			return;
+		}
+	}
+	/* buffers too short to contain a sample still have events */
+	if (in) {
+		do {
+			n = gst_midi_iter_next_batch (&iter, &batch, GST_CLOCK_TIME_NONE);
+			gst_fluidsynth_process_batch (part, in, &batch, n);
+		} while (n == GST_MIDI_BATCH_SIZE);
+	}
+}
+
+static void
+gst_fluidsynth_worker (gpointer item, gpointer user_data)
+{
+	GstFluidsynth *synth = user_data;
+
+	gst_fluidsynth_part_render (item);
+	g_mutex_lock (synth->jobs_lock);
+	if (--synth->jobs_pending == 0)
+		g_cond_signal (synth->jobs_done);
+	g_mutex_unlock (synth->jobs_lock);
+}
+
+/* adds n samples of src to dest, kept simple so compilers vectorize it */
+static void
+gst_fluidsynth_mix (float *dest, const float *src, guint n)
+{
+	guint j;
+
+	for (j = 0; j < n; j++)
+		dest[j] += src[j];
+}
+
+/* Renders frames of all parts into out, which may be NULL if frames is 0, 
+ * with the events of in, which may be NULL. The parts render in parallel 
+ * if there are workers and are mixed afterwards, parts that were silent
+ * are left out. gap is set if all of them were. */
+static gboolean
+gst_fluidsynth_render_parts (GstFluidsynth *synth, GstBuffer *in, 
+		GstBuffer *out, guint frames, gboolean *gap)
+{
+	GstFluidsynthPart *part;
+	guint i;
 
-		out->timestamp = synth->expected;
-		out->duration = GST_SECOND * 1024 / 44100;
-		if (fluid_synth_write_float (synth->synth, 1024, 
-					out->data, 0, 2, out->data, 1, 2) != 0){
-			g_print ("ERROR ERROR ERROR");
-			return GST_FLOW_ERROR;
+	synth->job_in = in;
+	synth->job_out = out;
+	synth->job_frames = frames;
+	for (i = 1; i < synth->n_parts; i++) {
+		part = &synth->parts[i];
+		if (part->size < frames) {
+			g_free (part->data);
+			part->data = g_new (float, 2 * frames);
+			part->size = frames;
 		}
-		gst_buffer_set_caps (GST_BUFFER (out), synth->out_caps);
-		gst_pad_push (synth->src, GST_BUFFER (out));
-		synth->expected += GST_SECOND * 1024 / 44100;
 	}
+	if (synth->workers == NULL) {
+		for (i = 0; i < synth->n_parts; i++)
+			gst_fluidsynth_part_render (&synth->parts[i]);
+	} else {
+		synth->jobs_pending = synth->n_parts;
+		for (i = 0; i < synth->n_parts; i++)
+			g_thread_pool_push (synth->workers, &synth->parts[i], NULL);
+		g_mutex_lock (synth->jobs_lock);
+		while (synth->jobs_pending > 0)
+			g_cond_wait (synth->jobs_done, synth->jobs_lock);
+		g_mutex_unlock (synth->jobs_lock);
+	}
+	synth->job_in = NULL;
+	synth->job_out = NULL;
+
+	*gap = TRUE;
+	for (i = 0; i < synth->n_parts; i++) {
+		part = &synth->parts[i];
+		if (part->failed)
+			return FALSE;
+		if (part->gap)
+			continue;
+		if (i > 0)
+			gst_fluidsynth_mix ((float *) GST_BUFFER_DATA (out), part->data, 
+					2 * frames);
+		*gap = FALSE;
+	}
+	return TRUE;
+}
+
+/* gets a buffer for the next frames, timestamped from the sample counter */
+static GstFlowReturn
+gst_fluidsynth_alloc (GstFluidsynth *synth, guint frames, GstBuffer **out)
+{
+	GstFlowReturn ret;
+
 	/* buffer size = sample size * channels * samples per buffer */
-	ret = gst_pad_alloc_buffer (synth->src, GST_BUFFER_OFFSET_NONE, 1024*2*sizeof(float), GST_PAD_CAPS (synth->src), &out);
-	if( ret != GST_FLOW_OK ){
+	ret = gst_pad_alloc_buffer (synth->src, synth->samples, 
+			frames * 2 * sizeof (float), GST_PAD_CAPS (synth->src), out);
+	if (ret != GST_FLOW_OK)
 		return ret;
+	GST_BUFFER_TIMESTAMP (*out) = gst_fluidsynth_time (synth, synth->samples);
+	GST_BUFFER_DURATION (*out) = gst_fluidsynth_time (synth, 
+			synth->samples + frames) - GST_BUFFER_TIMESTAMP (*out);
+	GST_BUFFER_OFFSET (*out) = synth->samples;
+	GST_BUFFER_OFFSET_END (*out) = synth->samples + frames;
+	gst_buffer_set_caps (*out, GST_PAD_CAPS (synth->src));
+	return GST_FLOW_OK;
+}
+
+static GstFlowReturn
+gst_fluidsynth_chain (GstPad * pad, GstBuffer * data)
+{
+	GstBuffer *out, *in = GST_BUFFER (data);
+	GstFluidsynth *synth = GST_FLUIDSYNTH (gst_pad_get_parent (pad));
+	guint64 start, end, period;
+	guint frames;
+	gboolean gap;
+	GstFlowReturn ret = GST_FLOW_OK;
+
+	if (synth->parts == NULL && !gst_fluidsynth_negotiate (synth)) {
+		ret = GST_FLOW_NOT_NEGOTIATED;
+		goto out;
 	}
-	gst_buffer_copy_metadata (out, in,GST_BUFFER_COPY_TIMESTAMPS);
-	for (i = 0; i < 1024 / 64; i++) {
-		last += in->duration * (i + 1) * 64 / 1024;
-		while (events_left && gst_midi_iter_get_time (&iter) < last) {
-			gst_fluidsynth_process_event (synth->synth, gst_midi_iter_get_event (&iter));
-			events_left = gst_midi_iter_next (&iter);
-		}
-		if (fluid_synth_write_float (synth->synth, 64, 
-					out->data, 0 + 64 * 2 * i, 2, 
-					out->data, 1 + 64 * 2 * i, 2) != 0){
-			g_print ("ERROR ERROR ERROR");
-			return GST_FLOW_ERROR;
+	gst_fluidsynth_load_soundfont (synth);
+	if (!gst_midi_buffer_validate (in)) {
+		GST_ELEMENT_ERROR (synth, STREAM, DECODE, (NULL), 
+				("invalid midi buffer"));
+		ret = GST_FLOW_ERROR;
+		goto out;
+	}
+	if (synth->discont) {
+		synth->samples = gst_fluidsynth_sample (synth, synth->segment_start);
+		synth->discont = FALSE;
+	}
+	start = gst_fluidsynth_sample (synth, in->timestamp);
+	end = gst_fluidsynth_sample (synth, in->timestamp + in->duration);
+	/* empty buffers up to the input, one period or input buffer long */
+	if (synth->period_size > 0)
+		period = synth->period_size;
+	else
+		period = MAX (gst_fluidsynth_sample (synth, synth->buffer_length), 1);
+	while (synth->samples < start) {
+		frames = MIN (period, start - synth->samples);
+		ret = gst_fluidsynth_alloc (synth, frames, &out);
+		if (ret != GST_FLOW_OK)
+			goto out;
+		if (!gst_fluidsynth_render_parts (synth, NULL, out, frames, &gap)) {
+			gst_buffer_unref (out);
+			goto render_error;
 		}
+		if (gap)
+			GST_BUFFER_FLAG_SET (out, GST_BUFFER_FLAG_GAP);
+		synth->samples += frames;
+		ret = gst_pad_push (synth->src, out);
+		if (ret != GST_FLOW_OK)
+			goto out;
+	}
+	/* the samples of the buffer, of any length the caps allow */
+	frames = end > synth->samples ? end - synth->samples : 0;
+	out = NULL;
+	if (frames > 0) {
+		ret = gst_fluidsynth_alloc (synth, frames, &out);
+		if (ret != GST_FLOW_OK)
+			goto out;
+	}
+	if (!gst_fluidsynth_render_parts (synth, in, out, frames, &gap)) {
+		if (out)
+			gst_buffer_unref (out);
+		goto render_error;
+	}
+	synth->samples += frames;
+	if (out) {
+		if (gap)
+			GST_BUFFER_FLAG_SET (out, GST_BUFFER_FLAG_GAP);
+		ret = gst_pad_push (synth->src, out);
 	}
-	synth->expected = in->timestamp + in->duration;
-	gst_buffer_unref (data);
-	//g_print ("pushing %llu\n", GST_BUFFER_TIMESTAMP (out));
-	gst_buffer_set_caps (GST_BUFFER (out), synth->out_caps);
-	gst_pad_push (synth->src, GST_BUFFER (out));
-	gst_object_unref(synth);
 
-	return GST_FLOW_OK;
+out:
+	gst_buffer_unref (in);
+	gst_object_unref (synth);
+	return ret;
+
+render_error:
+	GST_ELEMENT_ERROR (synth, STREAM, FAILED, (NULL), 
+			("fluidsynth could not render"));
+	ret = GST_FLOW_ERROR;
+	goto out;
 }
 
 static GstStateChangeReturn
@@ -289,10 +880,6 @@ gst_fluidsynth_change_state (GstElement * element, GstStateChange transition )
 	GstStateChangeReturn ret = GST_STATE_CHANGE_SUCCESS;
 
 	switch (transition) {
-		case GST_STATE_CHANGE_NULL_TO_READY:
-			fluidsynth->out_caps =
-				gst_caps_copy (gst_pad_get_pad_template_caps (fluidsynth->src));
-			break;
 		case GST_STATE_CHANGE_READY_TO_PAUSED:
 			gst_fluidsynth_start (fluidsynth);
 			break;
@@ -308,9 +895,6 @@ gst_fluidsynth_change_state (GstElement * element, GstStateChange transition )
 		case GST_STATE_CHANGE_PAUSED_TO_READY:
 			gst_fluidsynth_end (fluidsynth);
 			break;
-		case GST_STATE_CHANGE_READY_TO_NULL:
-			gst_caps_unref (fluidsynth->out_caps);
-			break;
 		default:
 			break;
 	}
@@ -323,9 +907,17 @@ gst_fluidsynth_dispose (GObject *object)
 {
 	GstFluidsynth *synth = GST_FLUIDSYNTH (object);
 
-	g_assert (synth->synth == NULL);
+	g_assert (synth->parts == NULL);
 	g_free (synth->soundfont);
 	synth->soundfont = NULL;
+	if (synth->jobs_lock) {
+		g_mutex_free (synth->jobs_lock);
+		synth->jobs_lock = NULL;
+	}
+	if (synth->jobs_done) {
+		g_cond_free (synth->jobs_done);
+		synth->jobs_done = NULL;
+	}
 
 	G_OBJECT_CLASS (parent_class)->dispose (object);
 }
@@ -338,13 +930,32 @@ gst_fluidsynth_set_property (GObject *object, guint prop_id,
 
 	switch (prop_id) {
 		case ARG_SOUNDFONT:
+			/* the parts load it before they render next */
+			GST_OBJECT_LOCK (synth);
+			g_free (synth->soundfont);
 			synth->soundfont = g_value_dup_string (value);
-			if (synth->synth && synth->soundfont) {
-				if (fluid_synth_sfload (synth->synth, synth->soundfont, 1) < 0) {
-					g_free (synth->soundfont);
-					synth->soundfont = NULL;
-				}
-			}
+			synth->soundfont_changed = TRUE;
+			GST_OBJECT_UNLOCK (synth);
+			break;
+		case ARG_RATE:
+			/* used when the synth is set up next time */
+			synth->rate = g_value_get_int (value);
+			break;
+		case ARG_PERIOD_SIZE:
+			/* used when caps are negotiated next time */
+			synth->period_size = g_value_get_uint (value);
+			break;
+		case ARG_CPU_CORES:
+			/* used when the synth is set up next time */
+			synth->cpu_cores = g_value_get_int (value);
+			break;
+		case ARG_POLYPHONY:
+			/* used when the synth is set up next time */
+			synth->polyphony = g_value_get_int (value);
+			break;
+		case ARG_SYNTHS:
+			/* used when the synth is set up next time */
+			synth->synths = g_value_get_uint (value);
 			break;
 		default:
 			G_OBJECT_WARN_INVALID_PROPERTY_ID (object, prop_id, pspec);
@@ -360,7 +971,24 @@ gst_fluidsynth_get_property (GObject *object, guint prop_id,
 
 	switch (prop_id) {
 		case ARG_SOUNDFONT:
+			GST_OBJECT_LOCK (synth);
 			g_value_set_string (value, synth->soundfont);
+			GST_OBJECT_UNLOCK (synth);
+			break;
+		case ARG_RATE:
+			g_value_set_int (value, synth->rate);
+			break;
+		case ARG_PERIOD_SIZE:
+			g_value_set_uint (value, synth->period_size);
+			break;
+		case ARG_CPU_CORES:
+			g_value_set_int (value, synth->cpu_cores);
+			break;
+		case ARG_POLYPHONY:
+			g_value_set_int (value, synth->polyphony);
+			break;
+		case ARG_SYNTHS:
+			g_value_set_uint (value, synth->synths);
 			break;
 		default:
 			G_OBJECT_WARN_INVALID_PROPERTY_ID (object, prop_id, pspec);
@@ -14,6 +14,24 @@ G_BEGIN_DECLS
 
 typedef struct _GstFluidsynth GstFluidsynth;
 typedef struct _GstFluidsynthClass GstFluidsynthClass;
+typedef struct _GstFluidsynthPart GstFluidsynthPart;
+
+/* one synth, playing some of the midi channels */
+struct _GstFluidsynthPart
+{
+  GstFluidsynth *	element;
+  fluid_synth_t *	synth;
+  guint			channels;	/* bit n is set if it plays channel n */
+  float *		data;		/* frames rendered for mixing */
+  guint			size;		/* frames data has room for */
+  guint			silent;		/* frames rendered silent with no 
+					   voice active */
+  gboolean		quiet;		/* if the synth is silent until the 
+					   next event */
+  gboolean		gap;		/* if the last frames were silence */
+  gboolean		failed;		/* if rendering the last frames failed */
+  gint			sfont_id;	/* id of the loaded soundfont or -1 */
+};
 
 struct _GstFluidsynth 
 {
@@ -22,12 +40,35 @@ struct _GstFluidsynth
   GstPad *		sink;
   GstPad *		src;
   
-  GstCaps *out_caps;
-
+  GstFluidsynthPart *	parts;		/* NULL until the src caps are set */
+  guint			n_parts;
+  guint			synths;		/* number of synths the channels are
+					   split between */
+  gchar *		soundfont;	/* set by the property, protected by 
+					   the object lock */
+  gboolean		soundfont_changed; /* if the parts need to load 
+					   soundfont */
+  gchar *		loaded_soundfont; /* the one the parts play */
+  gint			rate;		/* rate to output if possible */
+  guint			period_size;	/* frames per buffer or 0 to output
+					   buffers as long as the input */
+  gint			cpu_cores;	/* threads rendering voices */
+  gint			polyphony;	/* voices playing at most */
+  gint			samplerate;	/* rate the synth was set up with */
+  guint64		samples;	/* number of the next sample */
+  GstClockTime		segment_start;	/* of the current segment */
+  gboolean		discont;	/* if samples needs to be set from 
+					   segment_start */
+  GstClockTime		buffer_length;	/* length of the input buffers */
 
-  fluid_synth_t *	synth;
-  gchar *		soundfont;
-  GstClockTime		expected;
+  GThreadPool *		workers;	/* for rendering parts in parallel or NULL */
+  guint			jobs_pending;	/* parts the workers haven't rendered yet */
+  GMutex *		jobs_lock;
+  GCond *		jobs_done;
+  /* what the parts render next */
+  GstBuffer *		job_in;		/* midi buffer or NULL */
+  GstBuffer *		job_out;	/* part 0 renders into it */
+  guint			job_frames;
 };
 
 struct _GstFluidsynthClass {
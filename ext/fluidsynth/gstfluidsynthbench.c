@@ -0,0 +1,188 @@
+/*
+ * Copyright (C) 2005 Benjamin Otte <otte@gnome.org>
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Library General Public
+ * License as published by the Free Software Foundation; either
+ * version 2 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Library General Public License for more details.
+ *
+ * You should have received a copy of the GNU Library General Public
+ * License along with this library; if not, write to the
+ * Free Software Foundation, Inc., 59 Temple Place - Suite 330,
+ * Boston, MA 02111-1307, USA.
+ */
+
+/* Measures how fast fluidsynth renders dense orchestral music with the
+ * settings the fluidsynth element uses, for 1 up to all cpu cores. Run with
+ * "make bench SOUNDFONT=/path/to/soundfont.sf2", a General MIDI soundfont
+ * gives the most realistic results. Every line of output is one result,
+ * with tab separated fields:
+ *   cores  polyphony  seconds rendered  seconds taken  realtime factor
+ *   most voices playing at once */
+
+#ifdef HAVE_CONFIG_H
+#  include "config.h"
+#endif
+
+#ifdef HAVE_UNISTD_H
+#  include <unistd.h>
+#endif
+#include <stdlib.h>
+#include <fluidsynth.h>
+#include <gst/gst.h>
+
+#define RATE (44100)
+/* frames rendered at once, the default length of midi buffers */
+#define PERIOD (1024)
+/* seconds of music rendered if not given on the command line */
+#define DEFAULT_SECONDS (30)
+/* so no voices are stolen */
+#define POLYPHONY (4096)
+/* chords are changed this often, in periods */
+#define CHORD_PERIODS (11)
+#define NOTES_PER_CHORD (4)
+#define MAX_CORES (64)
+
+/* General MIDI instruments of an orchestra and the range they play in */
+static const struct {
+  guint8		program;
+  guint8		low;
+  guint8		high;
+} instruments[16] = {
+  { 40, 55, 100 },	/* violin */
+  { 40, 55, 96 },	/* violin */
+  { 41, 48, 84 },	/* viola */
+  { 42, 36, 76 },	/* cello */
+  { 43, 28, 60 },	/* contrabass */
+  { 48, 36, 96 },	/* string ensemble */
+  { 73, 60, 96 },	/* flute */
+  { 68, 58, 91 },	/* oboe */
+  { 71, 50, 91 },	/* clarinet */
+  { 0, 35, 81 },	/* percussion, the channel is ignored */
+  { 70, 34, 72 },	/* bassoon */
+  { 60, 34, 77 },	/* french horn */
+  { 56, 54, 82 },	/* trumpet */
+  { 57, 40, 72 },	/* trombone */
+  { 58, 28, 58 },	/* tuba */
+  { 46, 24, 103 }	/* harp */
+};
+
+/* a linear congruential generator, so all runs play the same music */
+static guint32 seed;
+
+static guint
+bench_random (guint max)
+{
+  seed = seed * 1103515245 + 12345;
+  return (seed >> 16) % max;
+}
+
+/* releases the last chord of every channel and plays a new one */
+static void
+change_chords (fluid_synth_t *synth, guint8 notes[16][NOTES_PER_CHORD])
+{
+  guint channel, i;
+
+  for (channel = 0; channel < 16; channel++) {
+    if (channel == 9)
+      continue;
+    for (i = 0; i < NOTES_PER_CHORD; i++) {
+      if (notes[channel][i])
+	fluid_synth_noteoff (synth, channel, notes[channel][i]);
+      notes[channel][i] = instruments[channel].low + bench_random (
+	  instruments[channel].high - instruments[channel].low + 1);
+      fluid_synth_noteon (synth, channel, notes[channel][i],
+	  40 + bench_random (80));
+    }
+  }
+  /* timpani, bass drum and cymbals */
+  fluid_synth_noteon (synth, 9, 35 + bench_random (2), 100);
+  fluid_synth_noteon (synth, 9, 49 + bench_random (9), 80);
+}
+
+/* renders seconds of music with cores threads, returns FALSE if the
+ * soundfont can't be loaded */
+static gboolean
+bench_render (const gchar *soundfont, guint seconds, gint cores)
+{
+  static float left[PERIOD], right[PERIOD];
+  guint8 notes[16][NOTES_PER_CHORD] = { { 0, } };
+  fluid_settings_t *settings;
+  fluid_synth_t *synth;
+  GTimer *timer;
+  guint periods, i, channel;
+  gint voices, most = 0;
+  gdouble taken;
+
+  settings = new_fluid_settings ();
+  fluid_settings_setnum (settings, "synth.sample-rate", RATE);
+  fluid_settings_setint (settings, "synth.cpu-cores", cores);
+  fluid_settings_setint (settings, "synth.polyphony", POLYPHONY);
+  synth = new_fluid_synth (settings);
+  if (fluid_synth_sfload (synth, soundfont, 1) < 0) {
+    delete_fluid_synth (synth);
+    delete_fluid_settings (settings);
+    return FALSE;
+  }
+  for (channel = 0; channel < 16; channel++) {
+    if (channel != 9)
+      fluid_synth_program_change (synth, channel, instruments[channel].program);
+  }
+
+  seed = 0;
+  periods = (guint64) seconds * RATE / PERIOD;
+  timer = g_timer_new ();
+  for (i = 0; i < periods; i++) {
+    if (i % CHORD_PERIODS == 0)
+      change_chords (synth, notes);
+    fluid_synth_write_float (synth, PERIOD, left, 0, 1, right, 0, 1);
+    voices = fluid_synth_get_active_voice_count (synth);
+    most = MAX (most, voices);
+  }
+  taken = g_timer_elapsed (timer, NULL);
+  g_timer_destroy (timer);
+
+  g_print ("%d\t%d\t%.1f\t%.3f\t%.2f\t%d\n", cores, POLYPHONY,
+      (gdouble) periods * PERIOD / RATE, taken,
+      (gdouble) periods * PERIOD / RATE / taken, most);
+  delete_fluid_synth (synth);
+  delete_fluid_settings (settings);
+  return TRUE;
+}
+
+int
+main (int argc, char **argv)
+{
+  guint seconds = DEFAULT_SECONDS;
+  glong n = 1;
+  gint cores;
+
+  if (argc < 2 || argv[1][0] == '\0') {
+    g_printerr ("usage: %s SOUNDFONT [SECONDS]\n", argv[0]);
+    return 1;
+  }
+  if (argc > 2)
+    seconds = MAX (atoi (argv[2]), 1);
+#if defined (HAVE_UNISTD_H) && defined (_SC_NPROCESSORS_ONLN)
+  n = sysconf (_SC_NPROCESSORS_ONLN);
+#endif
+  n = CLAMP (n, 1, MAX_CORES);
+
+  g_print ("# cores\tpolyphony\trendered\ttaken\trealtime\tvoices\n");
+  /* powers of two and all cores */
+  for (cores = 1; ; cores = MIN (cores * 2, n)) {
+    if (!bench_render (argv[1], seconds, cores)) {
+      g_printerr ("could not load soundfont %s\n", argv[1]);
+      return 1;
+    }
+    if (cores == n)
+      break;
+  }
+
+  return 0;
+}
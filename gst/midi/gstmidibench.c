@@ -0,0 +1,360 @@
+/*
+ * Copyright (C) 2005 Benjamin Otte <otte@gnome.org>
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Library General Public
+ * License as published by the Free Software Foundation; either
+ * version 2 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Library General Public License for more details.
+ *
+ * You should have received a copy of the GNU Library General Public
+ * License along with this library; if not, write to the
+ * Free Software Foundation, Inc., 59 Temple Place - Suite 330,
+ * Boston, MA 02111-1307, USA.
+ */
+
+/* Microbenchmarks for the hot paths of the midi buffer code. Run with
+ * "make bench". Every line of output is one result, with tab separated
+ * fields:
+ *   benchmark  corpus  layout  events  ns/event  events/sec
+ * Benchmarks that don't depend on a layout print "-" as layout. */
+
+#ifdef HAVE_CONFIG_H
+#  include "config.h"
+#endif
+
+#include <gst/gst.h>
+#include "gstmidibuffer.h"
+
+/* number of events in every corpus */
+#define N_EVENTS (100000)
+/* every benchmark is repeated until it ran at least this long */
+#define MIN_SECONDS (0.25)
+/* duration of a tick in the generated streams */
+#define TICK (GST_MSECOND)
+#define N_LAYOUTS (GST_MIDI_LAYOUT_COLUMNAR + 1)
+
+/* data of an event after the status byte */
+#define EVENT_DATA(corpus, event) ((corpus)->data + (event)->offset + \
+    ((corpus)->data[(event)->offset] & 0x80 ? 1 : 0))
+
+typedef struct {
+  guint32		delta;		/* offset of the delta time */
+  guint32		offset;		/* offset of the event after the delta time */
+  guint32		length;		/* length of the data after the status */
+  guint8		status;		/* status of the event, running or not */
+} BenchEvent;
+
+typedef struct {
+  const gchar *		name;
+  guint8 *		data;		/* events in SMF track encoding */
+  guint			size;
+  BenchEvent *		events;
+  guint			n_events;
+  GstClockTime		duration;	/* time of the last event + 1 tick */
+  GstBuffer *		buffers[N_LAYOUTS]; /* the corpus in each layout */
+} BenchCorpus;
+
+typedef void (* CorpusGenerator) (GByteArray *data, guint8 *status);
+
+/* a linear congruential generator, so all runs use the same corpora */
+static guint32 seed;
+
+static guint
+bench_random (guint max)
+{
+  seed = seed * 1103515245 + 12345;
+  return (seed >> 16) % max;
+}
+
+static void
+append_varlen (GByteArray *data, guint32 value)
+{
+  guint8 tmp[4];
+
+  g_byte_array_append (data, tmp, gst_midi_data_write_varlen (tmp, value));
+}
+
+/* note on and off events with status bytes and tiny deltas */
+static void
+generate_dense_notes (GByteArray *data, guint8 *status)
+{
+  guint8 event[3];
+
+  append_varlen (data, bench_random (2));
+  event[0] = (bench_random (2) ? 0x90 : 0x80) | bench_random (16);
+  event[1] = bench_random (128);
+  event[2] = bench_random (128);
+  g_byte_array_append (data, event, 3);
+}
+
+/* controller changes on one channel without any delay */
+static void
+generate_cc_flood (GByteArray *data, guint8 *status)
+{
+  guint8 event[3];
+  guint n = 0;
+
+  append_varlen (data, 0);
+  if (*status != 0xB3)
+    event[n++] = 0xB3;
+  event[n++] = bench_random (128);
+  event[n++] = bench_random (128);
+  g_byte_array_append (data, event, n);
+}
+
+/* sysex messages of up to a few hundred bytes mixed with notes */
+static void
+generate_sysex (GByteArray *data, guint8 *status)
+{
+  guint8 payload[512];
+  guint i, len;
+
+  if (bench_random (4)) {
+    generate_dense_notes (data, status);
+    return;
+  }
+  append_varlen (data, bench_random (200));
+  len = 16 + bench_random (sizeof (payload) - 16);
+  for (i = 0; i < len - 1; i++)
+    payload[i] = bench_random (128);
+  payload[len - 1] = 0xF7;
+  g_byte_array_append (data, (const guint8 *) "\360", 1);
+  append_varlen (data, len);
+  g_byte_array_append (data, payload, len);
+}
+
+/* notes on one channel using running status and note on with velocity 0
+ * instead of note off, with deltas of all lengths */
+static void
+generate_running_status (GByteArray *data, guint8 *status)
+{
+  guint8 event[3];
+  guint n = 0;
+
+  append_varlen (data, bench_random (4) ? bench_random (128) :
+      bench_random (1 << 14) << 7);
+  if (*status != 0x92)
+    event[n++] = 0x92;
+  event[n++] = bench_random (128);
+  event[n++] = bench_random (2) ? bench_random (128) : 0;
+  g_byte_array_append (data, event, n);
+}
+
+static void
+corpus_init (BenchCorpus *corpus, const gchar *name, CorpusGenerator generate)
+{
+  GByteArray *data = g_byte_array_new ();
+  GstMidiBuffer *buf;
+  guint64 ticks = 0;
+  guint i, j, len;
+  guint8 status = 0;
+  gint delta;
+
+  seed = 0;
+  corpus->name = name;
+  corpus->events = g_new (BenchEvent, N_EVENTS);
+  corpus->n_events = N_EVENTS;
+  for (i = 0; i < N_EVENTS; i++) {
+    corpus->events[i].delta = data->len;
+    generate (data, &status);
+    delta = gst_midi_data_parse_varlen (data->data + corpus->events[i].delta,
+	data->len - corpus->events[i].delta, &len);
+    g_assert (delta >= 0);
+    ticks += delta;
+    corpus->events[i].offset = corpus->events[i].delta + len;
+    len = gst_midi_data_get_length (data->data + corpus->events[i].offset,
+	data->len - corpus->events[i].offset, status);
+    g_assert (len > 0);
+    if (data->data[corpus->events[i].offset] & 0x80) {
+      corpus->events[i].status = data->data[corpus->events[i].offset];
+      corpus->events[i].length = len - 1;
+    } else {
+      corpus->events[i].status = status;
+      corpus->events[i].length = len;
+    }
+    if (corpus->events[i].status < 0xF0)
+      status = corpus->events[i].status;
+  }
+  corpus->size = data->len;
+  corpus->data = (guint8 *) g_byte_array_free (data, FALSE);
+  corpus->duration = (ticks + 1) * TICK;
+
+  for (j = 0; j < N_LAYOUTS; j++) {
+    buf = gst_midi_buffer_new_with_layout (0, corpus->duration, j);
+    ticks = 0;
+    for (i = 0; i < corpus->n_events; i++) {
+      BenchEvent *event = &corpus->events[i];
+
+      ticks += gst_midi_data_parse_varlen (corpus->data + event->delta,
+	  event->offset - event->delta, &len);
+      gst_midi_buffer_append_with_status (buf, ticks * TICK, event->status,
+	  EVENT_DATA (corpus, event), event->length);
+    }
+    corpus->buffers[j] = gst_midi_buffer_finish (buf);
+    g_assert (gst_midi_buffer_validate (corpus->buffers[j]));
+  }
+}
+
+static void
+corpus_free (BenchCorpus *corpus)
+{
+  guint i;
+
+  for (i = 0; i < N_LAYOUTS; i++)
+    gst_buffer_unref (corpus->buffers[i]);
+  g_free (corpus->events);
+  g_free (corpus->data);
+}
+
+static void
+report (const gchar *benchmark, const BenchCorpus *corpus, const gchar *layout,
+    guint64 events, gdouble seconds)
+{
+  g_print ("%s\t%s\t%s\t%" G_GUINT64_FORMAT "\t%.2f\t%.0f\n", benchmark,
+      corpus->name, layout, events, seconds * 1e9 / events, events / seconds);
+}
+
+/* the result is printed so the compiler can't optimize the loops away */
+static guint64 sink;
+
+static void
+bench_parse_varlen (const BenchCorpus *corpus)
+{
+  GTimer *timer = g_timer_new ();
+  guint64 events = 0, sum = 0;
+  guint i, len;
+
+  do {
+    for (i = 0; i < corpus->n_events; i++) {
+      const BenchEvent *event = &corpus->events[i];
+
+      sum += gst_midi_data_parse_varlen (corpus->data + event->delta,
+	  corpus->size - event->delta, &len);
+    }
+    events += corpus->n_events;
+  } while (g_timer_elapsed (timer, NULL) < MIN_SECONDS);
+  report ("parse_varlen", corpus, "-", events, g_timer_elapsed (timer, NULL));
+  g_timer_destroy (timer);
+  sink += sum;
+}
+
+static void
+bench_get_length (const BenchCorpus *corpus)
+{
+  GTimer *timer = g_timer_new ();
+  guint64 events = 0, sum = 0;
+  guint i;
+
+  do {
+    for (i = 0; i < corpus->n_events; i++) {
+      const BenchEvent *event = &corpus->events[i];
+
+      sum += gst_midi_data_get_length (corpus->data + event->offset,
+	  corpus->size - event->offset, event->status);
+    }
+    events += corpus->n_events;
+  } while (g_timer_elapsed (timer, NULL) < MIN_SECONDS);
+  report ("get_length", corpus, "-", events, g_timer_elapsed (timer, NULL));
+  g_timer_destroy (timer);
+  sink += sum;
+}
+
+static void
+bench_append (const BenchCorpus *corpus, GstMidiLayout layout)
+{
+  GTimer *timer = g_timer_new ();
+  GstMidiBufferPool *pool = gst_midi_buffer_pool_new ();
+  GstClockTime *times = g_new (GstClockTime, corpus->n_events);
+  GstMidiBuffer *buf;
+  GstMidiIter iter;
+  GstBuffer *out;
+  guint64 events = 0;
+  guint i;
+
+  /* times are taken from the prebuilt buffer, so only appending is measured */
+  gst_midi_iter_init (&iter, corpus->buffers[GST_MIDI_LAYOUT_ABSOLUTE]);
+  for (i = 0; i < corpus->n_events; i++) {
+    times[i] = gst_midi_iter_get_time (&iter);
+    gst_midi_iter_next (&iter);
+  }
+
+  g_timer_start (timer);
+  do {
+    buf = gst_midi_buffer_pool_acquire (pool, 0, corpus->duration, layout);
+    for (i = 0; i < corpus->n_events; i++) {
+      const BenchEvent *event = &corpus->events[i];
+
+      gst_midi_buffer_append_with_status (buf, times[i], event->status,
+	  EVENT_DATA (corpus, event), event->length);
+    }
+    out = gst_midi_buffer_finish (buf);
+    sink += GST_BUFFER_SIZE (out);
+    gst_buffer_unref (out);
+    events += corpus->n_events;
+  } while (g_timer_elapsed (timer, NULL) < MIN_SECONDS);
+  report ("append_with_status", corpus, gst_midi_layout_get_name (layout),
+      events, g_timer_elapsed (timer, NULL));
+  g_timer_destroy (timer);
+  gst_midi_buffer_pool_free (pool);
+  g_free (times);
+}
+
+static void
+bench_iter (const BenchCorpus *corpus, GstMidiLayout layout)
+{
+  GTimer *timer = g_timer_new ();
+  GstMidiIter iter;
+  guint64 events = 0, sum = 0;
+
+  do {
+    gst_midi_iter_init (&iter, corpus->buffers[layout]);
+    if (gst_midi_iter_get_event (&iter)) {
+      do {
+	sum += gst_midi_iter_get_event (&iter)[0];
+	events++;
+      } while (gst_midi_iter_next (&iter));
+    }
+  } while (g_timer_elapsed (timer, NULL) < MIN_SECONDS);
+  report ("iter", corpus, gst_midi_layout_get_name (layout), events,
+      g_timer_elapsed (timer, NULL));
+  g_timer_destroy (timer);
+  sink += sum;
+}
+
+int
+main (int argc, char **argv)
+{
+  static const struct {
+    const gchar *	name;
+    CorpusGenerator	generate;
+  } corpora[] = {
+    { "dense-notes", generate_dense_notes },
+    { "cc-flood", generate_cc_flood },
+    { "sysex", generate_sysex },
+    { "running-status", generate_running_status }
+  };
+  BenchCorpus corpus;
+  guint i, layout;
+
+  gst_init (&argc, &argv);
+
+  g_print ("# benchmark\tcorpus\tlayout\tevents\tns/event\tevents/sec\n");
+  for (i = 0; i < G_N_ELEMENTS (corpora); i++) {
+    corpus_init (&corpus, corpora[i].name, corpora[i].generate);
+    bench_parse_varlen (&corpus);
+    bench_get_length (&corpus);
+    for (layout = 0; layout < N_LAYOUTS; layout++)
+      bench_append (&corpus, layout);
+    for (layout = 0; layout < N_LAYOUTS; layout++)
+      bench_iter (&corpus, layout);
+    corpus_free (&corpus);
+  }
+  g_print ("# checksum %" G_GUINT64_FORMAT "\n", sink);
+
+  return 0;
+}
@@ -26,32 +26,548 @@
 #include "gstmidibuffer.h"
 
 #define DEFAULT_BUFFER_SIZE (16)
+/* maximum size of an event in the buffer: timestamp + status + data */
+#define EVENT_SIZE(len) (8 + 1 + (len))
+#define COMPACT_EVENT_SIZE(len) (10 + 1 + (len))
 
+/* offsets of the columns in a columnar buffer with room for n events */
+#define COLUMNAR_HEADER_SIZE (8)
+#define COLUMNAR_STATUS(n) (COLUMNAR_HEADER_SIZE + 8 * (n))
+#define COLUMNAR_DATA(n) (COLUMNAR_HEADER_SIZE + 9 * (n))
+#define COLUMNAR_SYSTEM(n) (COLUMNAR_HEADER_SIZE + 11 * (n))
+
+/* index of absolute and compact buffers and of columnar buffers with 
+ * system events: entries for every GST_MIDI_INDEX_INTERVAL'th event. It's
+ * kept next to the buffer, not in its data. In columnar buffers the offset
+ * is the one of the next system event. */
+#define INDEX_MIN_EVENTS (4 * GST_MIDI_INDEX_INTERVAL)
+
+typedef struct {
+  guint64		time;		/* time of the event */
+  guint32		offset;		/* offset of the event in the buffer */
+  guint8		status;		/* running status before the event */
+  guint8		padding[3];
+} IndexEntry;
+
+#define C1 1
+#define C2 2
+#define SV GST_MIDI_LENGTH_VARIABLE
+#define SM GST_MIDI_LENGTH_META
+const guint8 gst_midi_status_lengths[256] = {
+  /* 0x00 - 0x7F: data bytes */
+  0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0,
+  0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0,
+  0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0,
+  0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0,
+  0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0,
+  0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0,
+  0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0,
+  0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0,
+  /* 0x80 - 0xBF: note off, note on, key pressure, control change */
+  C2, C2, C2, C2, C2, C2, C2, C2, C2, C2, C2, C2, C2, C2, C2, C2,
+  C2, C2, C2, C2, C2, C2, C2, C2, C2, C2, C2, C2, C2, C2, C2, C2,
+  C2, C2, C2, C2, C2, C2, C2, C2, C2, C2, C2, C2, C2, C2, C2, C2,
+  C2, C2, C2, C2, C2, C2, C2, C2, C2, C2, C2, C2, C2, C2, C2, C2,
+  /* 0xC0 - 0xDF: program change, channel pressure */
+  C1, C1, C1, C1, C1, C1, C1, C1, C1, C1, C1, C1, C1, C1, C1, C1,
+  C1, C1, C1, C1, C1, C1, C1, C1, C1, C1, C1, C1, C1, C1, C1, C1,
+  /* 0xE0 - 0xEF: pitch bend */
+  C2, C2, C2, C2, C2, C2, C2, C2, C2, C2, C2, C2, C2, C2, C2, C2,
+  /* 0xF0 - 0xFF: system, 0xF0 and 0xF7 are sysex, 0xF4 is a sysex reference */
+  SV, SM, SM, SM, SV, SM, SM, SV, SM, SM, SM, SM, SM, SM, SM, SM
+};
+#undef C1
+#undef C2
+#undef SV
+#undef SM
+
+static const gchar *layout_names[] = { "absolute", "compact", "columnar" };
+
+/**
+ * gst_midi_caps_fixate:
+ * @caps: writable midi caps
+ *
+ * Fixates the bufferlength of all structures in @caps to the length nearest
+ * to GST_MIDI_BUFFER_LENGTH_NUM / GST_MIDI_BUFFER_LENGTH_DENOM seconds. 
+ * Elements producing midi buffers use this, so buffers only get a different
+ * length when downstream asks for it.
+ **/
+void
+gst_midi_caps_fixate (GstCaps *caps)
+{
+  guint i;
+
+  g_return_if_fail (caps != NULL);
+
+  for (i = 0; i < gst_caps_get_size (caps); i++) {
+    gst_structure_fixate_field_nearest_fraction (gst_caps_get_structure (caps, i),
+	"bufferlength", GST_MIDI_BUFFER_LENGTH_NUM, GST_MIDI_BUFFER_LENGTH_DENOM);
+  }
+}
+
+/**
+ * gst_midi_buffer_length_from_caps:
+ * @caps: fixed midi caps
+ * @num: set to the numerator of the buffer length
+ * @denom: set to the denominator of the buffer length
+ *
+ * Gets the length in seconds of the buffers with the given @caps. Caps 
+ * without a bufferlength field use the default length.
+ **/
+void
+gst_midi_buffer_length_from_caps (const GstCaps *caps, gint *num, gint *denom)
+{
+  g_return_if_fail (caps != NULL);
+  g_return_if_fail (num != NULL);
+  g_return_if_fail (denom != NULL);
+
+  if (!gst_structure_get_fraction (gst_caps_get_structure (caps, 0), 
+	"bufferlength", num, denom) || *num <= 0) {
+    *num = GST_MIDI_BUFFER_LENGTH_NUM;
+    *denom = GST_MIDI_BUFFER_LENGTH_DENOM;
+  }
+}
+
+/**
+ * gst_midi_layout_from_caps:
+ * @caps: fixed midi caps
+ *
+ * Gets the layout buffers with the given @caps use. Caps without a layout
+ * field use the absolute layout.
+ *
+ * Returns: the layout described by @caps
+ **/
+GstMidiLayout
+gst_midi_layout_from_caps (const GstCaps *caps)
+{
+  const gchar *name;
+  guint i;
+
+  g_return_val_if_fail (caps != NULL, GST_MIDI_LAYOUT_ABSOLUTE);
+
+  name = gst_structure_get_string (gst_caps_get_structure (caps, 0), "layout");
+  if (name == NULL)
+    return GST_MIDI_LAYOUT_ABSOLUTE;
+  for (i = 0; i < G_N_ELEMENTS (layout_names); i++) {
+    if (strcmp (name, layout_names[i]) == 0)
+      return i;
+  }
+  g_return_val_if_reached (GST_MIDI_LAYOUT_ABSOLUTE);
+}
+
+const gchar *
+gst_midi_layout_get_name (GstMidiLayout layout)
+{
+  g_return_val_if_fail (layout < G_N_ELEMENTS (layout_names), NULL);
+
+  return layout_names[layout];
+}
+
+GstMidiLayout
+gst_midi_buffer_get_layout (GstBuffer *buf)
+{
+  g_return_val_if_fail (GST_IS_BUFFER (buf), GST_MIDI_LAYOUT_ABSOLUTE);
+
+  if (GST_BUFFER_FLAG_IS_SET (buf, GST_MIDI_BUFFER_FLAG_COMPACT))
+    return GST_MIDI_LAYOUT_COMPACT;
+  if (GST_BUFFER_FLAG_IS_SET (buf, GST_MIDI_BUFFER_FLAG_COLUMNAR))
+    return GST_MIDI_LAYOUT_COLUMNAR;
+  return GST_MIDI_LAYOUT_ABSOLUTE;
+}
+
+/* varints store 7 bits per byte, least significant first. The high bit 
+ * is set on all but the last byte. */
+static guint
+gst_midi_write_varint (guint8 *dest, guint64 value)
+{
+  guint len = 0;
+
+  while (value >= 0x80) {
+    dest[len++] = (value & 0x7f) | 0x80;
+    value >>= 7;
+  }
+  dest[len++] = value;
+  return len;
+}
+
+static guint
+gst_midi_parse_varint (const guint8 *data, guint maxlen, guint64 *value)
+{
+  guint64 result = 0;
+  guint i;
+
+  for (i = 0; i < MIN (maxlen, 10); i++) {
+    result |= (guint64) (data[i] & 0x7f) << (7 * i);
+    if (!(data[i] & 0x80)) {
+      *value = result;
+      return i + 1;
+    }
+  }
+  return 0;
+}
+
+/* length of the data following status or 0 if it's not complete */
+static inline guint
+gst_midi_data_get_data_length (guint8 status, const guint8 *data, guint maxlen)
+{
+  guint len, skip, varlen_len;
+  gint data_len;
+
+  len = gst_midi_status_get_length (status);
+  if (G_LIKELY (len <= 2))
+    return maxlen >= len ? len : 0;
+
+  /* system event: type byte for meta events, varlen length and data */
+  skip = len == GST_MIDI_LENGTH_META ? 1 : 0;
+  if (maxlen <= skip)
+    return 0;
+  data_len = gst_midi_data_parse_varlen (data + skip, maxlen - skip, &varlen_len);
+  if (data_len < 0 || maxlen - skip - varlen_len < (guint) data_len)
+    return 0;
+  return skip + varlen_len + data_len;
+}
+
+typedef struct _GstMidiEventBuffer GstMidiEventBuffer;
+typedef struct _GstMidiEventBufferClass GstMidiEventBufferClass;
+
+/* The buffers filled by a GstMidiBuffer. They hold references to the 
+ * payloads of sysex events that weren't copied. The data of buffers from a
+ * pool goes back to it when they are freed, the buffers themselves are 
+ * freed as usual, as not all 0.10 versions allow finalize to keep them. */
+struct _GstMidiEventBuffer {
+  GstBuffer		buffer;
+
+  GstMidiBuffer		builder;	/* builder filling this buffer */
+  GPtrArray *		refs;		/* referenced sysex payloads or NULL */
+  IndexEntry *		index;		/* index for seeking or NULL */
+  guint			n_entries;
+};
+
+/* unused data of a pool, the list is kept in the data itself */
+typedef struct _GstMidiPoolBlock GstMidiPoolBlock;
+struct _GstMidiPoolBlock {
+  GstMidiPoolBlock *	next;
+  guint			capacity;	/* bytes allocated */
+};
+
+struct _GstMidiEventBufferClass {
+  GstBufferClass	buffer_class;
+};
+
+struct _GstMidiBufferPool {
+  GMutex *		lock;
+  guint			refcount;	/* owner and every buffer in use */
+  GstMidiPoolBlock *	free;		/* unused data */
+};
+
+#define GST_TYPE_MIDI_EVENT_BUFFER (gst_midi_event_buffer_get_type ())
+static GType gst_midi_event_buffer_get_type (void);
+static GstMiniObjectClass *event_buffer_parent_class = NULL;
+
+/* frees the pool once the last reference is gone */
+static void
+gst_midi_buffer_pool_destroy (GstMidiBufferPool *pool)
+{
+  GstMidiPoolBlock *block;
+
+  while ((block = pool->free) != NULL) {
+    pool->free = block->next;
+    g_free (block);
+  }
+  g_mutex_free (pool->lock);
+  g_free (pool);
+}
+
+static void
+gst_midi_buffer_pool_unref (GstMidiBufferPool *pool)
+{
+  gboolean last;
+
+  g_mutex_lock (pool->lock);
+  last = --pool->refcount == 0;
+  g_mutex_unlock (pool->lock);
+  if (last)
+    gst_midi_buffer_pool_destroy (pool);
+}
+
+static void
+gst_midi_event_buffer_finalize (GstMidiEventBuffer *buf)
+{
+  GstMidiBufferPool *pool = buf->builder.pool;
+  GstBuffer *buffer = GST_BUFFER (buf);
+  GstMidiPoolBlock *block;
+  gboolean last;
+  guint i;
+
+  if (buf->refs) {
+    for (i = 0; i < buf->refs->len; i++)
+      gst_buffer_unref (g_ptr_array_index (buf->refs, i));
+    g_ptr_array_free (buf->refs, TRUE);
+  }
+  g_free (buf->index);
+  if (pool == NULL)
+    goto free;
+
+  /* the data goes back unless it's too small to hold the list */
+  block = (GstMidiPoolBlock *) buffer->malloc_data;
+  if (buf->builder.capacity < sizeof (GstMidiPoolBlock))
+    block = NULL;
+  /* the check and putting the data back happen at once, so either the
+   * data goes back or this frees the pool */
+  g_mutex_lock (pool->lock);
+  last = --pool->refcount == 0;
+  if (!last && block) {
+    block->next = pool->free;
+    block->capacity = buf->builder.capacity;
+    pool->free = block;
+    buffer->malloc_data = NULL;
+  }
+  g_mutex_unlock (pool->lock);
+  if (last)
+    gst_midi_buffer_pool_destroy (pool);
+
+free:
+  event_buffer_parent_class->finalize (GST_MINI_OBJECT (buf));
+}
+
+/* Copies keep the layout and the sysex payloads, the default copy would
+ * make a plain buffer that reads as absolute events. The index is left 
+ * behind and the copy is not validated, as it's made to be modified. */
+static GstMidiEventBuffer *
+gst_midi_event_buffer_copy (GstMidiEventBuffer *buf)
+{
+  GstBuffer *buffer = GST_BUFFER (buf);
+  GstMidiEventBuffer *copy;
+  GstBuffer *copy_buffer;
+  guint size, i;
+
+  size = buffer->size;
+  copy = (GstMidiEventBuffer *) gst_mini_object_new (GST_TYPE_MIDI_EVENT_BUFFER);
+  copy_buffer = GST_BUFFER (copy);
+  copy->refs = NULL;
+  copy->index = NULL;
+  copy->n_entries = 0;
+  if (buf->refs) {
+    copy->refs = g_ptr_array_sized_new (buf->refs->len);
+    for (i = 0; i < buf->refs->len; i++)
+      g_ptr_array_add (copy->refs, 
+	  gst_buffer_ref (g_ptr_array_index (buf->refs, i)));
+  }
+  copy->builder.buffer = copy_buffer;
+  copy->builder.capacity = size;
+  copy->builder.layout = gst_midi_buffer_get_layout (buffer);
+  copy->builder.pool = NULL;
+
+  GST_BUFFER_FLAGS (copy_buffer) = GST_BUFFER_FLAGS (buffer) & 
+      (GST_BUFFER_FLAG_PREROLL | GST_BUFFER_FLAG_IN_CAPS | 
+       GST_BUFFER_FLAG_DELTA_UNIT | GST_BUFFER_FLAG_DISCONT | 
+       GST_BUFFER_FLAG_GAP | GST_MIDI_BUFFER_FLAG_COMPACT | 
+       GST_MIDI_BUFFER_FLAG_COLUMNAR);
+  copy_buffer->malloc_data = g_memdup (buffer->data, size);
+  copy_buffer->data = copy_buffer->malloc_data;
+  copy_buffer->size = size;
+  copy_buffer->timestamp = buffer->timestamp;
+  copy_buffer->duration = buffer->duration;
+  copy_buffer->offset = buffer->offset;
+  copy_buffer->offset_end = buffer->offset_end;
+  if (GST_BUFFER_CAPS (buffer))
+    gst_buffer_set_caps (copy_buffer, GST_BUFFER_CAPS (buffer));
+
+  return copy;
+}
+
+static void
+gst_midi_event_buffer_class_init (gpointer g_class, gpointer class_data)
+{
+  GstMiniObjectClass *mini_object_class = GST_MINI_OBJECT_CLASS (g_class);
+
+  event_buffer_parent_class = g_type_class_peek_parent (g_class);
+
+  mini_object_class->copy = 
+      (GstMiniObjectCopyFunction) gst_midi_event_buffer_copy;
+  mini_object_class->finalize = 
+      (GstMiniObjectFinalizeFunction) gst_midi_event_buffer_finalize;
+}
+
+static GType
+gst_midi_event_buffer_get_type (void)
+{
+  static GType event_buffer_type = 0;
+
+  if (!event_buffer_type) {
+    static const GTypeInfo event_buffer_info = {
+      sizeof (GstMidiEventBufferClass),
+      NULL,
+      NULL,
+      gst_midi_event_buffer_class_init,
+      NULL,
+      NULL,
+      sizeof (GstMidiEventBuffer),
+      0,
+      NULL,
+    };
+
+    event_buffer_type = g_type_register_static (GST_TYPE_BUFFER, 
+	"GstMidiEventBuffer", &event_buffer_info, 0);
+  }
+  return event_buffer_type;
+}
+
+static void
+gst_midi_buffer_grow (GstMidiBuffer *buf, guint size)
+{
+  GstBuffer *buffer = buf->buffer;
+  guint capacity = MAX (buf->capacity, DEFAULT_BUFFER_SIZE);
+
+  while (capacity < size)
+    capacity *= 2;
+  if (capacity == buf->capacity)
+    return;
+
+  buffer->malloc_data = g_realloc (buffer->malloc_data, capacity);
+  buffer->data = buffer->malloc_data;
+  buf->capacity = capacity;
+}
+
+/* moves the columns of a columnar buffer holding n_events from the
+ * positions for room of @from events to the positions for room of @to */
+static void
+gst_midi_buffer_move_columns (guint8 *data, guint n_events, guint from, 
+    guint to, guint system_size)
+{
+  if (to > from) {
+    memmove (data + COLUMNAR_SYSTEM (to), data + COLUMNAR_SYSTEM (from), system_size);
+    memmove (data + COLUMNAR_DATA (to), data + COLUMNAR_DATA (from), 2 * n_events);
+    memmove (data + COLUMNAR_STATUS (to), data + COLUMNAR_STATUS (from), n_events);
+  } else if (to < from) {
+    memmove (data + COLUMNAR_STATUS (to), data + COLUMNAR_STATUS (from), n_events);
+    memmove (data + COLUMNAR_DATA (to), data + COLUMNAR_DATA (from), 2 * n_events);
+    memmove (data + COLUMNAR_SYSTEM (to), data + COLUMNAR_SYSTEM (from), system_size);
+  }
+}
+
+static void
+gst_midi_buffer_grow_columns (GstMidiBuffer *buf, guint n_alloc)
+{
+  GstBuffer *buffer = buf->buffer;
+  guint system_size = buffer->size - COLUMNAR_SYSTEM (buf->n_alloc);
+
+  gst_midi_buffer_grow (buf, COLUMNAR_SYSTEM (n_alloc) + system_size);
+  gst_midi_buffer_move_columns (buffer->data, buf->n_events, buf->n_alloc, 
+      n_alloc, system_size);
+  buf->n_alloc = n_alloc;
+  buffer->size = COLUMNAR_SYSTEM (n_alloc) + system_size;
+}
+
+/* sets up buf to fill buffer, keeping the data buffer already has */
+static void
+gst_midi_buffer_init (GstMidiBuffer *buf, GstBuffer *buffer, 
+    GstClockTime timestamp, GstClockTime duration, GstMidiLayout layout)
+{
+  buf->buffer = buffer;
+  buffer->timestamp = timestamp;
+  buffer->duration = duration;
+  if (layout == GST_MIDI_LAYOUT_COMPACT)
+    GST_BUFFER_FLAG_SET (buffer, GST_MIDI_BUFFER_FLAG_COMPACT);
+  else if (layout == GST_MIDI_LAYOUT_COLUMNAR)
+    GST_BUFFER_FLAG_SET (buffer, GST_MIDI_BUFFER_FLAG_COLUMNAR);
+  buf->layout = layout;
+  buf->last = timestamp;
+  buf->status = 0;
+  buf->n_events = 0;
+  buf->n_alloc = 0;
+  gst_midi_buffer_grow (buf, DEFAULT_BUFFER_SIZE);
+  if (layout == GST_MIDI_LAYOUT_COLUMNAR)
+    buffer->size = COLUMNAR_HEADER_SIZE;
+}
+
+/**
+ * gst_midi_buffer_new:
+ * @timestamp: start time of the buffer
+ * @duration: duration of the buffer
+ *
+ * Starts building a new buffer of midi events. Events must be appended in
+ * increasing time order and lie inside the given time range. When done,
+ * call gst_midi_buffer_finish() to get the resulting #GstBuffer.
+ *
+ * Returns: a new #GstMidiBuffer
+ **/
 GstMidiBuffer *	
 gst_midi_buffer_new (GstClockTime timestamp, GstClockTime duration)
 {
+  return gst_midi_buffer_new_with_layout (timestamp, duration,
+      GST_MIDI_LAYOUT_ABSOLUTE);
+}
+
+/**
+ * gst_midi_buffer_new_with_layout:
+ * @timestamp: start time of the buffer
+ * @duration: duration of the buffer
+ * @layout: layout to write the events in
+ *
+ * Like gst_midi_buffer_new(), but the events are written using @layout.
+ * Use the layout that was negotiated with the downstream element.
+ *
+ * Returns: a new #GstMidiBuffer
+ **/
+GstMidiBuffer *	
+gst_midi_buffer_new_with_layout (GstClockTime timestamp, GstClockTime duration,
+    GstMidiLayout layout)
+{
+  GstMidiEventBuffer *buffer;
+  GstMidiBuffer *buf;
+
   g_return_val_if_fail (GST_CLOCK_TIME_IS_VALID (timestamp), NULL);
   g_return_val_if_fail (GST_CLOCK_TIME_IS_VALID (duration), NULL);
+  g_return_val_if_fail (layout < G_N_ELEMENTS (layout_names), NULL);
 
-  GstBuffer *buf = gst_buffer_new_and_alloc (DEFAULT_BUFFER_SIZE);
-  buf->size = 0;
-  buf->timestamp = timestamp;
-  buf->duration = duration;
+  buffer = (GstMidiEventBuffer *) gst_mini_object_new (GST_TYPE_MIDI_EVENT_BUFFER);
+  buffer->refs = NULL;
+  buffer->index = NULL;
+  buffer->n_entries = 0;
+  buf = &buffer->builder;
+  buf->capacity = 0;
+  buf->pool = NULL;
+  gst_midi_buffer_init (buf, GST_BUFFER (buffer), timestamp, duration, layout);
   
   return buf;
 }
 
+/**
+ * gst_midi_buffer_reserve:
+ * @buf: buffer to reserve space in
+ * @size: number of bytes that are going to be appended
+ *
+ * Makes sure at least @size more bytes can be appended to @buf without
+ * reallocating. Use this when the amount of data is known in advance.
+ * For columnar buffers, room for @size bytes worth of channel events is 
+ * reserved in the columns.
+ **/
+void
+gst_midi_buffer_reserve (GstMidiBuffer *buf, guint size)
+{
+  g_return_if_fail (buf != NULL);
+
+  if (buf->layout == GST_MIDI_LAYOUT_COLUMNAR) {
+    guint n_alloc = buf->n_events + size / (COLUMNAR_SYSTEM (1) - COLUMNAR_HEADER_SIZE);
+
+    if (n_alloc > buf->n_alloc)
+      gst_midi_buffer_grow_columns (buf, n_alloc);
+  } else if (buf->buffer->size + size > buf->capacity)
+    gst_midi_buffer_grow (buf, buf->buffer->size + size);
+}
+
 /* FIXME: need len here or should this be parsed automagically? */
 void
 gst_midi_buffer_append (GstMidiBuffer *buf, GstClockTime time, 
     const guint8 *data, guint len)
 {
-  g_return_if_fail (GST_IS_BUFFER (buf));
+  g_return_if_fail (buf != NULL);
   g_return_if_fail (data != NULL);
   g_return_if_fail (data[0] & 0x80);
   g_return_if_fail (len > 1);
-  g_return_if_fail (buf->timestamp <= time);
-  g_return_if_fail (time < buf->timestamp + buf->duration);
+  g_return_if_fail (GST_MIDI_BUFFER_TIMESTAMP (buf) <= time);
+  g_return_if_fail (time < GST_MIDI_BUFFER_TIMESTAMP (buf) + GST_MIDI_BUFFER_DURATION (buf));
 
   gst_midi_buffer_append_with_status (buf, time, data[0], data + 1, len - 1);
 }
@@ -60,29 +576,309 @@ void
 gst_midi_buffer_append_with_status (GstMidiBuffer *buf, GstClockTime time,
     guint8 status, const guint8 *data, guint len)
 {
-  g_return_if_fail (GST_IS_BUFFER (buf));
+  GstBuffer *buffer;
+  guint8 *dest;
+
+  g_return_if_fail (buf != NULL);
   g_return_if_fail (status & 0x80);
   g_return_if_fail (data != NULL);
   g_return_if_fail (len > 0);
-  g_return_if_fail (buf->timestamp <= time);
-  g_return_if_fail (time < buf->timestamp + buf->duration);
+  g_return_if_fail (buf->last <= time);
+  g_return_if_fail (time < GST_MIDI_BUFFER_TIMESTAMP (buf) + GST_MIDI_BUFFER_DURATION (buf));
+  /* the finished buffer is marked as valid, so don't append broken events */
+  g_return_if_fail (status >= 0xF0 || !(data[0] & 0x80));
+  g_return_if_fail (gst_midi_data_get_data_length (status, data, len) == len);
 
-  gint oldsize=buf->size;
-  buf->size = buf->size + len + 9;
-  if ( oldsize )
-	  buf->data = g_realloc (buf->data,buf->size);
-  else
-	  buf->data = g_malloc (buf->size);
+  buffer = buf->buffer;
+  if (buf->layout == GST_MIDI_LAYOUT_COMPACT) {
+    if (buffer->size + COMPACT_EVENT_SIZE (len) > buf->capacity)
+      gst_midi_buffer_grow (buf, buffer->size + COMPACT_EVENT_SIZE (len));
+
+    dest = buffer->data + buffer->size;
+    dest += gst_midi_write_varint (dest, time - buf->last);
+    if (status >= 0xF0) {
+      /* system events cancel running status */
+      *dest++ = status;
+      buf->status = 0;
+    } else if (status != buf->status) {
+      *dest++ = status;
+      buf->status = status;
+    }
+    memcpy (dest, data, len);
+    buffer->size = dest + len - buffer->data;
+  } else if (buf->layout == GST_MIDI_LAYOUT_COLUMNAR) {
+    guint n = buf->n_events;
 
-  GST_WRITE_UINT64_BE (buf->data + oldsize, time);
-  buf->data[oldsize + 8] = status;
-  memcpy (buf->data + oldsize + 9, data, len);
+
+    if (n == buf->n_alloc)
+      gst_midi_buffer_grow_columns (buf, MAX (DEFAULT_BUFFER_SIZE, 2 * n));
+    if (status >= 0xF0 && buffer->size + 1 + len > buf->capacity)
+      gst_midi_buffer_grow (buf, buffer->size + 1 + len);
+
+    dest = buffer->data;
+    ((GstClockTime *) (dest + COLUMNAR_HEADER_SIZE))[n] = time;
+    dest[COLUMNAR_STATUS (buf->n_alloc) + n] = status;
+    dest += COLUMNAR_DATA (buf->n_alloc) + 2 * n;
+    if (status >= 0xF0) {
+      dest[0] = dest[1] = 0;
+      dest = buffer->data + buffer->size;
+      dest[0] = status;
+      memcpy (dest + 1, data, len);
+      buffer->size += 1 + len;
+    } else {
+      dest[0] = data[0];
+      dest[1] = len > 1 ? data[1] : 0;
+    }
+  } else {
+    if (buffer->size + EVENT_SIZE (len) > buf->capacity)
+      gst_midi_buffer_grow (buf, buffer->size + EVENT_SIZE (len));
+
+    dest = buffer->data + buffer->size;
+    GST_WRITE_UINT64_BE (dest, time);
+    dest[8] = status;
+    memcpy (dest + 9, data, len);
+    buffer->size += EVENT_SIZE (len);
+  }
+  buf->last = time;
+  buf->n_events++;
 }
 
+/* sysex payloads smaller than this are copied, references aren't worth it */
+#define SYSEX_REF_MIN_SIZE (64)
+/* data of a GST_MIDI_SYSEX_REF event: length, status and index */
+#define SYSEX_REF_SIZE (6)
+
+/**
+ * gst_midi_buffer_append_sysex:
+ * @buf: buffer to append to
+ * @time: time of the event
+ * @status: 0xF0 for a sysex message or 0xF7 for an escaped one
+ * @payload: data of the event following the status
+ *
+ * Appends a sysex event. Unless it is very small, @payload isn't copied into
+ * @buf. Instead a reference to it is kept until the resulting buffer is
+ * freed. Get the payload with gst_midi_buffer_get_sysex().
+ **/
+void
+gst_midi_buffer_append_sysex (GstMidiBuffer *buf, GstClockTime time, 
+    guint8 status, GstBuffer *payload)
+{
+  GstMidiEventBuffer *buffer;
+  guint8 data[4 + SYSEX_REF_MIN_SIZE];
+  guint len;
+
+  g_return_if_fail (buf != NULL);
+  g_return_if_fail (status == 0xF0 || status == 0xF7);
+  g_return_if_fail (GST_IS_BUFFER (payload));
+  g_return_if_fail (GST_BUFFER_SIZE (payload) < (1 << 28));
+
+  if (GST_BUFFER_SIZE (payload) < SYSEX_REF_MIN_SIZE) {
+    len = gst_midi_data_write_varlen (data, GST_BUFFER_SIZE (payload));
+    memcpy (data + len, GST_BUFFER_DATA (payload), GST_BUFFER_SIZE (payload));
+    gst_midi_buffer_append_with_status (buf, time, status, data, 
+	len + GST_BUFFER_SIZE (payload));
+    return;
+  }
+
+  buffer = (GstMidiEventBuffer *) buf->buffer;
+  if (buffer->refs == NULL)
+    buffer->refs = g_ptr_array_new ();
+  data[0] = SYSEX_REF_SIZE - 1;
+  data[1] = status;
+  GST_WRITE_UINT32_LE (data + 2, buffer->refs->len);
+  gst_midi_buffer_append_with_status (buf, time, GST_MIDI_SYSEX_REF, data, 
+      SYSEX_REF_SIZE);
+  g_ptr_array_add (buffer->refs, gst_buffer_ref (payload));
+}
+
+/* builds the index of a finished buffer */
+static void
+gst_midi_buffer_write_index (GstMidiBuffer *buf)
+{
+  GstMidiEventBuffer *event_buffer = (GstMidiEventBuffer *) buf->buffer;
+  GstBuffer *buffer = buf->buffer;
+  guint n_entries, i;
+  IndexEntry *entries;
+  GstMidiIter iter;
+  guint8 status;
+
+  n_entries = (buf->n_events + GST_MIDI_INDEX_INTERVAL - 1) / GST_MIDI_INDEX_INTERVAL;
+  entries = g_new (IndexEntry, n_entries);
+
+  gst_midi_iter_init (&iter, buffer);
+  status = 0;
+  for (i = 0; iter.event != NULL; i++) {
+    if (i % GST_MIDI_INDEX_INTERVAL == 0) {
+      IndexEntry *entry = &entries[i / GST_MIDI_INDEX_INTERVAL];
+
+      entry->time = iter.time;
+      entry->offset = iter.data - buffer->data;
+      entry->status = status;
+      memset (entry->padding, 0, sizeof (entry->padding));
+    }
+    status = iter.status;
+    gst_midi_iter_next (&iter);
+  }
+  event_buffer->index = entries;
+  event_buffer->n_entries = n_entries;
+}
+
+/**
+ * gst_midi_buffer_finish:
+ * @buf: buffer to finish
+ *
+ * Finishes building @buf. If a lot of the allocated space is unused, the
+ * data is shrunk to fit, otherwise the storage is handed over as is.
+ * @buf is freed. The returned buffer is marked as validated. Absolute and
+ * compact buffers with many events get an index for 
+ * gst_midi_iter_seek_time(), which is kept outside of the buffer's data.
+ *
+ * Returns: the #GstBuffer containing all appended events
+ **/
 GstBuffer *
 gst_midi_buffer_finish (GstMidiBuffer *buf)
 {
-  return buf;
+  GstBuffer *buffer;
+
+  g_return_val_if_fail (buf != NULL, NULL);
+
+  buffer = buf->buffer;
+  if (buf->layout == GST_MIDI_LAYOUT_COLUMNAR) {
+    guint system_size = buffer->size - COLUMNAR_SYSTEM (buf->n_alloc);
+
+    if (buf->n_events == 0) {
+      buffer->size = 0;
+    } else {
+      gst_midi_buffer_move_columns (buffer->data, buf->n_events, buf->n_alloc,
+	  buf->n_events, system_size);
+      ((guint32 *) buffer->data)[0] = buf->n_events;
+      ((guint32 *) buffer->data)[1] = system_size;
+      buffer->size = COLUMNAR_SYSTEM (buf->n_events) + system_size;
+      /* seeking needs to know where the system events are */
+      if (system_size > 0 && buf->n_events >= INDEX_MIN_EVENTS)
+	gst_midi_buffer_write_index (buf);
+    }
+  } else if (buf->n_events >= INDEX_MIN_EVENTS) {
+    gst_midi_buffer_write_index (buf);
+  }
+  GST_BUFFER_FLAG_SET (buffer, GST_MIDI_BUFFER_FLAG_VALID);
+  /* pooled buffers keep their data for the next round */
+  if (buf->pool)
+    return buffer;
+
+  if (buffer->size == 0) {
+    g_free (buffer->malloc_data);
+    buffer->malloc_data = NULL;
+    buffer->data = NULL;
+  } else if (buf->capacity - buffer->size > buffer->size / 4) {
+    buffer->malloc_data = g_realloc (buffer->malloc_data, buffer->size);
+    buffer->data = buffer->malloc_data;
+  }
+
+  return buffer;
+}
+
+/**
+ * gst_midi_buffer_free:
+ * @buf: buffer to free
+ *
+ * Discards @buf and all events that were appended to it.
+ **/
+void
+gst_midi_buffer_free (GstMidiBuffer *buf)
+{
+  g_return_if_fail (buf != NULL);
+
+  /* the builder is part of the buffer */
+  gst_buffer_unref (buf->buffer);
+}
+
+/*** buffer pool ***/
+
+/**
+ * gst_midi_buffer_pool_new:
+ *
+ * Creates a pool of midi buffers. The memory of buffers acquired from the
+ * pool returns to it when they are not used anymore, so once enough buffers
+ * have been around, no more memory for events needs to be allocated.
+ *
+ * Returns: a new #GstMidiBufferPool
+ **/
+GstMidiBufferPool *
+gst_midi_buffer_pool_new (void)
+{
+  GstMidiBufferPool *pool;
+
+  pool = g_new (GstMidiBufferPool, 1);
+  pool->lock = g_mutex_new ();
+  pool->refcount = 1;
+  pool->free = NULL;
+
+  return pool;
+}
+
+/**
+ * gst_midi_buffer_pool_free:
+ * @pool: pool to free
+ *
+ * Frees @pool. Buffers from @pool that are still in use stay valid, the pool
+ * goes away when the last of them is unreffed.
+ **/
+void
+gst_midi_buffer_pool_free (GstMidiBufferPool *pool)
+{
+  g_return_if_fail (pool != NULL);
+
+  gst_midi_buffer_pool_unref (pool);
+}
+
+/**
+ * gst_midi_buffer_pool_acquire:
+ * @pool: pool to take the buffer from
+ * @timestamp: start time of the buffer
+ * @duration: duration of the buffer
+ * @layout: layout to write the events in
+ *
+ * Like gst_midi_buffer_new_with_layout(), but reuses the memory of a buffer
+ * from @pool that isn't in use anymore if there is one.
+ *
+ * Returns: a #GstMidiBuffer
+ **/
+GstMidiBuffer *
+gst_midi_buffer_pool_acquire (GstMidiBufferPool *pool, GstClockTime timestamp,
+    GstClockTime duration, GstMidiLayout layout)
+{
+  GstMidiEventBuffer *buf;
+  GstMidiPoolBlock *block;
+
+  g_return_val_if_fail (pool != NULL, NULL);
+  g_return_val_if_fail (GST_CLOCK_TIME_IS_VALID (timestamp), NULL);
+  g_return_val_if_fail (GST_CLOCK_TIME_IS_VALID (duration), NULL);
+  g_return_val_if_fail (layout < G_N_ELEMENTS (layout_names), NULL);
+
+  g_mutex_lock (pool->lock);
+  block = pool->free;
+  if (block)
+    pool->free = block->next;
+  pool->refcount++;
+  g_mutex_unlock (pool->lock);
+
+  buf = (GstMidiEventBuffer *) gst_mini_object_new (GST_TYPE_MIDI_EVENT_BUFFER);
+  buf->refs = NULL;
+  buf->index = NULL;
+  buf->n_entries = 0;
+  if (block) {
+    buf->builder.capacity = block->capacity;
+    GST_BUFFER_MALLOCDATA (buf) = (guint8 *) block;
+    GST_BUFFER_DATA (buf) = GST_BUFFER_MALLOCDATA (buf);
+  } else {
+    buf->builder.capacity = 0;
+  }
+  buf->builder.pool = pool;
+  gst_midi_buffer_init (&buf->builder, GST_BUFFER (buf), timestamp, duration, 
+      layout);
+
+  return &buf->builder;
 }
 
 /**
@@ -100,33 +896,36 @@ gst_midi_buffer_finish (GstMidiBuffer *buf)
 gint
 gst_midi_data_parse_varlen (const guint8 *data, guint maxlen, guint *len)
 {
-  gint value;
+  guint32 value, more;
+  guint n;
   
-  if (maxlen == 0) return -1;
-  
-  value = data[0] & 0x7f;
-  if (data[0] & 0x80) {
-    if (maxlen < 2) return -1;
-    value = (value << 7) + (data[1] & 0x7f);
-    if (data[1] & 0x80) {
-      if (maxlen < 3) return -1;
-      value = (value << 7) + (data[2] & 0x7f);
-      if (data[2] & 0x80) {
-	if (maxlen < 4) return -1;
-	if (data[3] & 0x80) return -2;
-	value = (value << 7) + (data[3] & 0x7f);
-	if (len)
-	  *len = 4;
-      } else if (len) {
-	*len = 3;
-      }
-    } else if (len) {
-      *len = 2;
+  if (G_LIKELY (maxlen >= 4)) {
+    /* look at all 4 possible bytes at once: the number of bytes is one more 
+     * than the number of leading bytes with the continuation bit set */
+    value = GST_READ_UINT32_BE (data);
+    more = value & (value << 8) & (value << 16);
+    n = 1 + (value >> 31) + ((value & (value << 8)) >> 31) + (more >> 31);
+    if (G_UNLIKELY (n > 3 && (more & (value << 24) & 0x80000000)))
+      return -2;
+    value = (value >> (32 - 8 * n)) & 0x7F7F7F7F;
+    value = (value & 0x7F) | ((value >> 1) & 0x3F80) | 
+	((value >> 2) & 0x1FC000) | ((value >> 3) & 0xFE00000);
+    if (len)
+      *len = n;
+    return value;
+  }
+
+  /* short data, go byte by byte */
+  value = 0;
+  for (n = 0; n < maxlen; n++) {
+    value = (value << 7) | (data[n] & 0x7F);
+    if (!(data[n] & 0x80)) {
+      if (len)
+	*len = n + 1;
+      return value;
     }
-  } else if (len) {
-    *len = 1;
   }
-  return value;
+  return -1;
 }
 
 /**
@@ -146,8 +945,7 @@ gst_midi_data_parse_varlen (const guint8 *data, guint maxlen, guint *len)
 guint
 gst_midi_data_get_length (const guint8 *data, guint maxlen, guint8 status)
 {
-  guint len, varlen_len;
-  gint data_len;
+  guint len, data_len;
   
   g_return_val_if_fail (data != NULL, 0);
   g_return_val_if_fail (status == 0 || (status & 0x80), 0);
@@ -164,48 +962,172 @@ gst_midi_data_get_length (const guint8 *data, guint maxlen, guint8 status)
     /* no status present, error */
     return 0;
   }
-  switch (status >> 4) {
-    case 8:
-    case 9:
-    case 10:
-    case 11:
-    case 14:
-      if (maxlen < 2)
-	return 0;
-      len += 2;
-      break;
-    case 12:
-    case 13:
-      if (maxlen < 1)
-	return 0;
-      len += 1;
-      break;
-    case 15:
-      if (maxlen < 2)
-	return 0;
-      data++;
-      maxlen--;
-      data_len = gst_midi_data_parse_varlen (data, maxlen, &varlen_len);
-      if (maxlen < (guint) data_len + varlen_len)
-	return 0;
-      len += (guint) data_len + varlen_len + 1;
-      break;
-    default:
-      /* should be checked above */
-      g_assert_not_reached();
-      break;
-  }
+  data_len = gst_midi_data_get_data_length (status, data, maxlen);
+  if (data_len == 0)
+    return 0;
+  return len + data_len;
+}
+
+/**
+ * gst_midi_data_write_varlen:
+ * @data: data to write to, must have room for 4 bytes
+ * @value: value to write, must fit into 28 bits
+ *
+ * Writes @value as a variable length midi value using as few bytes as 
+ * possible.
+ *
+ * Returns: the number of bytes written
+ **/
+guint
+gst_midi_data_write_varlen (guint8 *data, guint32 value)
+{
+  guint len, i;
+
+  g_return_val_if_fail (value < (1 << 28), 0);
+
+  for (len = 1; len < 4 && (value >> (7 * len)) != 0; len++);
+  for (i = 0; i < len; i++)
+    data[i] = ((value >> (7 * (len - 1 - i))) & 0x7F) | (i + 1 < len ? 0x80 : 0);
   return len;
 }
 
+/* decodes the event at iter->data, updating time, event and length */
+static gboolean
+gst_midi_iter_decode (GstMidiIter *iter)
+{
+  const guint8 *data = iter->data;
+  guint maxlen = iter->end - data;
+  guint64 delta;
+  guint len, varint_len;
+
+  if (iter->layout == GST_MIDI_LAYOUT_COLUMNAR) {
+    guint8 status = iter->statuses[iter->index];
+
+    iter->time = iter->times[iter->index];
+    if (status >= 0xF0) {
+      len = gst_midi_data_get_length (data, maxlen, 0);
+      if (len == 0 || data[0] != status)
+	return FALSE;
+      iter->event = data;
+      iter->length = len;
+    } else {
+      if (!(status & 0x80))
+	return FALSE;
+      iter->scratch[0] = status;
+      iter->scratch[1] = iter->values[2 * iter->index];
+      iter->scratch[2] = iter->values[2 * iter->index + 1];
+      iter->event = iter->scratch;
+      iter->length = 0;
+    }
+  } else if (iter->layout == GST_MIDI_LAYOUT_COMPACT) {
+    varint_len = gst_midi_parse_varint (data, maxlen, &delta);
+    if (varint_len == 0)
+      return FALSE;
+    data += varint_len;
+    maxlen -= varint_len;
+    if (maxlen == 0)
+      return FALSE;
+    len = gst_midi_data_get_length (data, maxlen, iter->status);
+    if (len == 0)
+      return FALSE;
+    if (data[0] & 0x80) {
+      iter->event = data;
+      iter->status = data[0] < 0xF0 ? data[0] : 0;
+    } else {
+      /* status was omitted, reconstruct the complete event */
+      iter->scratch[0] = iter->status;
+      memcpy (iter->scratch + 1, data, len);
+      iter->event = iter->scratch;
+    }
+    iter->time += delta;
+    iter->length = varint_len + len;
+  } else {
+    if (maxlen <= 8)
+      return FALSE;
+    len = gst_midi_data_get_length (data + 8, maxlen - 8, 0);
+    if (len == 0)
+      return FALSE;
+    iter->time = GST_READ_UINT64_BE (data);
+    iter->event = data + 8;
+    iter->length = 8 + len;
+  }
+  return TRUE;
+}
+
+/* marks the iterator as being past the last event */
+static void
+gst_midi_iter_set_done (GstMidiIter *iter)
+{
+  iter->data = iter->end;
+  iter->time = GST_CLOCK_TIME_NONE;
+  iter->event = NULL;
+  iter->length = 0;
+}
+
+/* sets up the iterator and decodes the first event */
+static gboolean
+gst_midi_iter_setup (GstMidiIter *iter, GstBuffer *buf)
+{
+  iter->buf = buf;
+  iter->data = buf->data;
+  iter->end = buf->data + buf->size;
+  iter->layout = gst_midi_buffer_get_layout (buf);
+  iter->valid = GST_BUFFER_FLAG_IS_SET (buf, GST_MIDI_BUFFER_FLAG_VALID);
+  iter->time = buf->timestamp;
+  iter->status = 0;
+  iter->index = 0;
+  iter->n_events = 0;
+  iter->entries = NULL;
+  iter->n_entries = 0;
+  if (G_TYPE_FROM_INSTANCE (buf) == GST_TYPE_MIDI_EVENT_BUFFER) {
+    iter->entries = (const guint8 *) ((GstMidiEventBuffer *) buf)->index;
+    iter->n_entries = ((GstMidiEventBuffer *) buf)->n_entries;
+  }
+  if (iter->layout == GST_MIDI_LAYOUT_COLUMNAR && buf->size > 0) {
+    guint size = buf->size;
+
+    if (size < COLUMNAR_HEADER_SIZE)
+      return FALSE;
+    iter->n_events = ((const guint32 *) buf->data)[0];
+    if (iter->n_events > (size - COLUMNAR_HEADER_SIZE) / 11 ||
+	size - COLUMNAR_SYSTEM (iter->n_events) != ((const guint32 *) buf->data)[1])
+      return FALSE;
+    iter->times = (const GstClockTime *) (buf->data + COLUMNAR_HEADER_SIZE);
+    iter->statuses = buf->data + COLUMNAR_STATUS (iter->n_events);
+    iter->values = buf->data + COLUMNAR_DATA (iter->n_events);
+    iter->data = buf->data + COLUMNAR_SYSTEM (iter->n_events);
+    if (iter->n_events == 0) {
+      gst_midi_iter_set_done (iter);
+      return TRUE;
+    }
+  } else if (iter->data == iter->end) {
+    gst_midi_iter_set_done (iter);
+    return TRUE;
+  }
+  return gst_midi_iter_decode (iter);
+}
+
+/**
+ * gst_midi_iter_init:
+ * @iter: iterator to initialize
+ * @buf: buffer containing midi events
+ *
+ * Initializes @iter to point to the first event in @buf. All layouts are 
+ * supported. If @buf contains no events, gst_midi_iter_get_time() will
+ * return #GST_CLOCK_TIME_NONE and gst_midi_iter_get_event() NULL.
+ * Iterating buffers that were validated with gst_midi_buffer_validate() 
+ * skips all checks unless #GST_MIDI_EXTRA_CHECKS is defined.
+ **/
 void
 gst_midi_iter_init (GstMidiIter *iter, GstBuffer *buf)
 {
   g_return_if_fail (iter != NULL);
   g_return_if_fail (GST_IS_BUFFER (buf));
 
-  iter->buf = buf;
-  iter->data = buf->data;
+  if (!gst_midi_iter_setup (iter, buf)) {
+    g_warning ("invalid data in midi buffer");
+    gst_midi_iter_set_done (iter);
+  }
 }
 
 GstClockTime
@@ -213,7 +1135,7 @@ gst_midi_iter_get_time (GstMidiIter *iter)
 {
   g_return_val_if_fail (iter != NULL, 0);
 
-  return GST_READ_UINT64_BE (iter->data);
+  return iter->time;
 }
 
 const guint8 *
@@ -221,25 +1143,320 @@ gst_midi_iter_get_event (GstMidiIter *iter)
 {
   g_return_val_if_fail (iter != NULL, NULL);
 
-  return iter->data + 8;
+  return iter->event;
 }
 
 gboolean
 gst_midi_iter_next (GstMidiIter *iter)
 {
-  guint len;
+  g_return_val_if_fail (iter != NULL, FALSE);
+
+  iter->data += iter->length;
+  if (iter->layout == GST_MIDI_LAYOUT_COLUMNAR ? 
+      ++iter->index >= iter->n_events : iter->data >= iter->end) {
+    gst_midi_iter_set_done (iter);
+    return FALSE;
+  }
+  if (!gst_midi_iter_decode (iter)) {
+    g_warning ("invalid data in midi buffer");
+    gst_midi_iter_set_done (iter);
+    return FALSE;
+  }
+  return TRUE;
+}
+
+/**
+ * gst_midi_iter_next_batch:
+ * @iter: iterator to read from
+ * @batch: batch to fill
+ * @end: only events before this time are decoded. Use #GST_CLOCK_TIME_NONE
+ *	 to decode until the end of the buffer.
+ *
+ * Decodes up to #GST_MIDI_BATCH_SIZE events starting at the current event
+ * of @iter into @batch and advances @iter past them. The decoded events 
+ * stay valid while the buffer and @batch are alive. For columnar buffers
+ * this is a tight loop over the columns.
+ *
+ * Returns: the number of events decoded. If it is less than 
+ *	    #GST_MIDI_BATCH_SIZE, there are no more events before @end.
+ **/
+guint
+gst_midi_iter_next_batch (GstMidiIter *iter, GstMidiBatch *batch, GstClockTime end)
+{
+  guint n = 0;
+
+  g_return_val_if_fail (iter != NULL, 0);
+  g_return_val_if_fail (batch != NULL, 0);
+
+  if (iter->layout == GST_MIDI_LAYOUT_COLUMNAR && iter->event != NULL) {
+    guint i, len, first = iter->index;
+    guint last = MIN (iter->n_events, first + GST_MIDI_BATCH_SIZE);
+    const guint8 *system = iter->data;
+
+    for (i = first; i < last && iter->times[i] < end; i++, n++) {
+      batch->times[n] = iter->times[i];
+      if (iter->statuses[i] >= 0xF0) {
+	/* gst_midi_iter_next() complains about broken data */
+	len = gst_midi_data_get_length (system, iter->end - system, 0);
+	if (len == 0)
+	  break;
+	batch->events[n] = system;
+	system += len;
+      } else {
+	batch->scratch[n][0] = iter->statuses[i];
+	batch->scratch[n][1] = iter->values[2 * i];
+	batch->scratch[n][2] = iter->values[2 * i + 1];
+	batch->events[n] = batch->scratch[n];
+      }
+    }
+    if (n > 0) {
+      iter->index = i - 1;
+      iter->data = system;
+      iter->length = 0;
+      gst_midi_iter_next (iter);
+    }
+  } else {
+    while (n < GST_MIDI_BATCH_SIZE && iter->event != NULL && iter->time < end) {
+      batch->times[n] = iter->time;
+      if (iter->event == iter->scratch) {
+	memcpy (batch->scratch[n], iter->scratch, 3);
+	batch->events[n] = batch->scratch[n];
+      } else {
+	batch->events[n] = iter->event;
+      }
+      n++;
+      gst_midi_iter_next (iter);
+    }
+  }
+  batch->n_events = n;
+
+  return n;
+}
+
+/**
+ * gst_midi_iter_seek_time:
+ * @iter: iterator to move
+ * @time: time to seek to
+ *
+ * Moves @iter to the first event in its buffer at or after @time. This 
+ * uses a binary search for columnar and indexed buffers and a linear 
+ * scan for all others. Only buffers from gst_midi_buffer_finish() are
+ * indexed, sub-buffers and merged buffers are not. Columnar buffers with
+ * system events are indexed, so their system events don't need to be
+ * counted from the start.
+ *
+ * Returns: TRUE if such an event exists, FALSE if @iter is now past the
+ *	    last event
+ **/
+gboolean
+gst_midi_iter_seek_time (GstMidiIter *iter, GstClockTime time)
+{
+  GstBuffer *buf;
+  guint lo, hi, mid;
 
   g_return_val_if_fail (iter != NULL, FALSE);
 
-  iter->data += 8;
-  len = gst_midi_data_get_length (iter->data, 
-      iter->buf->size +iter->buf->data - iter->data, 0);
-  if (len == 0) {
-    g_warning ("invaalid data in midi buffer");
+  buf = iter->buf;
+  if (iter->layout == GST_MIDI_LAYOUT_COLUMNAR && iter->n_events > 0) {
+    const guint8 *system = buf->data + COLUMNAR_SYSTEM (iter->n_events);
+
+    lo = 0;
+    hi = iter->n_events;
+    while (lo < hi) {
+      mid = (lo + hi) / 2;
+      if (iter->times[mid] < time)
+	lo = mid + 1;
+      else
+	hi = mid;
+    }
+    if (lo == iter->n_events) {
+      gst_midi_iter_set_done (iter);
+      return FALSE;
+    }
+    /* start from the indexed event before the new position, then skip
+     * the system events in between */
+    mid = 0;
+    if (iter->n_entries > 0) {
+      mid = lo / GST_MIDI_INDEX_INTERVAL;
+      if (mid >= iter->n_entries)
+	goto invalid;
+      system = buf->data + ((const IndexEntry *) iter->entries)[mid].offset;
+      if (system > iter->end)
+	goto invalid;
+      mid *= GST_MIDI_INDEX_INTERVAL;
+    }
+    for (; mid < lo && system < iter->end; mid++) {
+      if (iter->statuses[mid] >= 0xF0)
+	system += gst_midi_data_get_length (system, iter->end - system, 0);
+    }
+    iter->index = lo;
+    iter->data = system;
+  } else if (iter->n_entries > 0) {
+    const IndexEntry *entries = (const IndexEntry *) iter->entries;
+
+    /* find the last indexed event before time */
+    lo = 0;
+    hi = iter->n_entries;
+    while (lo < hi) {
+      mid = (lo + hi) / 2;
+      if (entries[mid].time < time)
+	lo = mid + 1;
+      else
+	hi = mid;
+    }
+    lo = lo > 0 ? lo - 1 : 0;
+    iter->data = buf->data + entries[lo].offset;
+    iter->status = entries[lo].status;
+    if (iter->data >= iter->end) 
+      goto invalid;
+  } else {
+    gst_midi_iter_init (iter, buf);
+    if (iter->event == NULL)
+      return FALSE;
+    while (iter->time < time) {
+      if (!gst_midi_iter_next (iter))
+	return FALSE;
+    }
+    return TRUE;
+  }
+
+  if (!gst_midi_iter_decode (iter))
+    goto invalid;
+  if (iter->layout != GST_MIDI_LAYOUT_COLUMNAR)
+    iter->time = ((const IndexEntry *) iter->entries)[lo].time;
+  while (iter->time < time) {
+    if (!gst_midi_iter_next (iter))
+      return FALSE;
+  }
+  return TRUE;
+
+invalid:
+  g_warning ("invalid data in midi buffer");
+  gst_midi_iter_set_done (iter);
+  return FALSE;
+}
+
+/**
+ * gst_midi_buffer_get_sysex:
+ * @buf: buffer containing @event
+ * @event: a system event inside @buf
+ * @status: set to the status of the sysex event or NULL
+ * @length: set to the size of the payload or NULL
+ *
+ * Gets the payload of a sysex event, no matter if it is stored in @buf or
+ * referenced by it.
+ *
+ * Returns: the payload or NULL if @event is not a sysex event
+ **/
+const guint8 *
+gst_midi_buffer_get_sysex (GstBuffer *buf, const GstMidiEvent *event,
+    guint8 *status, guint *length)
+{
+  GstMidiEventBuffer *buffer = (GstMidiEventBuffer *) buf;
+  const guint8 *end;
+  GstBuffer *payload;
+  guint index, len;
+  gint size;
+
+  g_return_val_if_fail (GST_IS_BUFFER (buf), NULL);
+  g_return_val_if_fail (event >= buf->data && event < buf->data + buf->size, NULL);
+
+  end = buf->data + buf->size;
+  if (event[0] == 0xF0 || event[0] == 0xF7) {
+    size = gst_midi_data_parse_varlen (event + 1, end - event - 1, &len);
+    if (size < 0 || (guint) size > end - event - 1 - len)
+      return NULL;
+    if (status)
+      *status = event[0];
+    if (length)
+      *length = size;
+    return event + 1 + len;
+  }
+  if (event[0] != GST_MIDI_SYSEX_REF || end - event < SYSEX_REF_SIZE + 1 ||
+      event[1] != SYSEX_REF_SIZE - 1)
+    return NULL;
+
+  /* referenced payloads only exist in buffers we built */
+  if (G_TYPE_FROM_INSTANCE (buf) != GST_TYPE_MIDI_EVENT_BUFFER || 
+      buffer->refs == NULL)
+    return NULL;
+  index = GST_READ_UINT32_LE (event + 3);
+  if (index >= buffer->refs->len)
+    return NULL;
+  payload = g_ptr_array_index (buffer->refs, index);
+  if (status)
+    *status = event[2];
+  if (length)
+    *length = GST_BUFFER_SIZE (payload);
+  return GST_BUFFER_DATA (payload);
+}
+
+/**
+ * gst_midi_buffer_validate:
+ * @buf: buffer to check
+ *
+ * Checks that all events in @buf are well-formed and in order inside the 
+ * buffer's time range. If so, @buf is marked with 
+ * #GST_MIDI_BUFFER_FLAG_VALID, so iterating it later can skip all checks.
+ * Buffers created with gst_midi_buffer_finish() are already marked.
+ *
+ * Returns: TRUE if @buf is valid
+ **/
+gboolean
+gst_midi_buffer_validate (GstBuffer *buf)
+{
+  GstMidiIter iter;
+  GstClockTime last, end;
+  const IndexEntry *entry;
+  guint8 status = 0;
+  guint i = 0;
+
+  g_return_val_if_fail (GST_IS_BUFFER (buf), FALSE);
+
+  if (GST_BUFFER_FLAG_IS_SET (buf, GST_MIDI_BUFFER_FLAG_VALID))
+    return TRUE;
+
+  if (!gst_midi_iter_setup (&iter, buf))
     return FALSE;
+  last = GST_BUFFER_TIMESTAMP (buf);
+  if (!GST_CLOCK_TIME_IS_VALID (last))
+    last = 0;
+  end = GST_BUFFER_DURATION (buf);
+  if (GST_CLOCK_TIME_IS_VALID (end) && GST_BUFFER_TIMESTAMP (buf) != GST_CLOCK_TIME_NONE)
+    end += GST_BUFFER_TIMESTAMP (buf);
+  else
+    end = GST_CLOCK_TIME_NONE;
+  while (iter.event != NULL) {
+    if (iter.time < last || iter.time >= end)
+      return FALSE;
+    if (iter.event[0] == GST_MIDI_SYSEX_REF &&
+	!gst_midi_buffer_get_sysex (buf, iter.event, NULL, NULL))
+      return FALSE;
+    last = iter.time;
+    if (iter.n_entries > 0 && i % GST_MIDI_INDEX_INTERVAL == 0) {
+      if (i / GST_MIDI_INDEX_INTERVAL >= iter.n_entries)
+	return FALSE;
+      entry = (const IndexEntry *) iter.entries + i / GST_MIDI_INDEX_INTERVAL;
+      if (entry->time != iter.time || entry->status != status ||
+	  entry->offset != iter.data - buf->data)
+	return FALSE;
+    }
+    status = iter.status;
+    i++;
+
+    iter.data += iter.length;
+    if (iter.layout == GST_MIDI_LAYOUT_COLUMNAR ? 
+	++iter.index >= iter.n_events : iter.data >= iter.end)
+      break;
+    if (!gst_midi_iter_decode (&iter))
+      return FALSE;
   }
-  iter->data += len;
-  return iter->data < iter->buf->size +iter->buf->data;
+  if (iter.n_entries > 0 && 
+      (i + GST_MIDI_INDEX_INTERVAL - 1) / GST_MIDI_INDEX_INTERVAL != iter.n_entries)
+    return FALSE;
+
+  GST_BUFFER_FLAG_SET (buf, GST_MIDI_BUFFER_FLAG_VALID);
+  return TRUE;
 }
 
 GstMidiEventType
@@ -279,25 +1496,20 @@ gst_midi_event_get_byte2 (const GstMidiEvent *event)
   return event[2];
 }
 
+/* only for channel events, the length of system events depends on their
+ * data, which can't be checked without knowing where it ends */
 guint
 gst_midi_event_get_length (const GstMidiEvent *event)
 {
+  guint len;
+
   g_return_val_if_fail (event != NULL, 0);
 
-  switch (gst_midi_event_get_type (event)) {
-    case 8:
-    case 9:
-    case 10:
-    case 11:
-    case 14:
-      return 3;
-    case 12:
-    case 13:
-      return 2;
-    case 15:
-    default:
-      g_return_val_if_reached (0);
-  }
+  len = gst_midi_status_get_length (event[0]);
+  if (len == 0 || len == GST_MIDI_LENGTH_VARIABLE || 
+      len == GST_MIDI_LENGTH_META)
+    g_return_val_if_reached (0);
+  return len + 1;
 }
 
 void
@@ -341,6 +1553,8 @@ gst_midi_buffer_dump (GstBuffer *buf)
   GstClockTime time;
 
   gst_midi_iter_init (&iter, buf);
+  if (gst_midi_iter_get_event (&iter) == NULL)
+    return;
   do {
     time = gst_midi_iter_get_time (&iter);
     g_print ("%"GST_TIME_FORMAT"   ", GST_TIME_ARGS (time));
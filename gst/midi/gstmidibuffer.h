@@ -25,13 +25,102 @@
 G_BEGIN_DECLS
 
 
-typedef GstBuffer GstMidiBuffer;
+/* caps of buffers containing midi events. Buffers are bufferlength seconds
+ * long and follow each other without gaps. */
+#define GST_MIDI_CAPS \
+  "audio/x-gst-midi, " \
+  "bufferlength = (fraction) [ 1/96000, 10/1 ], " \
+  "layout = (string) { compact, absolute, columnar }"
+
+/* bufferlength that is used if nothing else is asked for */
+#define GST_MIDI_BUFFER_LENGTH_NUM	1024
+#define GST_MIDI_BUFFER_LENGTH_DENOM	44100
+
+typedef struct _GstMidiBuffer GstMidiBuffer;
+typedef struct _GstMidiBufferPool GstMidiBufferPool;
 typedef guint8 GstMidiEvent;
 typedef struct _GstMidiIter GstMidiIter;
+typedef struct _GstMidiBatch GstMidiBatch;
+
+/* How events are stored in a buffer. This is negotiated with the "layout"
+ * field of the caps and marked on each buffer with a flag.
+ * ABSOLUTE: 8 byte big endian time, then the complete event
+ * COMPACT: varint time delta to the previous event (or the buffer
+ *	    timestamp for the first one), then the event. The status byte is
+ *	    omitted if it equals the one of the previous channel event.
+ * COLUMNAR: native endian guint32 event count and guint32 size of the
+ *	     system event area, followed by parallel arrays of the events'
+ *	     guint64 times, status bytes and 2 data bytes each. System
+ *	     events are stored completely in the area at the end, in order.
+ * Buffers built here with many events keep an index of every 
+ * GST_MIDI_INDEX_INTERVAL'th event for seeking. It's stored next to the
+ * buffer, the data holds nothing but the events. Columnar buffers only need
+ * one when they have system events, to find them without walking the
+ * statuses.
+ * Copies of buffers built here keep their layout and sysex payloads, but
+ * not the index or GST_MIDI_BUFFER_FLAG_VALID. */
+typedef enum {
+  GST_MIDI_LAYOUT_ABSOLUTE,
+  GST_MIDI_LAYOUT_COMPACT,
+  GST_MIDI_LAYOUT_COLUMNAR
+} GstMidiLayout;
+
+#define GST_MIDI_BUFFER_FLAG_COMPACT	(GST_BUFFER_FLAG_LAST << 0)
+#define GST_MIDI_BUFFER_FLAG_COLUMNAR	(GST_BUFFER_FLAG_LAST << 1)
+/* set by gst_midi_buffer_validate() when all events are well-formed */
+#define GST_MIDI_BUFFER_FLAG_VALID	(GST_BUFFER_FLAG_LAST << 2)
+
+#define GST_MIDI_INDEX_INTERVAL		(16)
+
+/* builder for a buffer of midi events. The buffer's data grows
+ * geometrically, so appending an event is amortized O(1). */
+struct _GstMidiBuffer {
+  GstBuffer *		buffer;		/* buffer being filled */
+  guint			capacity;	/* bytes allocated for buffer->data */
+  GstMidiLayout		layout;		/* layout the events are written in */
+  GstClockTime		last;		/* time of the last appended event */
+  guint8		status;		/* status of the last channel event */
+  guint			n_events;	/* number of appended events */
+  guint			n_alloc;	/* room for events in the columns */
+  GstMidiBufferPool *	pool;		/* pool the buffer returns to or NULL */
+};
+
+#define GST_MIDI_BUFFER_TIMESTAMP(buf)	GST_BUFFER_TIMESTAMP ((buf)->buffer)
+#define GST_MIDI_BUFFER_DURATION(buf)	GST_BUFFER_DURATION ((buf)->buffer)
+#define GST_MIDI_BUFFER_SIZE(buf)	GST_BUFFER_SIZE ((buf)->buffer)
 
 struct _GstMidiIter {
   GstBuffer *		buf;
-  const guint8 *	data;
+  const guint8 *	data;		/* start of the current event */
+  const guint8 *	end;		/* end of the buffer's data */
+  GstMidiLayout		layout;
+  gboolean		valid;		/* buffer was validated */
+
+  GstClockTime		time;		/* time of the current event */
+  const GstMidiEvent *	event;		/* the current event */
+  guint			length;		/* bytes the current event occupies */
+  guint8		status;		/* running status */
+  guint8		scratch[3];	/* current event if it isn't stored in one piece */
+
+  /* index of buffers built with gst_midi_buffer_finish() */
+  const guint8 *	entries;
+  guint			n_entries;
+
+  /* columnar layout */
+  guint			index;		/* index of the current event */
+  guint			n_events;
+  const GstClockTime *	times;
+  const guint8 *	statuses;
+  const guint8 *	values;
+};
+
+/* a number of events decoded at once by gst_midi_iter_next_batch() */
+#define GST_MIDI_BATCH_SIZE (64)
+struct _GstMidiBatch {
+  guint			n_events;
+  GstClockTime		times[GST_MIDI_BATCH_SIZE];
+  const GstMidiEvent *	events[GST_MIDI_BATCH_SIZE];
+  guint8		scratch[GST_MIDI_BATCH_SIZE][3];
 };
 
 typedef enum {
@@ -47,17 +136,50 @@ typedef enum {
 } GstMidiEventType;
 
 
+/* number of data bytes following a status byte: 0 for bytes that aren't a
+ * status, 1 or 2 for channel events, GST_MIDI_LENGTH_VARIABLE for sysex 
+ * events, which are followed by a varlen length and the payload, and 
+ * GST_MIDI_LENGTH_META for other system events, which have a type byte 
+ * before the varlen length */
+#define GST_MIDI_LENGTH_VARIABLE (0xFF)
+#define GST_MIDI_LENGTH_META (0xFE)
+extern const guint8 gst_midi_status_lengths[256];
+#define gst_midi_status_get_length(status) (gst_midi_status_lengths[(guint8) (status)])
+
+/* Sysex payloads appended with gst_midi_buffer_append_sysex() are kept by
+ * reference. Such an event uses this status byte, its data is the original
+ * status and an index, use gst_midi_buffer_get_sysex() to get the payload. */
+#define GST_MIDI_SYSEX_REF (0xF4)
+
 /* general support functions */
 gint		gst_midi_data_parse_varlen	(const guint8 *		data,
 						 guint			maxlen,
 						 guint *		len);
+guint		gst_midi_data_write_varlen	(guint8 *		data,
+						 guint32		value);
 guint		gst_midi_data_get_length      	(const guint8 *		data,
 						 guint			maxlen,
 						 guint8			status);
 
+/* caps */
+void		gst_midi_caps_fixate		(GstCaps *		caps);
+void		gst_midi_buffer_length_from_caps (const GstCaps *	caps,
+						 gint *			num,
+						 gint *			denom);
+
+/* layouts */
+GstMidiLayout	gst_midi_layout_from_caps	(const GstCaps *	caps);
+const gchar *	gst_midi_layout_get_name	(GstMidiLayout		layout);
+GstMidiLayout	gst_midi_buffer_get_layout	(GstBuffer *		buf);
+
 /* writing midi events into a buffer */
 GstMidiBuffer *	gst_midi_buffer_new		(GstClockTime		timestamp,
 						 GstClockTime		duration);
+GstMidiBuffer *	gst_midi_buffer_new_with_layout	(GstClockTime		timestamp,
+						 GstClockTime		duration,
+						 GstMidiLayout		layout);
+void		gst_midi_buffer_reserve		(GstMidiBuffer *	buf,
+						 guint			size);
 /* FIXME: need len here or should this be parsed automagically? */
 void		gst_midi_buffer_append		(GstMidiBuffer *	buf,
 						 GstClockTime		time,
@@ -69,15 +191,100 @@ void		gst_midi_buffer_append_with_status
 						 guint8			status,
 						 const guint8 *		data,
 						 guint			len);
+void		gst_midi_buffer_append_sysex	(GstMidiBuffer *	buf,
+						 GstClockTime		time,
+						 guint8			status,
+						 GstBuffer *		payload);
 GstBuffer *	gst_midi_buffer_finish		(GstMidiBuffer *	buf);
+void		gst_midi_buffer_free		(GstMidiBuffer *	buf);
+
+gboolean	gst_midi_buffer_validate	(GstBuffer *		buf);
+const guint8 *	gst_midi_buffer_get_sysex	(GstBuffer *		buf,
+						 const GstMidiEvent *	event,
+						 guint8 *		status,
+						 guint *		length);
+
+/* recycling buffers */
+GstMidiBufferPool *
+		gst_midi_buffer_pool_new	(void);
+void		gst_midi_buffer_pool_free	(GstMidiBufferPool *	pool);
+GstMidiBuffer *	gst_midi_buffer_pool_acquire	(GstMidiBufferPool *	pool,
+						 GstClockTime		timestamp,
+						 GstClockTime		duration,
+						 GstMidiLayout		layout);
 
 /* reading midi events from a buffer */
 void		gst_midi_iter_init		(GstMidiIter *		iter,
 						 GstBuffer *		buf);
+gboolean	gst_midi_iter_next		(GstMidiIter *		iter);
+guint		gst_midi_iter_next_batch	(GstMidiIter *		iter,
+						 GstMidiBatch *		batch,
+						 GstClockTime		end);
+gboolean	gst_midi_iter_seek_time		(GstMidiIter *		iter,
+						 GstClockTime		time);
+#ifdef GST_MIDI_EXTRA_CHECKS
 GstClockTime	gst_midi_iter_get_time		(GstMidiIter *		iter);
 const GstMidiEvent *
 		gst_midi_iter_get_event		(GstMidiIter *		iter);
-gboolean	gst_midi_iter_next		(GstMidiIter *		iter);
+#else
+#define gst_midi_iter_get_time(iter) ((iter)->time)
+#define gst_midi_iter_get_event(iter) ((const GstMidiEvent *) (iter)->event)
+#define gst_midi_iter_next(iter) gst_midi_iter_next_unchecked (iter)
+
+/* Steps over channel events of validated buffers without any checks. 
+ * Everything else goes through the real gst_midi_iter_next(). */
+static inline gboolean
+gst_midi_iter_next_unchecked (GstMidiIter *iter)
+{
+  const guint8 *data;
+  guint i;
+
+  if (!iter->valid)
+    goto checked;
+  switch (iter->layout) {
+    case GST_MIDI_LAYOUT_ABSOLUTE:
+      data = iter->data + iter->length;
+      if (data >= iter->end || data[8] >= 0xF0)
+	goto checked;
+      iter->data = data;
+      iter->time = GST_READ_UINT64_BE (data);
+      iter->event = data + 8;
+      iter->length = 8 + 1 + gst_midi_status_get_length (data[8]);
+      return TRUE;
+    case GST_MIDI_LAYOUT_COMPACT:
+      /* single byte time delta and omitted status */
+      data = iter->data + iter->length;
+      if (data >= iter->end || (data[0] & 0x80) || (data[1] & 0x80))
+	goto checked;
+      iter->data = data;
+      iter->time += data[0];
+      iter->scratch[0] = iter->status;
+      i = gst_midi_status_get_length (iter->status);
+      iter->scratch[1] = data[1];
+      iter->scratch[2] = i > 1 ? data[2] : 0;
+      iter->length = 1 + i;
+      iter->event = iter->scratch;
+      return TRUE;
+    case GST_MIDI_LAYOUT_COLUMNAR:
+      i = iter->index + 1;
+      if (iter->length != 0 || i >= iter->n_events || iter->statuses[i] >= 0xF0)
+	goto checked;
+      iter->index = i;
+      iter->time = iter->times[i];
+      iter->scratch[0] = iter->statuses[i];
+      iter->scratch[1] = iter->values[2 * i];
+      iter->scratch[2] = iter->values[2 * i + 1];
+      iter->event = iter->scratch;
+      return TRUE;
+    default:
+      break;
+  }
+
+checked:
+  /* the parentheses call the function instead of the macro */
+  return (gst_midi_iter_next) (iter);
+}
+#endif
 
 /* midi events */
 guint		gst_midi_event_get_length	(const GstMidiEvent *	event);
@@ -21,9 +21,13 @@
 #  include "config.h"
 #endif
 
+#include <string.h>
+
 #include <gst/gst.h>
 #include <gst/base/gstadapter.h>
 #include "gstmidibuffer.h"
+#include "gstsmftrack.h"
+#include "gstsmfenc.h"
 
 #define GST_TYPE_SMFDEC (gst_smfdec_get_type())
 #define GST_SMFDEC(obj) (G_TYPE_CHECK_INSTANCE_CAST((obj),GST_TYPE_SMFDEC,GstSmfdec))
@@ -31,16 +35,119 @@
 #define GST_IS_SMFDEC(obj) (G_TYPE_CHECK_INSTANCE_TYPE((obj),GST_TYPE_SMFDEC))
 #define GST_IS_SMFDEC_CLASS(obj) (G_TYPE_CHECK_CLASS_TYPE((klass),GST_TYPE_SMFDEC))
 
+/* tags for what meta events say that GStreamer has no tags for */
+#define GST_TAG_MIDI_TRACK_NAME		"midi-track-name"
+#define GST_TAG_MIDI_TIME_SIGNATURE	"midi-time-signature"
+#define GST_TAG_MIDI_KEY_SIGNATURE	"midi-key-signature"
+
 typedef struct _GstSmfdec GstSmfdec;
 typedef struct _GstSmfdecClass GstSmfdecClass;
 
 typedef struct {
   guint32		fourcc;
-  guint			length;
-  const guint8 *	data;
+  guint			length;		/* bytes of the chunk not yet consumed */
+  const guint8 *	data;		/* contiguous view of available bytes */
   guint			available;
+  guint			needed;		/* don't look at data before this many 
+					   bytes are available */
 } Chunk;
 
+/* a point in a track that playback can start from */
+typedef struct {
+  guint64		tick;		/* tick of the event before offset */
+  guint			offset;		/* position of the next event */
+  guint8		status;		/* running status at offset */
+} GstSmfdecCheckpoint;
+
+/* work for the worker pool, the first member of what it's done for */
+typedef struct _GstSmfdecJob GstSmfdecJob;
+struct _GstSmfdecJob {
+  void			(* func)	(GstSmfdecJob *job, GstSmfdec *dec);
+  gboolean		busy;		/* if the workers have it, protected by
+					   the jobs lock */
+};
+
+/* a track of a format 1 file, all of them are played at the same time */
+typedef struct {
+  GstBuffer *		buffer;		/* contents of the track chunk */
+  guint64		offset;		/* position of the contents in the file */
+  guint			length;		/* length of the contents */
+  guint64		tick;		/* tick the track starts at */
+  guint64		end_tick;	/* tick of the last event */
+  GArray *		checkpoints;	/* GstSmfdecCheckpoint every few events or
+					   NULL if the track wasn't indexed */
+  GstSmfTrackCursor	cursor;		/* the next event to play */
+  guint			index;		/* number of the track in the file */
+} GstSmfdecTrack;
+
+/* a part of a format 1 file that a worker decodes into buffers while the
+ * parts before it are pushed, the events from tick to end_tick - 1 */
+typedef struct {
+  GstSmfdecJob		job;
+  guint64		tick;
+  guint64		end_tick;
+  GstMidiBuffer *	buf;		/* buffer the part starts in or NULL */
+  guint			hint;		/* size to reserve for new buffers */
+  GPtrArray *		buffers;	/* GstBuffer decoded */
+  guint			events;		/* number of events decoded */
+  gchar *		error;		/* why decoding failed or NULL */
+  GstSmfdecTrack *	tracks;		/* copies of the tracks with own cursors */
+  GstSmfdecTrack **	heap;
+} GstSmfdecPart;
+
+/* part of the tempo map, the tempo in effect from tick on */
+typedef struct {
+  guint64		tick;
+  GstClockTime		time;		/* time of tick is time + carry / division */
+  guint64		carry;
+  GstClockTime		tempo;		/* nanoseconds per quarter note */
+} GstSmfdecTempo;
+
+/* a program change, controller or pitch bend, which set up a channel for 
+ * everything played after it */
+typedef struct {
+  guint64		tick;
+  guint32		track;		/* number of the track it is in */
+  guint32		event;		/* number of the event in the track */
+  guint8		status;
+  guint8		data[2];
+  guint8		padding[5];
+} GstSmfdecChange;
+
+/* the setup of all channels, -1 for what isn't set */
+typedef struct {
+  gint16		program[16];
+  gint16		bend[16];
+  gint16		controllers[16][120];
+} GstSmfdecChannels;
+
+/* Start of a cached image of a decoded file. It is followed by n_events
+ * GstSmfdecCacheEvent in the order they are played, n_tempos GstSmfdecTempo,
+ * n_changes GstSmfdecChange and data_size bytes of event data. Images are only read on the machine
+ * that wrote them, so everything is in native byte order. */
+typedef struct {
+  guint32		magic;
+  guint32		version;
+  guint64		hash;		/* hash of the file contents */
+  guint64		size;		/* size of the file */
+  guint32		format;		/* format of the file + 1 */
+  guint32		division;
+  guint32		n_events;
+  guint32		n_tempos;
+  guint32		n_changes;
+  guint32		padding;
+  guint64		data_size;
+} GstSmfdecCacheHeader;
+
+typedef struct {
+  GstClockTime		time;
+  guint64		tick;
+  guint64		offset;		/* position of the data after the status */
+  guint32		length;
+  guint8		status;
+  guint8		padding[3];
+} GstSmfdecCacheEvent;
+
 struct _GstSmfdec {
   GstElement		element;
 
@@ -54,23 +161,84 @@ struct _GstSmfdec {
   guint			tracks_missing;	/* tracks that haven't been parsed yet */
 
   guint8		status;		/* running status */
+  GArray *		events;		/* GstSmfTrackEvent of a scanned track */
+  GPtrArray *		tracks;		/* GstSmfdecTrack of a format 1 file or of
+					   any file in pull mode */
+  GstSmfdecTrack **	heap;		/* tracks being played, earliest first */
+  guint			heap_size;
+  guint			threads;	/* threads to decode tracks with */
+  GThreadPool *		workers;	/* those threads or NULL */
+  guint			jobs_pending;	/* jobs the workers haven't finished */
+  GMutex *		jobs_lock;
+  GCond *		jobs_done;
+  GstSmfdecPart *	parts;		/* ring of parts decoded by the workers */
+  guint			n_parts;
+  guint			parts_first;	/* oldest part not pushed yet */
+  guint			parts_busy;	/* parts started and not pushed yet */
+  guint64		parts_tick;	/* tick the next part starts at */
+  guint64		parts_buffer;	/* buffer the next part starts in */
+  guint			parts_span;	/* buffers per part */
+  guint64		end_tick;	/* tick of the last event of all tracks */
+  guint			next_track;	/* next track to play in pull mode */
+  gboolean		pulling;	/* if the sink pad is in pull mode */
+  gboolean		segment_sent;	/* if a newsegment event was pushed */
+  GstClockTime		segment_start;	/* start of the next newsegment event */
+  GArray *		tempo_map;	/* GstSmfdecTempo sorted by tick, filled 
+					   in pull mode only */
+  GArray *		changes;	/* GstSmfdecChange sorted by tick, filled
+					   with the tempo map */
+  GArray *		channels;	/* GstSmfdecChannels after every 
+					   CHANNELS_INTERVAL changes */
+  GstFlowReturn		flow;		/* result of the last push */
+
+  gboolean		scan;		/* only read tags and duration */
+  GstTagList *		tags;		/* tags not pushed yet or NULL */
+  gboolean		tags_scanned;	/* if tags were taken from the whole 
+					   file already */
+  GstClockTime		duration;	/* of the file if known */
+
+  gchar *		cache_dir;	/* where images are kept or NULL */
+  const GstSmfdecCacheHeader *cache; /* image being played or NULL */
+  GMappedFile *		cache_map;	/* file the image was loaded from */
+  GByteArray *		cache_bytes;	/* or the image if it was just built */
+  guint			cache_pos;	/* next event of the image to play */
+  GArray *		cache_events;	/* GstSmfdecCacheEvent while building */
+  GByteArray *		cache_data;	/* their data while building */
   
   guint			division;	/* division is read in the header */
+  guint64		recip;		/* 2^recip_shift / division rounded up */
+  guint			recip_shift;
   GstClockTime		tempo;		/* tempo as set by meta events in nanoseconds */
-  guint			ticks;		/* number of ticks already processed */
-  GstClockTime		start;		/* time at which we started */
+  guint64		tick_ns;	/* tempo / division */
+  guint64		tick_rem;	/* tempo % division */
+  guint64		tick;		/* tick of the current event */
+  guint64		time_tick;	/* tick the time was last computed for */
+  GstClockTime		time;		/* time of time_tick is 
+					   time + carry / division */
+  guint64		carry;
   
+  GstMidiLayout		layout;		/* negotiated buffer layout */
+  GstMidiBufferPool *	pool;		/* pool buffers are taken from */
   GstMidiBuffer *	buf;		/* current buffer */
   GstClockTime		buf_start;	/* time at which buffer sending starts */
   guint			buf_num;	/* numerator of buffer time */
   guint		  	buf_denom;	/* denominator of buffer time */
-  guint			buf_sent;	/* number of buffers already sent */
+  guint64		buf_sent;	/* number of buffers already sent */
+  GstClockTime		buf_next;	/* start of buffer number buf_sent */
+  guint			buf_hint;	/* size of the last buffer sent */
 };
 
 struct _GstSmfdecClass {
   GstElementClass	parent_class;
 };
 
+enum {
+  ARG_0,
+  ARG_THREADS,
+  ARG_CACHE_DIR,
+  ARG_SCAN
+};
+
 static GstElementClass *parent_class = NULL;
 static GType gst_smfdec_get_type (void);
 
@@ -85,9 +253,26 @@ static GstStaticPadTemplate gst_smfdec_src_template =
     GST_STATIC_PAD_TEMPLATE ("src",
     GST_PAD_SRC,
     GST_PAD_ALWAYS,
-    GST_STATIC_CAPS ("audio/x-gst-midi, bufferlength=(fraction) 1024/44100")
+    GST_STATIC_CAPS (GST_MIDI_CAPS)
     );
 
+/* Makes the part of the chunk that is in the adapter available as one 
+ * contiguous block. Tracks are only looked at through this, once per 
+ * incoming buffer. */
+static void
+chunk_update (GstAdapter *adapter, Chunk *chunk)
+{
+  guint available = MIN (gst_adapter_available (adapter), chunk->length);
+
+  if (available == 0 || available < chunk->needed) {
+    chunk->data = NULL;
+    chunk->available = 0;
+  } else {
+    chunk->data = gst_adapter_peek (adapter, available);
+    chunk->available = available;
+  }
+}
+
 static gboolean
 get_next_chunk (GstAdapter *adapter, Chunk *chunk)
 {
@@ -100,9 +285,10 @@ get_next_chunk (GstAdapter *adapter, Chunk *chunk)
 
   chunk->fourcc = GST_READ_UINT32_LE (data);
   chunk->length = length;
+  chunk->needed = 0;
+  chunk->data = NULL;
+  chunk->available = 0;
   gst_adapter_flush (adapter, 8);
-  chunk->data = gst_adapter_peek (adapter, gst_adapter_available_fast (adapter));
-  chunk->available = gst_adapter_available_fast (adapter);
   return TRUE;
 }
 
@@ -113,23 +299,24 @@ chunk_clear (Chunk *chunk)
   chunk->data = 0;
   chunk->length = 0;
   chunk->available = 0;
+  chunk->needed = 0;
 }
 
-static void
-chunk_skip (GstAdapter *adapter, Chunk *chunk, guint size)
+/* removes size bytes from the start of the chunk and returns them. The rest
+ * of the chunk is only looked at again with the next buffer */
+static GstBuffer *
+chunk_take (GstAdapter *adapter, Chunk *chunk, guint size)
 {
-  g_return_if_fail (size <= chunk->available);
+  GstBuffer *buffer;
+
+  g_return_val_if_fail (size > 0 && size <= chunk->available, NULL);
+  buffer = gst_adapter_take_buffer (adapter, size);
   chunk->length -= size;
-  chunk->available -= size;
-  gst_adapter_flush (adapter, size);
-  if (chunk->available) {
-    chunk->data = gst_adapter_peek (adapter, chunk->available);
-    g_assert (chunk->data);
-  } else {
-    chunk->data = NULL;
-  }
-  GST_LOG ("skipped %u bytes, %u of %u still available\n", size, 
-      chunk->available, chunk->length);
+  chunk->data = NULL;
+  chunk->available = 0;
+  chunk->needed = 0;
+  GST_LOG ("took %u bytes, %u still to go", size, chunk->length);
+  return buffer;
 }
 
 static void
@@ -144,9 +331,7 @@ chunk_flush (GstAdapter *adapter, Chunk *chunk)
 static gboolean
 chunk_ensure (GstAdapter *adapter, Chunk *chunk, guint size)
 {
-  if (size == 0)
-    size = MIN (gst_adapter_available (adapter), chunk->length);
-  g_return_val_if_fail (size <= chunk->length, FALSE);
+  g_return_val_if_fail (size > 0 && size <= chunk->length, FALSE);
 
   chunk->data = gst_adapter_peek (adapter, size);
   if (chunk->data) {
@@ -158,26 +343,175 @@ chunk_ensure (GstAdapter *adapter, Chunk *chunk, guint size)
   }
 }
 /******************************************************************************/
+/* Times are kept exactly as time + carry / division nanoseconds, so nothing 
+ * is lost to rounding no matter how long a file plays. Moving on by some 
+ * ticks only needs a multiplication to reduce the carry. */
+
+/* largest carry that can be reduced with the reciprocal */
+#define CARRY_LIMIT (G_GUINT64_CONSTANT (1) << 31)
+
+static inline void
+gst_smfdec_advance (GstSmfdec *dec, GstClockTime *time, guint64 *carry,
+    guint64 ticks, guint64 tick_ns, guint64 tick_rem)
+{
+  guint64 c = *carry + ticks * tick_rem;
+  guint64 n;
+
+  *time += ticks * tick_ns;
+  if (c >= dec->division) {
+    if (G_LIKELY (c < CARRY_LIMIT))
+      n = (c * dec->recip) >> dec->recip_shift;
+    else
+      n = c / dec->division;
+    *time += n;
+    c -= n * dec->division;
+  }
+  *carry = c;
+}
+
+/* returns the time of dec->tick */
+static GstClockTime
+gst_smfdec_update_time (GstSmfdec *dec)
+{
+  gst_smfdec_advance (dec, &dec->time, &dec->carry, 
+      dec->tick - dec->time_tick, dec->tick_ns, dec->tick_rem);
+  dec->time_tick = dec->tick;
+  return dec->time;
+}
+
+static void
+gst_smfdec_set_tick_length (GstSmfdec *dec)
+{
+  dec->tick_ns = dec->tempo / dec->division;
+  dec->tick_rem = dec->tempo % dec->division;
+}
+
+/* With recip_shift = 32 + floor (log2 (division)), c * recip >> recip_shift 
+ * is c / division for all c below CARRY_LIMIT and the product can't 
+ * overflow. */
+static void
+gst_smfdec_set_division (GstSmfdec *dec, guint division)
+{
+  dec->division = division;
+  dec->recip_shift = 32 + g_bit_storage (division) - 1;
+  dec->recip = ((G_GUINT64_CONSTANT (1) << dec->recip_shift) + division - 1) /
+      division;
+  gst_smfdec_set_tick_length (dec);
+}
+
 static void
 gst_smfdec_set_tempo (GstSmfdec *dec, guint64 tempo)
 {
-  dec->start += dec->ticks * dec->tempo / dec->division;
-  GST_DEBUG ("set tempo to %"G_GUINT64_FORMAT" and start offset to %"G_GUINT64_FORMAT" since %u ticks have been elapsed\n",
-      tempo, dec->start, dec->ticks);
+  gst_smfdec_update_time (dec);
+  GST_DEBUG ("set tempo to %"G_GUINT64_FORMAT" at tick %"G_GUINT64_FORMAT" (%"GST_TIME_FORMAT")",
+      tempo, dec->tick, GST_TIME_ARGS (dec->time));
   dec->tempo = tempo * GST_USECOND;
-  dec->ticks = 0;
+  gst_smfdec_set_tick_length (dec);
+}
+
+static gboolean
+gst_smfdec_negotiate (GstSmfdec *dec)
+{
+  GstCaps *caps;
+  gboolean ret;
+
+  caps = gst_pad_get_allowed_caps (dec->src);
+  if (caps == NULL || gst_caps_is_empty (caps)) {
+    if (caps)
+      gst_caps_unref (caps);
+    return FALSE;
+  }
+  caps = gst_caps_make_writable (caps);
+  gst_caps_truncate (caps);
+  gst_pad_fixate_caps (dec->src, caps);
+  ret = gst_pad_set_caps (dec->src, caps);
+  gst_caps_unref (caps);
+
+  return ret;
+}
+
+/* start of buffer number n, buffers are put on an exact grid so their 
+ * lengths don't add up rounding errors */
+static GstClockTime
+gst_smfdec_buffer_time (GstSmfdec *dec, guint64 n)
+{
+  return dec->buf_start + 
+      gst_util_uint64_scale (n, GST_SECOND * dec->buf_num, dec->buf_denom);
+}
+
+/* number of the buffer time is in */
+static guint64
+gst_smfdec_buffer_number (GstSmfdec *dec, GstClockTime time)
+{
+  guint64 n;
+
+  n = gst_util_uint64_scale (time - dec->buf_start + 1, dec->buf_denom, 
+      GST_SECOND * dec->buf_num);
+  if (gst_smfdec_buffer_time (dec, n) > time)
+    n--;
+  return n;
+}
+
+/* negotiates the layout and length of buffers if that didn't happen yet */
+static void
+gst_smfdec_check_caps (GstSmfdec *dec)
+{
+  if (GST_PAD_CAPS (dec->src) == NULL && !gst_smfdec_negotiate (dec))
+    GST_DEBUG ("could not negotiate, using %s layout", 
+	gst_midi_layout_get_name (dec->layout));
 }
 
 static void
 gst_smfdec_buffer_new (GstSmfdec *dec, GstClockTime time)
 {
+  GstClockTime end;
+
   g_assert (dec->buf == NULL);
-  /**** FLOATING POINT PROBLEM HERE... dec->buf_* hasn't been inited yet ******/
-  dec->buf_sent = (time - dec->buf_start) * dec->buf_denom / dec->buf_num / GST_SECOND;
-  dec->buf = gst_midi_buffer_new (
-      dec->buf_start + dec->buf_sent * GST_SECOND * dec->buf_num / dec->buf_denom,
-      GST_SECOND * dec->buf_num / dec->buf_denom);
+  gst_smfdec_check_caps (dec);
+
+  end = gst_smfdec_buffer_time (dec, dec->buf_sent + 1);
+  if (time < dec->buf_next || time >= end) {
+    /* not in the buffer after the last one, look for the one it's in */
+    dec->buf_sent = gst_smfdec_buffer_number (dec, time);
+    dec->buf_next = gst_smfdec_buffer_time (dec, dec->buf_sent);
+    end = gst_smfdec_buffer_time (dec, dec->buf_sent + 1);
+  }
+  dec->buf = gst_midi_buffer_pool_acquire (dec->pool, dec->buf_next,
+      end - dec->buf_next, dec->layout);
+  gst_midi_buffer_reserve (dec->buf, dec->buf_hint);
   dec->buf_sent++;
+  dec->buf_next = end;
+}
+
+static GstTagList *
+gst_smfdec_get_tags (GstSmfdec *dec)
+{
+  if (dec->tags == NULL)
+    dec->tags = gst_tag_list_new ();
+  return dec->tags;
+}
+
+/* pushes the tags found since the last time */
+static void
+gst_smfdec_push_tags (GstSmfdec *dec)
+{
+  if (dec->tags == NULL)
+    return;
+  gst_element_found_tags_for_pad (GST_ELEMENT (dec), dec->src, dec->tags);
+  dec->tags = NULL;
+}
+
+/* pushes a finished buffer */
+static void
+gst_smfdec_push (GstSmfdec *dec, GstBuffer *buf)
+{
+  gst_smfdec_push_tags (dec);
+  dec->buf_hint = GST_BUFFER_SIZE (buf);
+  gst_buffer_set_caps (buf, GST_PAD_CAPS (dec->src));
+  GST_LOG_OBJECT (dec, "pushing %u bytes at %" GST_TIME_FORMAT, 
+      GST_BUFFER_SIZE (buf), GST_TIME_ARGS (GST_BUFFER_TIMESTAMP (buf)));
+  //gst_pad_push (dec->src, GST_DATA (buf));
+  dec->flow = gst_pad_push (dec->src, buf);
 }
 
 static void
@@ -189,9 +523,164 @@ gst_smfdec_buffer_push (GstSmfdec *dec)
   
   buf = gst_midi_buffer_finish (dec->buf);
   dec->buf = NULL;
-  gst_midi_buffer_dump (buf);
-  //gst_pad_push (dec->src, GST_DATA (buf));
-  gst_pad_push (dec->src, GST_BUFFER (buf));
+  gst_smfdec_push (dec, buf);
+}
+
+/*** worker pool *************************************************************/
+
+/* upper limit for the threads property */
+#define MAX_THREADS (64)
+
+static void
+gst_smfdec_worker (gpointer item, gpointer user_data)
+{
+  GstSmfdecJob *job = item;
+  GstSmfdec *dec = user_data;
+
+  job->func (job, dec);
+  g_mutex_lock (dec->jobs_lock);
+  job->busy = FALSE;
+  dec->jobs_pending--;
+  g_cond_signal (dec->jobs_done);
+  g_mutex_unlock (dec->jobs_lock);
+}
+
+/* hands job to the workers or does it right away if there are none */
+static void
+gst_smfdec_job_start (GstSmfdec *dec, GstSmfdecJob *job)
+{
+  if (dec->workers == NULL) {
+    job->func (job, dec);
+    return;
+  }
+  g_mutex_lock (dec->jobs_lock);
+  job->busy = TRUE;
+  dec->jobs_pending++;
+  g_mutex_unlock (dec->jobs_lock);
+  g_thread_pool_push (dec->workers, job, NULL);
+}
+
+/* waits until the workers are done with job */
+static void
+gst_smfdec_job_wait (GstSmfdec *dec, GstSmfdecJob *job)
+{
+  g_mutex_lock (dec->jobs_lock);
+  while (job->busy)
+    g_cond_wait (dec->jobs_done, dec->jobs_lock);
+  g_mutex_unlock (dec->jobs_lock);
+}
+
+/* waits until the workers are done with all jobs */
+static void
+gst_smfdec_jobs_wait (GstSmfdec *dec)
+{
+  g_mutex_lock (dec->jobs_lock);
+  while (dec->jobs_pending > 0)
+    g_cond_wait (dec->jobs_done, dec->jobs_lock);
+  g_mutex_unlock (dec->jobs_lock);
+}
+
+/* throws away what the workers decoded and wasn't pushed */
+static void
+gst_smfdec_parts_clear (GstSmfdec *dec)
+{
+  GstSmfdecPart *part;
+  guint i, j;
+
+  gst_smfdec_jobs_wait (dec);
+  for (i = 0; i < dec->n_parts; i++) {
+    part = &dec->parts[i];
+    for (j = 0; j < part->buffers->len; j++)
+      gst_buffer_unref (g_ptr_array_index (part->buffers, j));
+    g_ptr_array_set_size (part->buffers, 0);
+    if (part->buf) {
+      gst_midi_buffer_free (part->buf);
+      part->buf = NULL;
+    }
+    g_free (part->error);
+    part->error = NULL;
+  }
+  dec->parts_first = 0;
+  dec->parts_busy = 0;
+}
+
+static void
+gst_smfdec_workers_start (GstSmfdec *dec)
+{
+  guint i;
+
+  if (dec->threads < 2 || dec->workers != NULL)
+    return;
+  dec->workers = g_thread_pool_new (gst_smfdec_worker, dec, dec->threads,
+      FALSE, NULL);
+  if (dec->workers == NULL) {
+    GST_WARNING_OBJECT (dec, "could not start %u threads, decoding in the "
+	"streaming thread", dec->threads);
+    return;
+  }
+  /* one more than they work on, so one is ready while they decode */
+  dec->n_parts = dec->threads + 1;
+  dec->parts = g_new0 (GstSmfdecPart, dec->n_parts);
+  for (i = 0; i < dec->n_parts; i++)
+    dec->parts[i].buffers = g_ptr_array_new ();
+}
+
+static void
+gst_smfdec_workers_stop (GstSmfdec *dec)
+{
+  guint i;
+
+  if (dec->workers == NULL)
+    return;
+  gst_smfdec_parts_clear (dec);
+  g_thread_pool_free (dec->workers, FALSE, TRUE);
+  dec->workers = NULL;
+  for (i = 0; i < dec->n_parts; i++) {
+    g_ptr_array_free (dec->parts[i].buffers, TRUE);
+    g_free (dec->parts[i].tracks);
+    g_free (dec->parts[i].heap);
+  }
+  g_free (dec->parts);
+  dec->parts = NULL;
+  dec->n_parts = 0;
+}
+
+/******************************************************************************/
+
+static void
+gst_smfdec_clear_tracks (GstSmfdec *dec)
+{
+  GstSmfdecTrack *track;
+  guint i;
+
+  gst_smfdec_parts_clear (dec);
+  for (i = 0; i < dec->tracks->len; i++) {
+    track = g_ptr_array_index (dec->tracks, i);
+    if (track->buffer)
+      gst_buffer_unref (track->buffer);
+    if (track->checkpoints)
+      g_array_free (track->checkpoints, TRUE);
+    g_free (track);
+  }
+  g_ptr_array_set_size (dec->tracks, 0);
+  dec->heap_size = 0;
+  dec->next_track = 0;
+}
+
+/* stops using the cached image of the file */
+static void
+gst_smfdec_cache_clear (GstSmfdec *dec)
+{
+  if (dec->cache_map) {
+    g_mapped_file_free (dec->cache_map);
+    dec->cache_map = NULL;
+  }
+  if (dec->cache_bytes) {
+    g_byte_array_free (dec->cache_bytes, TRUE);
+    dec->cache_bytes = NULL;
+  }
+  dec->cache = NULL;
+  dec->cache_pos = 0;
 }
 
 static void
@@ -199,205 +688,672 @@ gst_smfdec_reset (GstSmfdec *dec)
 {
   gst_adapter_clear (dec->adapter);
   chunk_clear (&dec->chunk);
+  if (dec->buf) {
+    gst_midi_buffer_free (dec->buf);
+    dec->buf = NULL;
+  }
+  dec->buf_hint = 0;
+  dec->layout = GST_MIDI_LAYOUT_ABSOLUTE;
   dec->format = 0;
-  dec->start = 0;
+  gst_smfdec_clear_tracks (dec);
+  gst_smfdec_cache_clear (dec);
   dec->status = 0;
-  dec->division = 1;
-  dec->ticks = 0;
+  dec->tick = 0;
+  dec->time_tick = 0;
+  dec->time = 0;
+  dec->carry = 0;
+  dec->segment_sent = FALSE;
+  dec->segment_start = 0;
+  g_array_set_size (dec->tempo_map, 0);
+  g_array_set_size (dec->changes, 0);
+  g_array_set_size (dec->channels, 0);
+  dec->flow = GST_FLOW_OK;
+  if (dec->tags) {
+    gst_tag_list_free (dec->tags);
+    dec->tags = NULL;
+  }
+  dec->tags_scanned = FALSE;
+  dec->duration = GST_CLOCK_TIME_NONE;
   dec->buf_start = 0;
-  dec->buf_num=1024;
-  dec->buf_denom=44100;
+  dec->buf_num = GST_MIDI_BUFFER_LENGTH_NUM;
+  dec->buf_denom = GST_MIDI_BUFFER_LENGTH_DENOM;
   dec->buf_sent = 0;
-  gst_smfdec_set_tempo (dec, 480000);
+  dec->buf_next = 0;
+  dec->parts_span = 0;
+  dec->tempo = 480000 * GST_USECOND;
+  gst_smfdec_set_division (dec, 1);
 }
 
-static void
-gst_smfdec_buffer_append (GstSmfdec *dec, guint8 status, const guint8 *data, guint len)
+/* makes sure an event at the current time fits into dec->buf */
+static GstClockTime
+gst_smfdec_buffer_prepare (GstSmfdec *dec)
 {
-  GstClockTime time = dec->start + dec->ticks * dec->tempo / dec->division;
+  GstClockTime time = gst_smfdec_update_time (dec);
 
   //g_print ("time is %"GST_TIME_FORMAT"\n", GST_TIME_ARGS (time));
-  g_assert (!dec->buf || time >= dec->buf->timestamp);
+  g_assert (!dec->buf || time >= GST_MIDI_BUFFER_TIMESTAMP (dec->buf));
 
-  if (!dec->buf || time >= dec->buf->timestamp + dec->buf->duration) {
+  if (!dec->buf || time >= GST_MIDI_BUFFER_TIMESTAMP (dec->buf) + 
+      GST_MIDI_BUFFER_DURATION (dec->buf)) {
     if (dec->buf)
       gst_smfdec_buffer_push (dec);
     gst_smfdec_buffer_new (dec, time);
   }
+  return time;
+}
+
+static void
+gst_smfdec_buffer_append (GstSmfdec *dec, guint8 status, const guint8 *data, guint len)
+{
+  GstClockTime time = gst_smfdec_buffer_prepare (dec);
+
   gst_midi_buffer_append_with_status (dec->buf, time, status, data, len);
 }
 
+static void
+gst_smfdec_buffer_append_sysex (GstSmfdec *dec, guint8 status, GstBuffer *payload)
+{
+  GstClockTime time = gst_smfdec_buffer_prepare (dec);
+
+  gst_midi_buffer_append_sysex (dec->buf, time, status, payload);
+}
+
 
 static gboolean
 gst_smfdec_src_setcaps (GstPad * pad, GstCaps * caps)
 {
   GstSmfdec *dec = GST_SMFDEC (gst_pad_get_parent (pad));
-  GstStructure *structure = gst_caps_get_structure (caps, 0);
-  const GValue *value = gst_structure_get_value (structure, "bufferlength");
+  gint num, denom;
 
-  g_assert (value);
-
-  if (dec->buf_denom)
-    dec->buf_start += dec->buf_sent * GST_SECOND * dec->buf_num / dec->buf_denom;
-#if 0
-  dec->buf_num = gst_value_get_fraction_numerator (value);
-  dec->buf_denom = gst_value_get_fraction_denominator (value);
-#endif
+  /* buffers of the new length start where the old ones stopped */
+  gst_midi_buffer_length_from_caps (caps, &num, &denom);
+  dec->buf_start = gst_smfdec_buffer_time (dec, dec->buf_sent);
+  dec->buf_next = dec->buf_start;
+  dec->buf_num = num;
+  dec->buf_denom = denom;
   dec->buf_sent = 0;
+  dec->layout = gst_midi_layout_from_caps (caps);
   gst_object_unref(dec);
   return TRUE;
 }
 
+static void
+gst_smfdec_src_fixatecaps (GstPad * pad, GstCaps * caps)
+{
+  gst_midi_caps_fixate (caps);
+}
+
+/* text of meta events is usually ASCII or Latin-1 */
+static gchar *
+gst_smfdec_meta_text (const guint8 *data, guint len)
+{
+  if (g_utf8_validate ((const gchar *) data, len, NULL))
+    return g_strndup ((const gchar *) data, len);
+  return g_convert ((const gchar *) data, len, "UTF-8", "ISO-8859-1", 
+      NULL, NULL, NULL);
+}
+
+/* adds what a meta event of type says about the file to the tags. data is
+ * what follows the length. */
+static void
+gst_smfdec_meta_tag (GstSmfdec *dec, guint type, const guint8 *data, 
+    guint len)
+{
+  static const gchar *major[] = { "Cb", "Gb", "Db", "Ab", "Eb", "Bb", "F",
+      "C", "G", "D", "A", "E", "B", "F#", "C#" };
+  static const gchar *minor[] = { "Ab", "Eb", "Bb", "F", "C", "G", "D", 
+      "A", "E", "B", "F#", "C#", "G#", "D#", "A#" };
+  gchar *text;
+  gint sharps;
+
+  switch (type) {
+    case 0x01:
+    case 0x02:
+    case 0x03:
+      if (len == 0)
+	return;
+      text = gst_smfdec_meta_text (data, len);
+      if (text == NULL)
+	return;
+      GST_DEBUG_OBJECT (dec, "text meta event 0x%02X: %s", type, text);
+      if (type == 0x01) {
+	gst_tag_list_add (gst_smfdec_get_tags (dec), GST_TAG_MERGE_APPEND,
+	    GST_TAG_COMMENT, text, NULL);
+      } else if (type == 0x02) {
+	gst_tag_list_add (gst_smfdec_get_tags (dec), GST_TAG_MERGE_KEEP,
+	    GST_TAG_COPYRIGHT, text, NULL);
+      } else {
+	/* the name of the first track is the name of the song */
+	gst_tag_list_add (gst_smfdec_get_tags (dec), GST_TAG_MERGE_KEEP,
+	    GST_TAG_TITLE, text, NULL);
+	gst_tag_list_add (gst_smfdec_get_tags (dec), GST_TAG_MERGE_APPEND,
+	    GST_TAG_MIDI_TRACK_NAME, text, NULL);
+      }
+      g_free (text);
+      break;
+    case 0x58:
+      if (len != 4)
+	return;
+      text = g_strdup_printf ("%d/%d", (int) data[0], 1 << MIN (data[1], 30));
+      gst_tag_list_add (gst_smfdec_get_tags (dec), GST_TAG_MERGE_KEEP,
+	  GST_TAG_MIDI_TIME_SIGNATURE, text, NULL);
+      g_free (text);
+      break;
+    case 0x59:
+      if (len != 2)
+	return;
+      sharps = (gint8) data[0];
+      if (sharps < -7 || sharps > 7)
+	return;
+      text = g_strdup_printf ("%s %s", data[1] ? minor[sharps + 7] : 
+	  major[sharps + 7], data[1] ? "minor" : "major");
+      gst_tag_list_add (gst_smfdec_get_tags (dec), GST_TAG_MERGE_KEEP,
+	  GST_TAG_MIDI_KEY_SIGNATURE, text, NULL);
+      g_free (text);
+      break;
+    default:
+      break;
+  }
+}
+
+/* returns why a meta event of type with len bytes of data can't be played 
+ * or NULL if it can */
+static gchar *
+gst_smfdec_meta_invalid (guint type, guint len)
+{
+  switch (type) {
+    case 0x51:
+      if (len != 3)
+	return g_strdup_printf ("tempo meta event not 3 bytes long, but %u", 
+	    len);
+      break;
+    case 0x58:
+      if (len != 4)
+	return g_strdup_printf ("time signature meta event not 4 bytes long, "
+	    "but %u", len);
+      break;
+    case 0x59:
+      if (len != 2)
+	return g_strdup_printf ("key signature meta event not 2 bytes long, "
+	    "but %u", len);
+      break;
+    default:
+      break;
+  }
+  return NULL;
+}
+
 static gboolean
 gst_smfdec_meta_event (GstSmfdec *dec, const guint8 *data, guint len)
 {
-  guint check, skip, type;
+  guint check, skip, type, tempo;
+  gchar *error;
   
   type = data[0];
   check = gst_midi_data_parse_varlen (data + 1, len, &skip);
   data += skip + 1; 
   len -= (skip + 1);
   g_assert (len == check);
+
+  error = gst_smfdec_meta_invalid (type, len);
+  if (error) {
+    GST_ELEMENT_ERROR (dec, STREAM, DECODE, (NULL), ("%s", error));
+    g_free (error);
+    return FALSE;
+  }
   
   switch (type) {
     case 0x01:
       /* comment */
-      g_print ("comment: %*s\n", len, data);
-      break;
     case 0x02:
       /* copyright */
-      g_print ("copyright: %*s\n", len, data);
-      break;
     case 0x03:
       /* track name */
-      g_print ("track name: %*s\n", len, data);
       break;
     case 0x51:
       /* tempo change */
-      if (len != 3) {
-	GST_ELEMENT_ERROR (dec, STREAM, DECODE, (NULL),
-	    ("tempo meta event not 3 bytes long, but %u", len));
-	return FALSE;
-      }
-      g_print ("got a tempo change\n");
-      gst_smfdec_set_tempo (dec, ((data[0] << 16) + (data[1] << 8) + data[2]));
+      tempo = (data[0] << 16) + (data[1] << 8) + data[2];
+      /* the file starts with the last tempo set at tick 0 */
+      if (!dec->tags_scanned && dec->tick == 0 && tempo > 0)
+	gst_tag_list_add (gst_smfdec_get_tags (dec), GST_TAG_MERGE_REPLACE,
+	    GST_TAG_BEATS_PER_MINUTE, 60000000.0 / tempo, NULL);
+      gst_smfdec_set_tempo (dec, tempo);
       break;
     case 0x58:
       /* time signature */
-      if (len != 4) {
-	GST_ELEMENT_ERROR (dec, STREAM, DECODE, (NULL),
-	    ("time signature meta event not 4 bytes long, but %u", len));
-	return FALSE;
-      }
-      g_print ("this is a %d/%d song\n", (int) data[0], 1 << data[1]);
-      break;
     case 0x59:
       /* key signature */
-      if (len != 2) {
-	GST_ELEMENT_ERROR (dec, STREAM, DECODE, (NULL),
-	    ("key signature meta event not 2 bytes long, but %u", len));
-	return FALSE;
-      }
-      g_print ("this song is keyed as %d %s %s\n", 
-	  (int) data[0] - (data[0] > 127 ? 255 : 0), data[0] <= 7 ? "sharp" : "flat",
-	  data[1] ? "minor" : "major");
       break;
     default:
-      GST_WARNING ("meta event 0x%02X not yet handled", (int) type);
-      break;
+      GST_LOG ("meta event 0x%02X not handled", (int) type);
+      return TRUE;
   }
+  if (!dec->tags_scanned)
+    gst_smfdec_meta_tag (dec, type, data, len);
   return TRUE;
 }
 
-static GstFlowReturn
-gst_smfdec_chain (GstPad * pad, GstBuffer * data)
+/* adds an event at dec->tick to the image being built */
+static void
+gst_smfdec_cache_record (GstSmfdec *dec, guint8 status, const guint8 *data,
+    guint len)
 {
-	GstSmfdec *dec = GST_SMFDEC (gst_pad_get_parent (pad));
-	gint i, ticks;
-	guint len, midi_len;
+  GstSmfdecCacheEvent event;
 
-	/* we must be negotiated */
-	g_assert ( dec != NULL );
-	g_assert (dec->buf_denom > 0);
+  event.time = gst_smfdec_update_time (dec);
+  event.tick = dec->tick;
+  event.offset = dec->cache_data->len;
+  event.length = len;
+  event.status = status;
+  memset (event.padding, 0, sizeof (event.padding));
+  g_array_append_val (dec->cache_events, event);
+  g_byte_array_append (dec->cache_data, data, len);
+}
 
-	gst_adapter_push (dec->adapter, GST_BUFFER (data));
-	if (dec->chunk.fourcc) {
-		chunk_ensure (dec->adapter, &dec->chunk, 0);
-	}
+/* handles one event at dec->tick, data follows the status byte and is part
+ * of track, so sysex payloads can reference it. If track is NULL, they are 
+ * copied. */
+static gboolean
+gst_smfdec_event (GstSmfdec *dec, GstBuffer *track, guint8 status,
+    const guint8 *data, guint len)
+{
+  GstBuffer *payload;
+  guint skip;
+  gint size;
 
-	while (dec->chunk.fourcc || get_next_chunk (dec->adapter, &dec->chunk)) {
-		switch (dec->chunk.fourcc) {
-			case GST_MAKE_FOURCC ('M', 'T', 'h', 'd'):
-				if (dec->format) {
-					GST_ELEMENT_ERROR (dec, STREAM, DECODE, (NULL), 
-							("got a header chunk while already initialized"));
-					goto error;
-				}
-				if (dec->chunk.length != 6) {
-					GST_ELEMENT_ERROR (dec, STREAM, DECODE, (NULL), 
-							("header chunk %d bytes long, not 6", (int) dec->chunk.length));
-					goto error;
-				}
-				if (!chunk_ensure (dec->adapter, &dec->chunk, 6))
-					goto out;
-				/* we add one, so we can use 0 for uninitialized */
-				dec->format = GST_READ_UINT16_BE (dec->chunk.data) + 1;
-				if (dec->format > 2)
-					g_warning ("I have no clue if midi format %u works", dec->format - 1);
-				dec->tracks_missing = GST_READ_UINT16_BE (dec->chunk.data + 2);
-				//g_assert (dec->tracks_missing == 1);
-				/* ignore the number of track atoms */
-				i = (gint16) GST_READ_UINT16_BE (dec->chunk.data + 4);
-				if (i < 0) {
-					GST_ELEMENT_ERROR (dec, STREAM, NOT_IMPLEMENTED, (NULL), 
-							("can't handle smpte timing"));
-					goto error;
-				} else {
-					dec->start = 0;
-					dec->division = i;
-				}
-				chunk_flush (dec->adapter, &dec->chunk);
-				break;
-			case GST_MAKE_FOURCC ('M', 'T', 'r', 'k'):
-				if (dec->format == 0) {
-					GST_ELEMENT_ERROR (dec, STREAM, DECODE, (NULL), 
-							("got a track chunk while not yet initialized"));
-					goto error;
-				}
-				/* figure out if we have enough data */
-				ticks = gst_midi_data_parse_varlen (dec->chunk.data, dec->chunk.available, &len);
-				if (ticks == -1) goto out;
-				if (ticks == -2) {
-					GST_ELEMENT_ERROR (dec, STREAM, DECODE, (NULL), 
-							("invalid delta time value"));
-					goto error;
-				}
-				midi_len = gst_midi_data_get_length (dec->chunk.data + len, 
-						dec->chunk.available - len, dec->status);
-				if (midi_len == 0) goto out;
-				/* we have enough data, process */
-				dec->ticks += ticks;
-				//g_print ("got %u ticks, now %u\n", ticks, dec->ticks);
-				if (dec->chunk.data[len] & 0x80) {
-					dec->status = dec->chunk.data[len];
-					len++;
-					midi_len--;
-				}
-				if (dec->status == 0xFF) {
-					if (!gst_smfdec_meta_event (dec, dec->chunk.data + len, midi_len))
-						goto error;
-				} else {
-					gst_smfdec_buffer_append (dec, dec->status, dec->chunk.data + len, midi_len);
-				}
-				chunk_skip (dec->adapter, &dec->chunk, len + midi_len);
-				if (dec->chunk.length == 0)
-					chunk_clear (&dec->chunk);
-				break;
-			default:
-				goto out;
-		}
-	}
-out:
+  if (G_UNLIKELY (dec->cache_events)) {
+    /* building an image, only tempo changes need to be handled */
+    gst_smfdec_cache_record (dec, status, data, len);
+    if (status != 0xFF || data[0] != 0x51)
+      return TRUE;
+  }
+  if (G_UNLIKELY (dec->scan) && status != 0xFF)
+    return TRUE;
+
+  if (status == 0xFF) {
+    return gst_smfdec_meta_event (dec, data, len);
+  } else if (status == 0xF0 || status == 0xF7) {
+    size = gst_midi_data_parse_varlen (data, len, &skip);
+    g_assert (size >= 0 && skip + size == len);
+    if (track) {
+      payload = gst_buffer_create_sub (track, 
+	  data + skip - GST_BUFFER_DATA (track), size);
+    } else {
+      payload = gst_buffer_new_and_alloc (size);
+      memcpy (GST_BUFFER_DATA (payload), data + skip, size);
+    }
+    gst_smfdec_buffer_append_sysex (dec, status, payload);
+    gst_buffer_unref (payload);
+    return TRUE;
+  }
+
+  gst_smfdec_buffer_append (dec, status, data, len);
+  return TRUE;
+}
+
+/* processes all complete events of the available part of a track chunk */
+static gboolean
+gst_smfdec_track (GstSmfdec *dec)
+{
+  GstSmfTrackEvent *event;
+  GstBuffer *track;
+  const guint8 *data;
+  guint64 tick = 0;
+  guint8 status = dec->status;
+  gint scanned;
+  guint i, len;
+
+  if (dec->chunk.available == 0)
+    return TRUE;
+  g_array_set_size (dec->events, 0);
+  scanned = gst_smf_track_scan (dec->chunk.data, dec->chunk.available, &tick, 
+      &status, dec->events);
+  if (scanned < 0) {
+    GST_ELEMENT_ERROR (dec, STREAM, DECODE, (NULL), 
+	("invalid track chunk"));
+    return FALSE;
+  }
+  if ((guint) scanned < dec->chunk.available && 
+      dec->chunk.available == dec->chunk.length) {
+    GST_ELEMENT_ERROR (dec, STREAM, DECODE, (NULL), 
+	("truncated event at the end of a track chunk"));
+    return FALSE;
+  }
+  if (scanned == 0) {
+    /* an event is bigger than what we have, wait until there's a lot more
+     * instead of copying the data around for every buffer */
+    dec->chunk.needed = MIN (2 * dec->chunk.available, dec->chunk.length);
+    return TRUE;
+  }
+
+  /* keep the events in a buffer, so sysex events can reference them */
+  track = chunk_take (dec->adapter, &dec->chunk, scanned);
+  tick = 0;
+  for (i = 0; i < dec->events->len; i++) {
+    event = &g_array_index (dec->events, GstSmfTrackEvent, i);
+    dec->tick += event->tick - tick;
+    tick = event->tick;
+    data = GST_BUFFER_DATA (track) + event->offset;
+    len = event->length;
+    if (data[0] & 0x80) {
+      status = data[0];
+      data++;
+      len--;
+      /* system events don't change the running status */
+      if (status < 0xF0)
+	dec->status = status;
+    } else {
+      status = dec->status;
+    }
+    if (!gst_smfdec_event (dec, track, status, data, len)) {
+      gst_buffer_unref (track);
+      return FALSE;
+    }
+  }
+  gst_buffer_unref (track);
+  return TRUE;
+}
+
+/* orders tracks by the tick of their next event. At the same tick, earlier
+ * tracks go first, so tempo changes in the conductor track apply to the
+ * events of all other tracks at that tick */
+#define TRACK_BEFORE(a,b) ((a)->cursor.tick < (b)->cursor.tick || \
+    ((a)->cursor.tick == (b)->cursor.tick && (a)->index < (b)->index))
+
+static void
+gst_smfdec_heap_down (GstSmfdecTrack **heap, guint n, guint i)
+{
+  GstSmfdecTrack *track = heap[i];
+  guint child;
+
+  while ((child = 2 * i + 1) < n) {
+    if (child + 1 < n && TRACK_BEFORE (heap[child + 1], heap[child]))
+      child++;
+    if (!TRACK_BEFORE (heap[child], track))
+      break;
+    heap[i] = heap[child];
+    i = child;
+  }
+  heap[i] = track;
+}
+
+/* reads a track that isn't in memory yet in place */
+static GstFlowReturn
+gst_smfdec_track_pull (GstSmfdec *dec, GstSmfdecTrack *track)
+{
+  GstFlowReturn ret;
+
+  if (track->buffer)
+    return GST_FLOW_OK;
+
+  ret = gst_pad_pull_range (dec->sink, track->offset, track->length, 
+      &track->buffer);
+  if (ret != GST_FLOW_OK)
+    return ret;
+  if (GST_BUFFER_SIZE (track->buffer) < track->length) {
+    gst_buffer_unref (track->buffer);
+    track->buffer = NULL;
+    GST_ELEMENT_ERROR (dec, STREAM, DECODE, (NULL), 
+	("track chunk %u is truncated", track->index));
+    return GST_FLOW_ERROR;
+  }
+  return GST_FLOW_OK;
+}
+
+/* puts the cursor of the track on its first event at or after tick, starting
+ * from the last checkpoint before it. Returns like 
+ * gst_smf_track_cursor_next() */
+static gint
+gst_smfdec_track_seek (GstSmfdecTrack *track, guint64 tick)
+{
+  GstSmfdecCheckpoint *checkpoint;
+  guint low = 0, high = 0, mid;
+  gint next;
+
+  gst_smf_track_cursor_init (&track->cursor, GST_BUFFER_DATA (track->buffer),
+      track->length);
+  track->cursor.tick = track->tick;
+
+  if (track->checkpoints)
+    high = track->checkpoints->len;
+  while (low < high) {
+    mid = (low + high) / 2;
+    checkpoint = &g_array_index (track->checkpoints, GstSmfdecCheckpoint, mid);
+    if (checkpoint->tick < tick)
+      low = mid + 1;
+    else
+      high = mid;
+  }
+  if (low > 0) {
+    checkpoint = &g_array_index (track->checkpoints, GstSmfdecCheckpoint, low - 1);
+    track->cursor.data += checkpoint->offset;
+    track->cursor.tick = checkpoint->tick;
+    track->cursor.status = checkpoint->status;
+  }
+
+  do {
+    next = gst_smf_track_cursor_next (&track->cursor);
+  } while (next > 0 && track->cursor.tick < tick);
+  return next;
+}
+
+/* Starts playing tracks first to last - 1 at the same time, continuing with
+ * their first events at or after dec->tick. Tracks that weren't read yet are 
+ * pulled in place. */
+static GstFlowReturn
+gst_smfdec_merge_start (GstSmfdec *dec, guint first, guint last)
+{
+  GstSmfdecTrack *track;
+  GstFlowReturn ret;
+  guint i;
+  gint next;
+
+  g_assert (dec->heap_size == 0);
+
+  dec->heap = g_renew (GstSmfdecTrack *, dec->heap, last - first);
+  for (i = first; i < last; i++) {
+    track = g_ptr_array_index (dec->tracks, i);
+    ret = gst_smfdec_track_pull (dec, track);
+    if (ret != GST_FLOW_OK)
+      return ret;
+    next = gst_smfdec_track_seek (track, dec->tick);
+    if (next < 0)
+      goto invalid;
+    if (next > 0)
+      dec->heap[dec->heap_size++] = track;
+  }
+  for (i = dec->heap_size / 2; i > 0; i--)
+    gst_smfdec_heap_down (dec->heap, dec->heap_size, i - 1);
+  return GST_FLOW_OK;
+
+invalid:
+  dec->heap_size = 0;
+  GST_ELEMENT_ERROR (dec, STREAM, DECODE, (NULL), 
+      ("invalid track chunk"));
+  return GST_FLOW_ERROR;
+}
+
+/* handles up to max_events events of the tracks being played, always the
+ * earliest event of all tracks next */
+static gboolean
+gst_smfdec_merge_step (GstSmfdec *dec, guint max_events)
+{
+  GstSmfdecTrack *track;
+  gint next;
+
+  while (dec->heap_size > 0 && max_events-- > 0) {
+    track = dec->heap[0];
+    dec->tick = track->cursor.tick;
+    if (!gst_smfdec_event (dec, track->buffer, track->cursor.event_status,
+	  track->cursor.event, track->cursor.length))
+      return FALSE;
+    next = gst_smf_track_cursor_next (&track->cursor);
+    if (next < 0) {
+      GST_ELEMENT_ERROR (dec, STREAM, DECODE, (NULL), 
+	  ("invalid track chunk"));
+      return FALSE;
+    }
+    if (next == 0 && --dec->heap_size > 0)
+      dec->heap[0] = dec->heap[dec->heap_size];
+    if (dec->heap_size > 0)
+      gst_smfdec_heap_down (dec->heap, dec->heap_size, 0);
+  }
+  return TRUE;
+}
+
+/* plays all tracks of a format 1 file that were collected in push mode */
+static gboolean
+gst_smfdec_merge (GstSmfdec *dec)
+{
+  gboolean ret;
+
+  ret = gst_smfdec_merge_start (dec, 0, dec->tracks->len) == GST_FLOW_OK &&
+      gst_smfdec_merge_step (dec, G_MAXUINT);
+  gst_smfdec_clear_tracks (dec);
+  return ret;
+}
+
+/* takes the track chunk out of the adapter for merging, merges once all 
+ * tracks are there */
+static gboolean
+gst_smfdec_add_track (GstSmfdec *dec)
+{
+  GstSmfdecTrack *track;
+
+  if (dec->tracks_missing == 0) {
+    GST_WARNING ("file has more tracks than announced, ignoring them");
+    gst_adapter_flush (dec->adapter, dec->chunk.length);
+    return TRUE;
+  }
+  dec->tracks_missing--;
+  if (dec->chunk.length > 0) {
+    track = g_new0 (GstSmfdecTrack, 1);
+    track->buffer = gst_adapter_take_buffer (dec->adapter, dec->chunk.length);
+    track->offset = 0;
+    track->length = dec->chunk.length;
+    track->tick = dec->tick;
+    track->end_tick = dec->tick;
+    track->checkpoints = NULL;
+    track->index = dec->tracks->len;
+    g_ptr_array_add (dec->tracks, track);
+  }
+  if (dec->tracks_missing == 0)
+    return gst_smfdec_merge (dec);
+  return TRUE;
+}
+
+/* parses the contents of a header chunk */
+static gboolean
+gst_smfdec_header (GstSmfdec *dec, const guint8 *data, guint length)
+{
+  gint division;
+
+  if (dec->format) {
+    GST_ELEMENT_ERROR (dec, STREAM, DECODE, (NULL), 
+	("got a header chunk while already initialized"));
+    return FALSE;
+  }
+  if (length != 6) {
+    GST_ELEMENT_ERROR (dec, STREAM, DECODE, (NULL), 
+	("header chunk %u bytes long, not 6", length));
+    return FALSE;
+  }
+  /* we add one, so we can use 0 for uninitialized */
+  dec->format = GST_READ_UINT16_BE (data) + 1;
+  if (dec->format > 2)
+    g_warning ("I have no clue if midi format %u works", dec->format - 1);
+  dec->tracks_missing = GST_READ_UINT16_BE (data + 2);
+  division = (gint16) GST_READ_UINT16_BE (data + 4);
+  if (division < 0) {
+    GST_ELEMENT_ERROR (dec, STREAM, NOT_IMPLEMENTED, (NULL), 
+	("can't handle smpte timing"));
+    return FALSE;
+  } else if (division == 0) {
+    GST_ELEMENT_ERROR (dec, STREAM, DECODE, (NULL), 
+	("header chunk has a division of 0"));
+    return FALSE;
+  }
+  gst_smfdec_set_division (dec, division);
+  return TRUE;
+}
+
+static gboolean
+gst_smfdec_sink_event (GstPad *pad, GstEvent *event)
+{
+  GstSmfdec *dec = GST_SMFDEC (gst_pad_get_parent (pad));
+  gboolean ret;
+
+  switch (GST_EVENT_TYPE (event)) {
+    case GST_EVENT_EOS:
+      /* play what we got of files with missing tracks */
+      if (dec->tracks->len > 0)
+	gst_smfdec_merge (dec);
+      if (dec->buf)
+	gst_smfdec_buffer_push (dec);
+      if (dec->format > 0) {
+	dec->duration = gst_smfdec_update_time (dec);
+	gst_tag_list_add (gst_smfdec_get_tags (dec), GST_TAG_MERGE_REPLACE,
+	    GST_TAG_DURATION, dec->duration, NULL);
+      }
+      gst_smfdec_push_tags (dec);
+      break;
+    default:
+      break;
+  }
+  ret = gst_pad_event_default (pad, event);
+  gst_object_unref (dec);
+  return ret;
+}
+
+static GstFlowReturn
+gst_smfdec_chain (GstPad * pad, GstBuffer * data)
+{
+	GstSmfdec *dec = GST_SMFDEC (gst_pad_get_parent (pad));
+
+	/* we must be negotiated */
+	g_assert ( dec != NULL );
+	g_assert (dec->buf_denom > 0);
+
+	gst_adapter_push (dec->adapter, GST_BUFFER (data));
+
+	while (dec->chunk.fourcc || get_next_chunk (dec->adapter, &dec->chunk)) {
+		switch (dec->chunk.fourcc) {
+			case GST_MAKE_FOURCC ('M', 'T', 'h', 'd'):
+				if (dec->chunk.length == 6 && 
+						!chunk_ensure (dec->adapter, &dec->chunk, 6))
+					goto out;
+				if (!gst_smfdec_header (dec, dec->chunk.data, dec->chunk.length))
+					goto error;
+				chunk_flush (dec->adapter, &dec->chunk);
+				break;
+			case GST_MAKE_FOURCC ('M', 'T', 'r', 'k'):
+				if (dec->format == 0) {
+					GST_ELEMENT_ERROR (dec, STREAM, DECODE, (NULL), 
+							("got a track chunk while not yet initialized"));
+					goto error;
+				}
+				if (dec->format == 2) {
+					/* format 1: all tracks play at the same time */
+					if (gst_adapter_available (dec->adapter) < dec->chunk.length)
+						goto out;
+					if (!gst_smfdec_add_track (dec))
+						goto error;
+					chunk_clear (&dec->chunk);
+					break;
+				}
+				chunk_update (dec->adapter, &dec->chunk);
+				if (!gst_smfdec_track (dec))
+					goto error;
+				/* the rest of the track comes with the next buffer */
+				if (dec->chunk.length > 0)
+					goto out;
+				chunk_clear (&dec->chunk);
+				break;
+			default:
+				goto out;
+		}
+	}
+out:
 	gst_object_unref(dec);
 	return GST_FLOW_OK;;
 
@@ -406,23 +1362,1415 @@ error:
 	return GST_FLOW_ERROR;
 }
 
+/*** pull mode ***************************************************************/
+
+/* number of events handled per iteration of the streaming task */
+#define LOOP_EVENTS (256)
+
+/* reads the header and makes a table of the track chunks in the file, the
+ * tracks themselves are only pulled when they are played */
+static GstFlowReturn
+gst_smfdec_pull_index (GstSmfdec *dec)
+{
+  GstSmfdecTrack *track;
+  GstFlowReturn ret;
+  GstBuffer *buf;
+  guint64 offset = 0;
+  guint32 fourcc, length;
+  gboolean valid;
+
+  while (TRUE) {
+    ret = gst_pad_pull_range (dec->sink, offset, 8, &buf);
+    if (ret == GST_FLOW_UNEXPECTED)
+      break;
+    if (ret != GST_FLOW_OK)
+      return ret;
+    if (GST_BUFFER_SIZE (buf) < 8) {
+      gst_buffer_unref (buf);
+      break;
+    }
+    fourcc = GST_READ_UINT32_LE (GST_BUFFER_DATA (buf));
+    length = GST_READ_UINT32_BE (GST_BUFFER_DATA (buf) + 4);
+    gst_buffer_unref (buf);
+    offset += 8;
+
+    switch (fourcc) {
+      case GST_MAKE_FOURCC ('M', 'T', 'h', 'd'):
+	ret = gst_pad_pull_range (dec->sink, offset, 6, &buf);
+	if (ret != GST_FLOW_OK)
+	  return ret;
+	valid = GST_BUFFER_SIZE (buf) == 6 &&
+	    gst_smfdec_header (dec, GST_BUFFER_DATA (buf), length);
+	gst_buffer_unref (buf);
+	if (!valid)
+	  return GST_FLOW_ERROR;
+	break;
+      case GST_MAKE_FOURCC ('M', 'T', 'r', 'k'):
+	if (dec->format == 0) {
+	  GST_ELEMENT_ERROR (dec, STREAM, DECODE, (NULL), 
+	      ("got a track chunk while not yet initialized"));
+	  return GST_FLOW_ERROR;
+	}
+	if (length == 0)
+	  break;
+	track = g_new0 (GstSmfdecTrack, 1);
+	track->buffer = NULL;
+	track->offset = offset;
+	track->length = length;
+	track->tick = 0;
+	track->end_tick = 0;
+	track->checkpoints = NULL;
+	track->index = dec->tracks->len;
+	g_ptr_array_add (dec->tracks, track);
+	break;
+      default:
+	GST_DEBUG ("skipping unknown chunk %"GST_FOURCC_FORMAT, 
+	    GST_FOURCC_ARGS (fourcc));
+	break;
+    }
+    offset += length;
+  }
+
+  if (dec->format == 0) {
+    GST_ELEMENT_ERROR (dec, STREAM, WRONG_TYPE, (NULL), 
+	("no header chunk found"));
+    return GST_FLOW_ERROR;
+  }
+  GST_DEBUG ("found %u tracks", dec->tracks->len);
+  return GST_FLOW_OK;
+}
+
+/* number of events between two checkpoints of a track */
+#define CHECKPOINT_EVENTS (512)
+
+typedef struct {
+  guint64		tick;
+  guint			track;
+  guint			event;		/* number of the event in the track */
+  guint			tempo;		/* microseconds per quarter note */
+} TempoChange;
+
+/* sorts tempo changes in the order they are played */
+static gint
+tempo_change_compare (gconstpointer a, gconstpointer b)
+{
+  const TempoChange *ca = a, *cb = b;
+
+  if (ca->tick != cb->tick)
+    return ca->tick < cb->tick ? -1 : 1;
+  if (ca->track != cb->track)
+    return ca->track < cb->track ? -1 : 1;
+  return ca->event < cb->event ? -1 : (ca->event > cb->event);
+}
+
+/* number of changes between two GstSmfdecChannels of the decoder */
+#define CHANNELS_INTERVAL (256)
+
+/* if a seek needs to restore the channel event */
+static inline gboolean
+gst_smfdec_is_change (guint8 status, const guint8 *data)
+{
+  switch (status & 0xF0) {
+    case 0xB0:
+      /* controllers and reset all controllers, not the other channel modes */
+      return data[0] < 120 || data[0] == 121;
+    case 0xC0:
+    case 0xE0:
+      return TRUE;
+    default:
+      return FALSE;
+  }
+}
+
+static void
+gst_smfdec_channels_apply (GstSmfdecChannels *channels, 
+    const GstSmfdecChange *change)
+{
+  guint channel = change->status & 0xF, i;
+
+  switch (change->status & 0xF0) {
+    case 0xB0:
+      if (change->data[0] < 120) {
+	channels->controllers[channel][change->data[0]] = change->data[1];
+	break;
+      }
+      /* reset all controllers, but not bank, volume, pan and effects */
+      channels->bend[channel] = -1;
+      for (i = 0; i < 120; i++) {
+	if (i != 0 && i != 32 && i != 7 && i != 10 && (i < 91 || i > 95))
+	  channels->controllers[channel][i] = -1;
+      }
+      break;
+    case 0xC0:
+      channels->program[channel] = change->data[0];
+      break;
+    case 0xE0:
+      channels->bend[channel] = change->data[0] | (change->data[1] << 7);
+      break;
+    default:
+      g_assert_not_reached ();
+  }
+}
+
+/* takes the setup of the channels every CHANNELS_INTERVAL changes, so it can
+ * be found for any tick without going through all changes before */
+static void
+gst_smfdec_channels_index (GstSmfdec *dec)
+{
+  GstSmfdecChannels channels;
+  guint i;
+
+  memset (&channels, 0xFF, sizeof (channels));
+  g_array_set_size (dec->channels, 0);
+  for (i = 0; i < dec->changes->len; i++) {
+    if (i % CHANNELS_INTERVAL == 0)
+      g_array_append_val (dec->channels, channels);
+    gst_smfdec_channels_apply (&channels, 
+	&g_array_index (dec->changes, GstSmfdecChange, i));
+  }
+}
+
+/* the setup of the channels by the changes before tick */
+static void
+gst_smfdec_channels_at (GstSmfdec *dec, guint64 tick, 
+    GstSmfdecChannels *channels)
+{
+  guint low = 0, high = dec->changes->len, mid, i;
+
+  while (low < high) {
+    mid = (low + high) / 2;
+    if (g_array_index (dec->changes, GstSmfdecChange, mid).tick < tick)
+      low = mid + 1;
+    else
+      high = mid;
+  }
+  if (low == 0) {
+    memset (channels, 0xFF, sizeof (GstSmfdecChannels));
+    return;
+  }
+  i = (low - 1) / CHANNELS_INTERVAL;
+  *channels = g_array_index (dec->channels, GstSmfdecChannels, i);
+  for (i *= CHANNELS_INTERVAL; i < low; i++)
+    gst_smfdec_channels_apply (channels, 
+	&g_array_index (dec->changes, GstSmfdecChange, i));
+}
+
+/* Merges the changes of the tracks of a format 1 file, which follow each 
+ * other in dec->changes from runs[i] on and are in the order they are played
+ * already. At the same tick, the earlier track goes first. */
+static void
+gst_smfdec_changes_merge (GstSmfdec *dec, guint *runs, guint n_runs)
+{
+  GArray *from = dec->changes, *to, *tmp;
+  const GstSmfdecChange *a, *a_end, *b, *b_end;
+  GstSmfdecChange *out, *end;
+  guint i;
+
+  to = g_array_sized_new (FALSE, FALSE, sizeof (GstSmfdecChange), from->len);
+  g_array_set_size (to, from->len);
+  while (n_runs > 1) {
+    end = (GstSmfdecChange *) from->data + from->len;
+    for (i = 0; i < n_runs; i += 2) {
+      a = (GstSmfdecChange *) from->data + runs[i];
+      a_end = i + 1 < n_runs ? (GstSmfdecChange *) from->data + runs[i + 1] : 
+	  end;
+      b = a_end;
+      b_end = i + 2 < n_runs ? (GstSmfdecChange *) from->data + runs[i + 2] : 
+	  end;
+      out = (GstSmfdecChange *) to->data + runs[i];
+      while (a < a_end && b < b_end)
+	*out++ = b->tick < a->tick ? *b++ : *a++;
+      memcpy (out, a, (a_end - a) * sizeof (GstSmfdecChange));
+      out += a_end - a;
+      memcpy (out, b, (b_end - b) * sizeof (GstSmfdecChange));
+      runs[i / 2] = runs[i];
+    }
+    n_runs = (n_runs + 1) / 2;
+    tmp = from;
+    from = to;
+    to = tmp;
+  }
+  dec->changes = from;
+  g_array_free (to, TRUE);
+}
+
+/* a meta event that could say something about the file */
+typedef struct {
+  guint			offset;		/* position of the data after the length */
+  guint			length;		/* length of the data */
+  guint8		type;
+} MetaTag;
+
+/* reading a track once for the map, done by the workers for format 1 files */
+typedef struct {
+  GstSmfdecJob		job;
+  GstSmfdecTrack *	track;
+  guint			n;		/* number of the track */
+  GArray *		tempos;		/* TempoChange found */
+  GArray *		changes;	/* GstSmfdecChange found */
+  GArray *		tags;		/* MetaTag found */
+  gboolean		valid;		/* if the track could be read */
+} TrackMap;
+
+/* places checkpoints in a track and collects what is needed for the map */
+static void
+gst_smfdec_track_map (GstSmfdecJob *job, GstSmfdec *dec)
+{
+  TrackMap *map = (TrackMap *) job;
+  GstSmfdecTrack *track = map->track;
+  GstSmfdecCheckpoint checkpoint;
+  TempoChange change;
+  GstSmfdecChange channel_change;
+  MetaTag tag;
+  const guint8 *data;
+  guint n, skip, len;
+  gint next;
+
+  memset (&channel_change, 0, sizeof (channel_change));
+  if (track->checkpoints)
+    g_array_set_size (track->checkpoints, 0);
+  else
+    track->checkpoints = g_array_new (FALSE, FALSE, 
+	sizeof (GstSmfdecCheckpoint));
+  gst_smf_track_cursor_init (&track->cursor, GST_BUFFER_DATA (track->buffer),
+      track->length);
+  track->cursor.tick = track->tick;
+  for (n = 1; (next = gst_smf_track_cursor_next (&track->cursor)) > 0; n++) {
+    data = track->cursor.event;
+    if (track->cursor.event_status == 0xFF) {
+      len = gst_midi_data_parse_varlen (data + 1, track->cursor.length - 1, 
+	  &skip);
+      if (data[0] == 0x51 && len == 3) {
+	change.tick = track->cursor.tick;
+	change.track = map->n;
+	change.event = n;
+	data += skip + 1;
+	change.tempo = (data[0] << 16) + (data[1] << 8) + data[2];
+	g_array_append_val (map->tempos, change);
+      } else if (skip + 1 + len == track->cursor.length) {
+	tag.offset = data + skip + 1 - GST_BUFFER_DATA (track->buffer);
+	tag.length = len;
+	tag.type = data[0];
+	g_array_append_val (map->tags, tag);
+      }
+    } else if (gst_smfdec_is_change (track->cursor.event_status, data) &&
+	!dec->scan) {
+      channel_change.tick = track->cursor.tick;
+      channel_change.track = map->n;
+      channel_change.event = n;
+      channel_change.status = track->cursor.event_status;
+      channel_change.data[0] = data[0];
+      channel_change.data[1] = track->cursor.length > 1 ? data[1] : 0;
+      g_array_append_val (map->changes, channel_change);
+    }
+    if (n % CHECKPOINT_EVENTS == 0 && !dec->scan) {
+      checkpoint.tick = track->cursor.tick;
+      checkpoint.offset = track->cursor.data - GST_BUFFER_DATA (track->buffer);
+      checkpoint.status = track->cursor.status;
+      g_array_append_val (track->checkpoints, checkpoint);
+    }
+  }
+  map->valid = next == 0;
+  track->end_tick = track->cursor.tick;
+}
+
+/* adds what was found in a track to the tags, the tempo changes and the
+ * channel changes */
+static gboolean
+gst_smfdec_track_map_collect (GstSmfdec *dec, TrackMap *map, GArray *tempos)
+{
+  GstSmfdecTrack *track = map->track;
+  MetaTag *tag;
+  guint i;
+
+  if (!map->valid) {
+    GST_ELEMENT_ERROR (dec, STREAM, DECODE, (NULL), 
+	("invalid track chunk"));
+    return FALSE;
+  }
+  for (i = 0; i < map->tags->len; i++) {
+    tag = &g_array_index (map->tags, MetaTag, i);
+    gst_smfdec_meta_tag (dec, tag->type, 
+	GST_BUFFER_DATA (track->buffer) + tag->offset, tag->length);
+  }
+  g_array_append_vals (tempos, map->tempos->data, map->tempos->len);
+  g_array_append_vals (dec->changes, map->changes->data, map->changes->len);
+  /* only one track at a time is needed for playing those */
+  if (dec->format != 2 || dec->scan) {
+    gst_buffer_unref (track->buffer);
+    track->buffer = NULL;
+  }
+  return TRUE;
+}
+
+/* Reads every track once to place checkpoints and find the tempo changes, 
+ * which are made into the tempo map, and the tags. The tracks of format 0 and
+ * 2 files play one after another, so each starts at the last tick of the one 
+ * before. Those of format 1 files all start at 0 and are read by the workers
+ * while the next ones are pulled. */
+static GstFlowReturn
+gst_smfdec_pull_map (GstSmfdec *dec)
+{
+  GstSmfdecTrack *track;
+  GstSmfdecTempo tempo;
+  TempoChange *cur;
+  TrackMap *maps, *map;
+  GstFlowReturn ret = GST_FLOW_OK;
+  GArray *changes;
+  guint64 tick = 0;
+  guint *runs = NULL;
+  guint i, n = dec->tracks->len;
+
+  changes = g_array_new (FALSE, FALSE, sizeof (TempoChange));
+  g_array_set_size (dec->changes, 0);
+  maps = g_new0 (TrackMap, n);
+  for (i = 0; i < n; i++) {
+    map = &maps[i];
+    map->job.func = gst_smfdec_track_map;
+    map->track = g_ptr_array_index (dec->tracks, i);
+    map->n = i;
+    map->tempos = g_array_new (FALSE, FALSE, sizeof (TempoChange));
+    map->changes = g_array_new (FALSE, FALSE, sizeof (GstSmfdecChange));
+    map->tags = g_array_new (FALSE, FALSE, sizeof (MetaTag));
+  }
+  for (i = 0; i < n; i++) {
+    track = maps[i].track;
+    ret = gst_smfdec_track_pull (dec, track);
+    if (ret != GST_FLOW_OK)
+      goto out;
+
+    if (dec->format == 2) {
+      track->tick = 0;
+      gst_smfdec_job_start (dec, &maps[i].job);
+      continue;
+    }
+    track->tick = tick;
+    gst_smfdec_track_map (&maps[i].job, dec);
+    if (!gst_smfdec_track_map_collect (dec, &maps[i], changes)) {
+      ret = GST_FLOW_ERROR;
+      goto out;
+    }
+    tick = track->end_tick;
+  }
+  if (dec->format == 2) {
+    gst_smfdec_jobs_wait (dec);
+    runs = g_new (guint, n);
+    for (i = 0; i < n; i++) {
+      runs[i] = dec->changes->len;
+      if (!gst_smfdec_track_map_collect (dec, &maps[i], changes)) {
+	ret = GST_FLOW_ERROR;
+	goto out;
+      }
+    }
+    gst_smfdec_changes_merge (dec, runs, n);
+  }
+
+  g_array_sort (changes, tempo_change_compare);
+  gst_smfdec_channels_index (dec);
+  tempo.tick = 0;
+  tempo.time = 0;
+  tempo.carry = 0;
+  tempo.tempo = dec->tempo;
+  g_array_append_val (dec->tempo_map, tempo);
+  for (i = 0; i < changes->len; i++) {
+    cur = &g_array_index (changes, TempoChange, i);
+    gst_smfdec_advance (dec, &tempo.time, &tempo.carry, cur->tick - tempo.tick,
+	tempo.tempo / dec->division, tempo.tempo % dec->division);
+    tempo.tick = cur->tick;
+    tempo.tempo = cur->tempo * GST_USECOND;
+    g_array_append_val (dec->tempo_map, tempo);
+  }
+  GST_DEBUG ("tempo map has %u entries", dec->tempo_map->len);
+  /* the tempo the file starts with is the last one set at tick 0 */
+  i = 0;
+  while (i + 1 < dec->tempo_map->len && 
+      g_array_index (dec->tempo_map, GstSmfdecTempo, i + 1).tick == 0)
+    i++;
+  if (i > 0)
+    gst_tag_list_add (gst_smfdec_get_tags (dec), GST_TAG_MERGE_REPLACE,
+	GST_TAG_BEATS_PER_MINUTE, 60.0 * GST_SECOND / 
+	g_array_index (dec->tempo_map, GstSmfdecTempo, i).tempo, NULL);
+  dec->tags_scanned = TRUE;
+
+out:
+  /* the workers still have the tracks after an error */
+  gst_smfdec_jobs_wait (dec);
+  for (i = 0; i < n; i++) {
+    g_array_free (maps[i].tempos, TRUE);
+    g_array_free (maps[i].changes, TRUE);
+    g_array_free (maps[i].tags, TRUE);
+  }
+  g_free (maps);
+  g_free (runs);
+  g_array_free (changes, TRUE);
+  return ret;
+}
+
+/* finds the part of the tempo map tick is in */
+static guint
+gst_smfdec_tempo_index (GstSmfdec *dec, guint64 tick)
+{
+  guint low = 1, high = dec->tempo_map->len, mid;
+
+  g_assert (high > 0);
+  while (low < high) {
+    mid = (low + high) / 2;
+    if (g_array_index (dec->tempo_map, GstSmfdecTempo, mid).tick <= tick)
+      low = mid + 1;
+    else
+      high = mid;
+  }
+  return low - 1;
+}
+
+/* finds the part of the tempo map the first tick at or after time is in */
+static const GstSmfdecTempo *
+gst_smfdec_tempo_lookup (GstSmfdec *dec, GstClockTime time)
+{
+  guint low = 1, high = dec->tempo_map->len, mid;
+
+  g_assert (high > 0);
+  while (low < high) {
+    mid = (low + high) / 2;
+    if (g_array_index (dec->tempo_map, GstSmfdecTempo, mid).time < time)
+      low = mid + 1;
+    else
+      high = mid;
+  }
+  return &g_array_index (dec->tempo_map, GstSmfdecTempo, low - 1);
+}
+
+/* returns the time of a tick */
+static GstClockTime
+gst_smfdec_tick_to_time (GstSmfdec *dec, guint64 tick)
+{
+  const GstSmfdecTempo *tempo;
+  GstClockTime time;
+  guint64 carry;
+
+  tempo = &g_array_index (dec->tempo_map, GstSmfdecTempo, 
+      gst_smfdec_tempo_index (dec, tick));
+  time = tempo->time;
+  carry = tempo->carry;
+  gst_smfdec_advance (dec, &time, &carry, tick - tempo->tick, 
+      tempo->tempo / dec->division, tempo->tempo % dec->division);
+  return time;
+}
+
+/* returns the first tick that is not before time */
+static guint64
+gst_smfdec_time_to_tick (GstSmfdec *dec, GstClockTime time)
+{
+  const GstSmfdecTempo *tempo = gst_smfdec_tempo_lookup (dec, time);
+  guint64 units;
+
+  if (time <= tempo->time)
+    return tempo->tick;
+  /* time stands still from there on */
+  if (tempo->tempo == 0)
+    return G_MAXUINT64;
+  units = (time - tempo->time) * dec->division - tempo->carry;
+  return tempo->tick + (units + tempo->tempo - 1) / tempo->tempo;
+}
+
+/*** decoding in parts *******************************************************/
+
+/* number of events a part should have, the number of buffers in the next 
+ * parts is adjusted to get close to it */
+#define PART_EVENTS (65536)
+
+/* number of buffers in the first part of a file */
+#define PART_BUFFERS (64)
+
+/* Decodes the events of a part of a format 1 file into buffers. It merges
+ * the tracks and computes the times with the tempo map like playing would, 
+ * only it starts from the checkpoints of the tracks and doesn't change the 
+ * decoder. */
+static void
+gst_smfdec_part_decode (GstSmfdecJob *job, GstSmfdec *dec)
+{
+  GstSmfdecPart *part = (GstSmfdecPart *) job;
+  const GstSmfdecTempo *tempo, *last_tempo;
+  GstSmfdecTrack *track;
+  GstMidiBuffer *buf = part->buf;
+  GstBuffer *payload;
+  GstClockTime time, start, end = 0;
+  guint64 carry, time_tick, tick_ns, tick_rem, n;
+  const guint8 *data;
+  guint i, len, skip, heap_size = 0;
+  guint8 status;
+  gint next, size;
+
+  part->buf = NULL;
+  part->events = 0;
+  part->tracks = g_renew (GstSmfdecTrack, part->tracks, dec->tracks->len);
+  part->heap = g_renew (GstSmfdecTrack *, part->heap, dec->tracks->len);
+  for (i = 0; i < dec->tracks->len; i++) {
+    track = &part->tracks[i];
+    *track = *(GstSmfdecTrack *) g_ptr_array_index (dec->tracks, i);
+    next = gst_smfdec_track_seek (track, part->tick);
+    if (next < 0)
+      goto invalid;
+    if (next > 0 && track->cursor.tick < part->end_tick)
+      part->heap[heap_size++] = track;
+  }
+  for (i = heap_size / 2; i > 0; i--)
+    gst_smfdec_heap_down (part->heap, heap_size, i - 1);
+
+  if (buf)
+    end = GST_MIDI_BUFFER_TIMESTAMP (buf) + GST_MIDI_BUFFER_DURATION (buf);
+  tempo = &g_array_index (dec->tempo_map, GstSmfdecTempo, 
+      gst_smfdec_tempo_index (dec, part->tick));
+  last_tempo = &g_array_index (dec->tempo_map, GstSmfdecTempo, 
+      dec->tempo_map->len - 1);
+  time_tick = tempo->tick;
+  time = tempo->time;
+  carry = tempo->carry;
+  tick_ns = tempo->tempo / dec->division;
+  tick_rem = tempo->tempo % dec->division;
+
+  while (heap_size > 0) {
+    track = part->heap[0];
+    while (tempo < last_tempo && track->cursor.tick >= tempo[1].tick) {
+      tempo++;
+      time_tick = tempo->tick;
+      time = tempo->time;
+      carry = tempo->carry;
+      tick_ns = tempo->tempo / dec->division;
+      tick_rem = tempo->tempo % dec->division;
+    }
+    gst_smfdec_advance (dec, &time, &carry, track->cursor.tick - time_tick,
+	tick_ns, tick_rem);
+    time_tick = track->cursor.tick;
+
+    status = track->cursor.event_status;
+    data = track->cursor.event;
+    len = track->cursor.length;
+    if (status == 0xFF) {
+      /* the tempo map has the tempo changes and the tags were read */
+      size = gst_midi_data_parse_varlen (data + 1, len - 1, &skip);
+      part->error = gst_smfdec_meta_invalid (data[0], size);
+      if (part->error)
+	goto error;
+    } else {
+      if (buf == NULL || time >= end) {
+	if (buf) {
+	  g_ptr_array_add (part->buffers, gst_midi_buffer_finish (buf));
+	  part->hint = GST_BUFFER_SIZE (g_ptr_array_index (part->buffers, 
+		part->buffers->len - 1));
+	}
+	n = gst_smfdec_buffer_number (dec, time);
+	start = gst_smfdec_buffer_time (dec, n);
+	end = gst_smfdec_buffer_time (dec, n + 1);
+	buf = gst_midi_buffer_pool_acquire (dec->pool, start, end - start,
+	    dec->layout);
+	gst_midi_buffer_reserve (buf, part->hint);
+      }
+      if (status == 0xF0 || status == 0xF7) {
+	size = gst_midi_data_parse_varlen (data, len, &skip);
+	g_assert (size >= 0 && skip + size == len);
+	payload = gst_buffer_create_sub (track->buffer, 
+	    data + skip - GST_BUFFER_DATA (track->buffer), size);
+	gst_midi_buffer_append_sysex (buf, time, status, payload);
+	gst_buffer_unref (payload);
+      } else {
+	gst_midi_buffer_append_with_status (buf, time, status, data, len);
+      }
+    }
+    part->events++;
+
+    next = gst_smf_track_cursor_next (&track->cursor);
+    if (next < 0)
+      goto invalid;
+    if ((next == 0 || track->cursor.tick >= part->end_tick) && 
+	--heap_size > 0)
+      part->heap[0] = part->heap[heap_size];
+    if (heap_size > 0)
+      gst_smfdec_heap_down (part->heap, heap_size, 0);
+  }
+  if (buf)
+    g_ptr_array_add (part->buffers, gst_midi_buffer_finish (buf));
+  return;
+
+invalid:
+  part->error = g_strdup ("invalid track chunk");
+error:
+  /* like playing, the buffer with the event isn't pushed */
+  if (buf)
+    gst_midi_buffer_free (buf);
+}
+
+/* starts decoding the next part of the file if a part is free and the file
+ * goes on */
+static void
+gst_smfdec_part_start (GstSmfdec *dec)
+{
+  GstSmfdecPart *part;
+
+  if (dec->parts_busy == dec->n_parts || dec->parts_tick > dec->end_tick)
+    return;
+  part = &dec->parts[(dec->parts_first + dec->parts_busy) % dec->n_parts];
+  part->job.func = gst_smfdec_part_decode;
+  part->tick = dec->parts_tick;
+  /* parts end where a buffer starts, so no buffer is split between two */
+  do {
+    dec->parts_buffer += dec->parts_span;
+    part->end_tick = gst_smfdec_time_to_tick (dec, 
+	gst_smfdec_buffer_time (dec, dec->parts_buffer));
+  } while (part->end_tick <= part->tick);
+  /* the first part continues the buffer a seek started */
+  part->buf = dec->buf;
+  dec->buf = NULL;
+  part->hint = dec->buf_hint;
+  dec->parts_tick = part->end_tick;
+  dec->parts_busy++;
+  gst_smfdec_job_start (dec, &part->job);
+}
+
+/* Starts playing all tracks of a format 1 file from dec->tick. If there are
+ * workers, they decode the file in parts, each on its own, and the streaming
+ * thread only pushes what they decoded. */
+static GstFlowReturn
+gst_smfdec_play_all (GstSmfdec *dec)
+{
+  GstSmfdecTrack *track;
+  GstFlowReturn ret;
+  guint i;
+
+  dec->next_track = dec->tracks->len;
+  if (dec->workers == NULL || dec->cache_events || dec->scan)
+    return gst_smfdec_merge_start (dec, 0, dec->tracks->len);
+
+  gst_smfdec_parts_clear (dec);
+  dec->end_tick = 0;
+  for (i = 0; i < dec->tracks->len; i++) {
+    track = g_ptr_array_index (dec->tracks, i);
+    ret = gst_smfdec_track_pull (dec, track);
+    if (ret != GST_FLOW_OK)
+      return ret;
+    dec->end_tick = MAX (dec->end_tick, track->end_tick);
+  }
+  /* the workers need to know the buffers */
+  gst_smfdec_check_caps (dec);
+  dec->parts_tick = dec->tick;
+  dec->parts_buffer = gst_smfdec_buffer_number (dec, 
+      gst_smfdec_tick_to_time (dec, dec->tick));
+  if (dec->parts_span == 0)
+    dec->parts_span = PART_BUFFERS;
+  for (i = 0; i < dec->n_parts; i++)
+    gst_smfdec_part_start (dec);
+  return GST_FLOW_OK;
+}
+
+/* pushes the buffers of the oldest part once it's decoded and starts 
+ * decoding the next one in its place */
+static gboolean
+gst_smfdec_parts_push (GstSmfdec *dec)
+{
+  GstSmfdecPart *part = &dec->parts[dec->parts_first];
+  GstBuffer *buf;
+  gchar *error;
+  guint i;
+
+  g_assert (dec->parts_busy > 0);
+
+  gst_smfdec_job_wait (dec, &part->job);
+  dec->parts_first = (dec->parts_first + 1) % dec->n_parts;
+  dec->parts_busy--;
+  for (i = 0; i < part->buffers->len; i++) {
+    buf = g_ptr_array_index (part->buffers, i);
+    if (dec->flow == GST_FLOW_OK)
+      gst_smfdec_push (dec, buf);
+    else
+      gst_buffer_unref (buf);
+  }
+  g_ptr_array_set_size (part->buffers, 0);
+  error = part->error;
+  part->error = NULL;
+  if (error && dec->flow == GST_FLOW_OK) {
+    GST_ELEMENT_ERROR (dec, STREAM, DECODE, (NULL), ("%s", error));
+    g_free (error);
+    return FALSE;
+  }
+  g_free (error);
+
+  if (part->events < PART_EVENTS / 2 && dec->parts_span < G_MAXUINT / 2)
+    dec->parts_span *= 2;
+  else if (part->events > PART_EVENTS * 2 && dec->parts_span > 1)
+    dec->parts_span /= 2;
+  if (dec->flow == GST_FLOW_OK)
+    gst_smfdec_part_start (dec);
+  return TRUE;
+}
+
+/*** cached images ***********************************************************/
+
+#define CACHE_MAGIC GST_MAKE_FOURCC ('S', 'M', 'F', 'C')
+#define CACHE_VERSION (2)
+/* bytes pulled at once when hashing a file */
+#define CACHE_BLOCK_SIZE (65536)
+
+#define CACHE_EVENTS(header) ((const GstSmfdecCacheEvent *) ((header) + 1))
+#define CACHE_TEMPOS(header) \
+    ((const GstSmfdecTempo *) (CACHE_EVENTS (header) + (header)->n_events))
+#define CACHE_CHANGES(header) \
+    ((const GstSmfdecChange *) (CACHE_TEMPOS (header) + (header)->n_tempos))
+#define CACHE_DATA(header) \
+    ((const guint8 *) (CACHE_CHANGES (header) + (header)->n_changes))
+
+/* reads the whole file to compute a 64 bit FNV-1a hash of it */
+static GstFlowReturn
+gst_smfdec_cache_hash (GstSmfdec *dec, guint64 *hash, guint64 *size)
+{
+  GstFlowReturn ret;
+  GstBuffer *buf;
+  const guint8 *data;
+  guint64 h = G_GUINT64_CONSTANT (14695981039346656037);
+  guint i, n;
+
+  *size = 0;
+  do {
+    ret = gst_pad_pull_range (dec->sink, *size, CACHE_BLOCK_SIZE, &buf);
+    if (ret == GST_FLOW_UNEXPECTED)
+      break;
+    if (ret != GST_FLOW_OK)
+      return ret;
+    data = GST_BUFFER_DATA (buf);
+    n = GST_BUFFER_SIZE (buf);
+    for (i = 0; i < n; i++) {
+      h ^= data[i];
+      h *= G_GUINT64_CONSTANT (1099511628211);
+    }
+    *size += n;
+    gst_buffer_unref (buf);
+  } while (n == CACHE_BLOCK_SIZE);
+
+  *hash = h;
+  return GST_FLOW_OK;
+}
+
+static gchar *
+gst_smfdec_cache_path (GstSmfdec *dec, guint64 hash, guint64 size)
+{
+  gchar *name, *path;
+
+  name = g_strdup_printf ("%016" G_GINT64_MODIFIER "x-%" G_GINT64_MODIFIER 
+      "x.smfcache", hash, size);
+  path = g_build_filename (dec->cache_dir, name, NULL);
+  g_free (name);
+  return path;
+}
+
+/* checks that the image belongs to the file and sets up playing it */
+static gboolean
+gst_smfdec_cache_open (GstSmfdec *dec, const guint8 *image, gsize length,
+    guint64 hash, guint64 size)
+{
+  const GstSmfdecCacheHeader *header = (const GstSmfdecCacheHeader *) image;
+  const GstSmfdecChange *change;
+  guint i;
+
+  if (length < sizeof (GstSmfdecCacheHeader) ||
+      header->magic != CACHE_MAGIC || header->version != CACHE_VERSION ||
+      header->hash != hash || header->size != size ||
+      header->format < 1 || header->format > 3 || header->division == 0 ||
+      header->n_tempos == 0 ||
+      length != sizeof (GstSmfdecCacheHeader) + 
+	  (guint64) header->n_events * sizeof (GstSmfdecCacheEvent) +
+	  (guint64) header->n_tempos * sizeof (GstSmfdecTempo) + 
+	  (guint64) header->n_changes * sizeof (GstSmfdecChange) + 
+	  header->data_size)
+    return FALSE;
+  for (i = 0; i < header->n_changes; i++) {
+    change = &CACHE_CHANGES (header)[i];
+    if (change->status < 0xB0 || change->status >= 0xF0 ||
+	(change->status & 0xF0) == 0xD0 || (change->data[0] & 0x80) || 
+	(change->data[1] & 0x80) || 
+	!gst_smfdec_is_change (change->status, change->data) ||
+	(i > 0 && change->tick < change[-1].tick))
+      return FALSE;
+  }
+
+  dec->cache = header;
+  dec->cache_pos = 0;
+  dec->time = 0;
+  dec->format = header->format;
+  gst_smfdec_set_division (dec, header->division);
+  g_array_set_size (dec->tempo_map, 0);
+  g_array_append_vals (dec->tempo_map, CACHE_TEMPOS (header), 
+      header->n_tempos);
+  g_array_set_size (dec->changes, 0);
+  g_array_append_vals (dec->changes, CACHE_CHANGES (header), 
+      header->n_changes);
+  gst_smfdec_channels_index (dec);
+  if (header->n_events > 0)
+    dec->duration = CACHE_EVENTS (header)[header->n_events - 1].time;
+  else
+    dec->duration = 0;
+  GST_DEBUG ("playing cached image with %u events", header->n_events);
+  return TRUE;
+}
+
+static gboolean
+gst_smfdec_cache_load (GstSmfdec *dec, const gchar *path, guint64 hash, 
+    guint64 size)
+{
+  GMappedFile *map;
+
+  map = g_mapped_file_new (path, FALSE, NULL);
+  if (map == NULL)
+    return FALSE;
+  if (!gst_smfdec_cache_open (dec, (const guint8 *) 
+	g_mapped_file_get_contents (map), g_mapped_file_get_length (map), 
+	hash, size)) {
+    GST_WARNING_OBJECT (dec, "ignoring invalid cached image %s", path);
+    g_mapped_file_free (map);
+    return FALSE;
+  }
+  dec->cache_map = map;
+  return TRUE;
+}
+
+/* checks an event of an image before it's handled like one of the file */
+static gboolean
+gst_smfdec_cache_event_valid (guint8 status, const guint8 *data, guint len)
+{
+  guint skip;
+  gint size;
+
+  if (status == 0xFF) {
+    if (len < 1)
+      return FALSE;
+    size = gst_midi_data_parse_varlen (data + 1, len - 1, &skip);
+    return size >= 0 && skip + 1 + size == len;
+  } else if (status == 0xF0 || status == 0xF7) {
+    size = gst_midi_data_parse_varlen (data, len, &skip);
+    return size >= 0 && skip + size == len;
+  }
+  return status >= 0x80 && len == gst_midi_status_get_length (status);
+}
+
+/* plays up to max_events events of the image */
+static gboolean
+gst_smfdec_cache_step (GstSmfdec *dec, guint max_events)
+{
+  const GstSmfdecCacheHeader *header = dec->cache;
+  const GstSmfdecCacheEvent *event;
+  const guint8 *data;
+
+  while (dec->cache_pos < header->n_events && max_events-- > 0) {
+    event = &CACHE_EVENTS (header)[dec->cache_pos++];
+    if (event->offset > header->data_size || 
+	event->length > header->data_size - event->offset ||
+	event->time < dec->time)
+      goto corrupt;
+    data = CACHE_DATA (header) + event->offset;
+    if (!gst_smfdec_cache_event_valid (event->status, data, event->length))
+      goto corrupt;
+    /* the time is known already */
+    dec->tick = event->tick;
+    dec->time_tick = event->tick;
+    dec->time = event->time;
+    dec->carry = 0;
+    if (!gst_smfdec_event (dec, NULL, event->status, data, event->length))
+      return FALSE;
+  }
+  return TRUE;
+
+corrupt:
+  GST_ELEMENT_ERROR (dec, STREAM, DECODE, (NULL), 
+      ("corrupt cached image of the file"));
+  return FALSE;
+}
+
+/* continues playing the image with the first event at or after time */
+static void
+gst_smfdec_cache_seek (GstSmfdec *dec, GstClockTime time)
+{
+  const GstSmfdecCacheEvent *events = CACHE_EVENTS (dec->cache);
+  guint low = 0, high = dec->cache->n_events, mid;
+
+  while (low < high) {
+    mid = (low + high) / 2;
+    if (events[mid].time < time)
+      low = mid + 1;
+    else
+      high = mid;
+  }
+  dec->cache_pos = low;
+  dec->time = 0;
+}
+
+/******************************************************************************/
+
+/* appends a channel event at time to the current buffer */
+static inline void
+gst_smfdec_restore_event (GstSmfdec *dec, GstClockTime time, guint8 status,
+    guint8 data1, guint8 data2)
+{
+  guint8 data[2] = { data1, data2 };
+
+  gst_midi_buffer_append_with_status (dec->buf, time, status, data, 
+      gst_midi_status_get_length (status));
+}
+
+/* Starts the buffer time is in with what sets up the channels for playing 
+ * from dec->tick: all notes off, so nothing keeps sounding from before the 
+ * seek, and the controllers, programs and pitch bends set before. */
+static void
+gst_smfdec_restore_channels (GstSmfdec *dec, GstClockTime time)
+{
+  GstSmfdecChannels channels;
+  guint channel, i;
+
+  gst_smfdec_channels_at (dec, dec->tick, &channels);
+  gst_smfdec_buffer_new (dec, time);
+  for (channel = 0; channel < 16; channel++) {
+    gst_smfdec_restore_event (dec, time, 0xB0 | channel, 123, 0);
+    gst_smfdec_restore_event (dec, time, 0xB0 | channel, 121, 0);
+    /* RPN and NRPN selection goes before the data entry it is for */
+    for (i = 98; i <= 101; i++) {
+      if (channels.controllers[channel][i] >= 0)
+	gst_smfdec_restore_event (dec, time, 0xB0 | channel, i, 
+	    channels.controllers[channel][i]);
+    }
+    for (i = 0; i < 120; i++) {
+      if (channels.controllers[channel][i] >= 0 && (i < 98 || i > 101))
+	gst_smfdec_restore_event (dec, time, 0xB0 | channel, i, 
+	    channels.controllers[channel][i]);
+    }
+    /* after the bank select controllers */
+    if (channels.program[channel] >= 0)
+      gst_smfdec_restore_event (dec, time, 0xC0 | channel, 
+	  channels.program[channel], 0);
+    if (channels.bend[channel] >= 0)
+      gst_smfdec_restore_event (dec, time, 0xE0 | channel, 
+	  channels.bend[channel] & 0x7F, channels.bend[channel] >> 7);
+  }
+}
+
+/* makes playback continue with the first events at or after time */
+static GstFlowReturn
+gst_smfdec_seek_to (GstSmfdec *dec, GstClockTime time)
+{
+  const GstSmfdecTempo *tempo = gst_smfdec_tempo_lookup (dec, time);
+  GstSmfdecTrack *track;
+  guint i, current;
+
+  dec->tick = gst_smfdec_time_to_tick (dec, time);
+  dec->tempo = tempo->tempo;
+  gst_smfdec_set_tick_length (dec);
+  dec->time_tick = tempo->tick;
+  dec->time = tempo->time;
+  dec->carry = tempo->carry;
+  GST_DEBUG ("seeking to %"GST_TIME_FORMAT", tick %"G_GUINT64_FORMAT,
+      GST_TIME_ARGS (time), dec->tick);
+
+  if (dec->buf) {
+    gst_midi_buffer_free (dec->buf);
+    dec->buf = NULL;
+  }
+  dec->heap_size = 0;
+  gst_smfdec_parts_clear (dec);
+  dec->segment_sent = FALSE;
+  dec->segment_start = time;
+  dec->flow = GST_FLOW_OK;
+  /* not while building an image, it starts at the beginning anyway */
+  if (dec->cache_events == NULL && !dec->scan)
+    gst_smfdec_restore_channels (dec, time);
+
+  if (dec->cache) {
+    gst_smfdec_cache_seek (dec, time);
+    return GST_FLOW_OK;
+  }
+
+  if (dec->format == 2)
+    return gst_smfdec_play_all (dec);
+
+  /* continue in the track playing at that tick */
+  current = dec->tracks->len;
+  for (i = 0; i < dec->tracks->len; i++) {
+    track = g_ptr_array_index (dec->tracks, i);
+    if (current == dec->tracks->len && track->end_tick >= dec->tick)
+      current = i;
+    else if (track->buffer) {
+      gst_buffer_unref (track->buffer);
+      track->buffer = NULL;
+    }
+  }
+  dec->next_track = current;
+  if (current == dec->tracks->len)
+    return GST_FLOW_OK;
+  dec->next_track++;
+  return gst_smfdec_merge_start (dec, current, current + 1);
+}
+
+/* starts playing the next tracks once the ones before are done */
+static GstFlowReturn
+gst_smfdec_next_tracks (GstSmfdec *dec)
+{
+  GstSmfdecTrack *track;
+  GstFlowReturn ret;
+
+  if (dec->format == 2) {
+    /* format 1: all tracks play at the same time */
+    ret = gst_smfdec_play_all (dec);
+  } else {
+    /* other formats play one track after another */
+    if (dec->next_track > 0) {
+      track = g_ptr_array_index (dec->tracks, dec->next_track - 1);
+      gst_buffer_unref (track->buffer);
+      track->buffer = NULL;
+    }
+    ret = gst_smfdec_merge_start (dec, dec->next_track, dec->next_track + 1);
+    dec->next_track++;
+  }
+  return ret;
+}
+
+/* Decodes the whole file into an image, which is saved to path and played 
+ * from then on. Saving can fail without causing an error. */
+static GstFlowReturn
+gst_smfdec_cache_build (GstSmfdec *dec, const gchar *path, guint64 hash,
+    guint64 size)
+{
+  GstSmfdecCacheHeader header;
+  GstFlowReturn ret;
+  GByteArray *image;
+  GError *error = NULL;
+
+  dec->cache_events = g_array_new (FALSE, FALSE, sizeof (GstSmfdecCacheEvent));
+  dec->cache_data = g_byte_array_new ();
+  ret = gst_smfdec_seek_to (dec, 0);
+  while (ret == GST_FLOW_OK) {
+    if (dec->heap_size > 0) {
+      if (!gst_smfdec_merge_step (dec, G_MAXUINT))
+	ret = GST_FLOW_ERROR;
+    } else if (dec->next_track < dec->tracks->len) {
+      ret = gst_smfdec_next_tracks (dec);
+    } else {
+      break;
+    }
+  }
+  if (ret != GST_FLOW_OK)
+    goto out;
+
+  memset (&header, 0, sizeof (header));
+  header.magic = CACHE_MAGIC;
+  header.version = CACHE_VERSION;
+  header.hash = hash;
+  header.size = size;
+  header.format = dec->format;
+  header.division = dec->division;
+  header.n_events = dec->cache_events->len;
+  header.n_tempos = dec->tempo_map->len;
+  header.n_changes = dec->changes->len;
+  header.data_size = dec->cache_data->len;
+  image = g_byte_array_new ();
+  g_byte_array_append (image, (const guint8 *) &header, sizeof (header));
+  g_byte_array_append (image, (const guint8 *) dec->cache_events->data, 
+      header.n_events * sizeof (GstSmfdecCacheEvent));
+  g_byte_array_append (image, (const guint8 *) dec->tempo_map->data, 
+      header.n_tempos * sizeof (GstSmfdecTempo));
+  g_byte_array_append (image, (const guint8 *) dec->changes->data, 
+      header.n_changes * sizeof (GstSmfdecChange));
+  g_byte_array_append (image, dec->cache_data->data, header.data_size);
+
+  g_mkdir_with_parents (dec->cache_dir, 0755);
+  if (!g_file_set_contents (path, (const gchar *) image->data, image->len, 
+	&error)) {
+    GST_WARNING_OBJECT (dec, "could not save decoded file: %s", 
+	error->message);
+    g_error_free (error);
+  }
+  dec->cache_bytes = image;
+  if (!gst_smfdec_cache_open (dec, image->data, image->len, hash, size))
+    g_assert_not_reached ();
+  gst_smfdec_clear_tracks (dec);
+
+out:
+  g_array_free (dec->cache_events, TRUE);
+  dec->cache_events = NULL;
+  g_byte_array_free (dec->cache_data, TRUE);
+  dec->cache_data = NULL;
+  return ret;
+}
+
+/* returns the time the last track ends at */
+static GstClockTime
+gst_smfdec_pull_duration (GstSmfdec *dec)
+{
+  GstSmfdecTrack *track;
+  guint64 end = 0;
+  guint i;
+
+  for (i = 0; i < dec->tracks->len; i++) {
+    track = g_ptr_array_index (dec->tracks, i);
+    end = MAX (end, track->end_tick);
+  }
+  return gst_smfdec_tick_to_time (dec, end);
+}
+
+/* Reads what is needed to play and seek in the file. If a cache directory
+ * is set, a decoded image of the file is played instead, which is built on
+ * first use. When scanning, only the tags and the duration are needed. */
+static GstFlowReturn
+gst_smfdec_pull_setup (GstSmfdec *dec)
+{
+  GstFlowReturn ret;
+  guint64 hash = 0, size = 0;
+  gchar *path = NULL;
+
+  if (dec->cache_dir && !dec->scan) {
+    ret = gst_smfdec_cache_hash (dec, &hash, &size);
+    if (ret != GST_FLOW_OK)
+      return ret;
+    path = gst_smfdec_cache_path (dec, hash, size);
+    if (gst_smfdec_cache_load (dec, path, hash, size)) {
+      g_free (path);
+      goto out;
+    }
+  }
+
+  if (dec->format == 0)
+    ret = gst_smfdec_pull_index (dec);
+  else
+    ret = GST_FLOW_OK;
+  if (ret == GST_FLOW_OK)
+    ret = gst_smfdec_pull_map (dec);
+  if (ret == GST_FLOW_OK)
+    dec->duration = gst_smfdec_pull_duration (dec);
+  if (ret == GST_FLOW_OK && path)
+    ret = gst_smfdec_cache_build (dec, path, hash, size);
+  g_free (path);
+  if (ret != GST_FLOW_OK)
+    return ret;
+
+out:
+  GST_DEBUG_OBJECT (dec, "duration is %" GST_TIME_FORMAT, 
+      GST_TIME_ARGS (dec->duration));
+  gst_tag_list_add (gst_smfdec_get_tags (dec), GST_TAG_MERGE_REPLACE,
+      GST_TAG_DURATION, dec->duration, NULL);
+  return GST_FLOW_OK;
+}
+
+static void
+gst_smfdec_loop (GstPad *pad)
+{
+  GstSmfdec *dec = GST_SMFDEC (gst_pad_get_parent (pad));
+  GstFlowReturn ret;
+
+  if (dec->tempo_map->len == 0) {
+    ret = gst_smfdec_pull_setup (dec);
+    if (ret != GST_FLOW_OK)
+      goto pause;
+  }
+  if (!dec->segment_sent) {
+    gst_pad_push_event (dec->src, gst_event_new_new_segment (FALSE, 1.0, 
+	  GST_FORMAT_TIME, dec->segment_start, -1, dec->segment_start));
+    dec->segment_sent = TRUE;
+  }
+  gst_smfdec_push_tags (dec);
+  if (dec->scan) {
+    ret = GST_FLOW_UNEXPECTED;
+    goto pause;
+  }
+
+  if (dec->cache) {
+    if (dec->cache_pos >= dec->cache->n_events) {
+      if (dec->buf)
+	gst_smfdec_buffer_push (dec);
+      ret = GST_FLOW_UNEXPECTED;
+      goto pause;
+    }
+    if (!gst_smfdec_cache_step (dec, LOOP_EVENTS)) {
+      ret = GST_FLOW_ERROR;
+      goto pause;
+    }
+  } else {
+    if (dec->heap_size == 0 && dec->parts_busy == 0) {
+      if (dec->next_track >= dec->tracks->len) {
+	if (dec->buf)
+	  gst_smfdec_buffer_push (dec);
+	ret = GST_FLOW_UNEXPECTED;
+	goto pause;
+      }
+      ret = gst_smfdec_next_tracks (dec);
+      if (ret != GST_FLOW_OK)
+	goto pause;
+    }
+    if (dec->parts_busy > 0) {
+      if (!gst_smfdec_parts_push (dec)) {
+	ret = GST_FLOW_ERROR;
+	goto pause;
+      }
+    } else if (!gst_smfdec_merge_step (dec, LOOP_EVENTS)) {
+      ret = GST_FLOW_ERROR;
+      goto pause;
+    }
+  }
+  ret = dec->flow;
+  if (ret != GST_FLOW_OK)
+    goto pause;
+
+  gst_object_unref (dec);
+  return;
+
+pause:
+  GST_LOG ("pausing task, reason %s", gst_flow_get_name (ret));
+  gst_pad_pause_task (pad);
+  if (GST_FLOW_IS_FATAL (ret) || ret == GST_FLOW_NOT_LINKED) {
+    if (ret != GST_FLOW_UNEXPECTED)
+      GST_ELEMENT_ERROR (dec, STREAM, FAILED, (NULL), 
+	  ("streaming stopped, reason %s", gst_flow_get_name (ret)));
+    gst_pad_push_event (dec->src, gst_event_new_eos ());
+  }
+  gst_object_unref (dec);
+}
+
+static gboolean
+gst_smfdec_sink_activate (GstPad *pad)
+{
+  if (gst_pad_check_pull_range (pad))
+    return gst_pad_activate_pull (pad, TRUE);
+
+  return gst_pad_activate_push (pad, TRUE);
+}
+
+static gboolean
+gst_smfdec_sink_activate_pull (GstPad *pad, gboolean active)
+{
+  GstSmfdec *dec = GST_SMFDEC (gst_pad_get_parent (pad));
+  gboolean ret;
+
+  dec->pulling = active;
+  if (active)
+    ret = gst_pad_start_task (pad, (GstTaskFunction) gst_smfdec_loop, pad);
+  else
+    ret = gst_pad_stop_task (pad);
+
+  gst_object_unref (dec);
+  return ret;
+}
+
+/* seeks to a time, which needs random access to the file */
+static gboolean
+gst_smfdec_handle_seek (GstSmfdec *dec, GstEvent *event)
+{
+  GstFormat format;
+  GstSeekFlags flags;
+  GstSeekType cur_type, stop_type;
+  GstFlowReturn ret = GST_FLOW_OK;
+  gint64 cur, stop;
+  gdouble rate;
+  gboolean flush;
+
+  if (!dec->pulling) {
+    GST_DEBUG ("can only seek in pull mode");
+    return FALSE;
+  }
+  gst_event_parse_seek (event, &rate, &format, &flags, &cur_type, &cur, 
+      &stop_type, &stop);
+  if (format != GST_FORMAT_TIME || rate != 1.0 || 
+      cur_type != GST_SEEK_TYPE_SET || cur < 0) {
+    GST_DEBUG ("can only seek to a time at normal rate");
+    return FALSE;
+  }
+
+  flush = flags & GST_SEEK_FLAG_FLUSH;
+  if (flush)
+    gst_pad_push_event (dec->src, gst_event_new_flush_start ());
+  else
+    gst_pad_pause_task (dec->sink);
+  GST_PAD_STREAM_LOCK (dec->sink);
+  if (flush)
+    gst_pad_push_event (dec->src, gst_event_new_flush_stop ());
+
+  if (dec->tempo_map->len == 0)
+    ret = gst_smfdec_pull_setup (dec);
+  if (ret == GST_FLOW_OK)
+    ret = gst_smfdec_seek_to (dec, cur);
+  if (ret == GST_FLOW_OK)
+    gst_pad_start_task (dec->sink, (GstTaskFunction) gst_smfdec_loop, 
+	dec->sink);
+  GST_PAD_STREAM_UNLOCK (dec->sink);
+
+  return ret == GST_FLOW_OK;
+}
+
+static gboolean
+gst_smfdec_src_query (GstPad *pad, GstQuery *query)
+{
+  GstSmfdec *dec = GST_SMFDEC (gst_pad_get_parent (pad));
+  GstFormat format;
+  gboolean ret;
+
+  switch (GST_QUERY_TYPE (query)) {
+    case GST_QUERY_DURATION:
+      gst_query_parse_duration (query, &format, NULL);
+      if (format == GST_FORMAT_TIME && 
+	  GST_CLOCK_TIME_IS_VALID (dec->duration)) {
+	gst_query_set_duration (query, GST_FORMAT_TIME, dec->duration);
+	ret = TRUE;
+	break;
+      }
+      /* fall through */
+    default:
+      ret = gst_pad_query_default (pad, query);
+      break;
+  }
+  gst_object_unref (dec);
+  return ret;
+}
+
+static gboolean
+gst_smfdec_src_event (GstPad *pad, GstEvent *event)
+{
+  GstSmfdec *dec = GST_SMFDEC (gst_pad_get_parent (pad));
+  gboolean ret;
+
+  switch (GST_EVENT_TYPE (event)) {
+    case GST_EVENT_SEEK:
+      ret = gst_smfdec_handle_seek (dec, event);
+      gst_event_unref (event);
+      break;
+    default:
+      ret = gst_pad_event_default (pad, event);
+      break;
+  }
+  gst_object_unref (dec);
+  return ret;
+}
+
+/******************************************************************************/
+
 static GstStateChangeReturn
 gst_smfdec_change_state (GstElement * element, GstStateChange transition)
 {
   GstSmfdec *smfdec = GST_SMFDEC (element);
+  GstStateChangeReturn ret = GST_STATE_CHANGE_SUCCESS;
 
   switch (transition) {
     case GST_STATE_CHANGE_READY_TO_PAUSED:
       gst_smfdec_reset (smfdec);
+      gst_smfdec_workers_start (smfdec);
       break;
     default:
       break;
   }
 
   if (parent_class->change_state)
-    return parent_class->change_state (element,transition);
+    ret = parent_class->change_state (element,transition);
+
+  switch (transition) {
+    case GST_STATE_CHANGE_PAUSED_TO_READY:
+      gst_smfdec_workers_stop (smfdec);
+      break;
+    default:
+      break;
+  }
 
-  return GST_STATE_CHANGE_SUCCESS;
+  return ret;
 }
 
 static void
@@ -430,12 +2778,107 @@ gst_smfdec_dispose (GObject *object)
 {
   GstSmfdec *dec = GST_SMFDEC (object);
 
+  gst_smfdec_workers_stop (dec);
   g_object_unref (dec->adapter);
   dec->adapter = NULL;
+  if (dec->buf) {
+    gst_midi_buffer_free (dec->buf);
+    dec->buf = NULL;
+  }
+  if (dec->pool) {
+    gst_midi_buffer_pool_free (dec->pool);
+    dec->pool = NULL;
+  }
+  if (dec->events) {
+    g_array_free (dec->events, TRUE);
+    dec->events = NULL;
+  }
+  if (dec->tracks) {
+    gst_smfdec_clear_tracks (dec);
+    g_ptr_array_free (dec->tracks, TRUE);
+    dec->tracks = NULL;
+  }
+  g_free (dec->heap);
+  dec->heap = NULL;
+  if (dec->tempo_map) {
+    g_array_free (dec->tempo_map, TRUE);
+    dec->tempo_map = NULL;
+  }
+  if (dec->changes) {
+    g_array_free (dec->changes, TRUE);
+    dec->changes = NULL;
+  }
+  if (dec->channels) {
+    g_array_free (dec->channels, TRUE);
+    dec->channels = NULL;
+  }
+  if (dec->tags) {
+    gst_tag_list_free (dec->tags);
+    dec->tags = NULL;
+  }
+  gst_smfdec_cache_clear (dec);
+  g_free (dec->cache_dir);
+  dec->cache_dir = NULL;
+  if (dec->jobs_lock) {
+    g_mutex_free (dec->jobs_lock);
+    dec->jobs_lock = NULL;
+  }
+  if (dec->jobs_done) {
+    g_cond_free (dec->jobs_done);
+    dec->jobs_done = NULL;
+  }
   
   G_OBJECT_CLASS (parent_class)->dispose (object);
 }
 
+static void
+gst_smfdec_set_property (GObject * object, guint prop_id,
+    const GValue * value, GParamSpec * pspec)
+{
+  GstSmfdec *dec = GST_SMFDEC (object);
+
+  switch (prop_id) {
+    case ARG_THREADS:
+      /* used from the next time the element goes to PAUSED */
+      dec->threads = g_value_get_uint (value);
+      break;
+    case ARG_CACHE_DIR:
+      /* used when the next file is read */
+      g_free (dec->cache_dir);
+      dec->cache_dir = g_value_dup_string (value);
+      break;
+    case ARG_SCAN:
+      /* used when the next file is read */
+      dec->scan = g_value_get_boolean (value);
+      break;
+    default:
+      G_OBJECT_WARN_INVALID_PROPERTY_ID (object, prop_id, pspec);
+      break;
+  }
+}
+
+static void
+gst_smfdec_get_property (GObject * object, guint prop_id,
+    GValue * value, GParamSpec * pspec)
+{
+  GstSmfdec *dec = GST_SMFDEC (object);
+
+  switch (prop_id) {
+    case ARG_THREADS:
+      g_value_set_uint (value, dec->threads);
+      break;
+    case ARG_CACHE_DIR:
+      g_value_set_string (value, dec->cache_dir);
+      break;
+    case ARG_SCAN:
+      g_value_set_boolean (value, dec->scan);
+      break;
+    default:
+      G_OBJECT_WARN_INVALID_PROPERTY_ID (object, prop_id, pspec);
+      break;
+  }
+}
+
 static void
 gst_smfdec_class_init (gpointer g_class, gpointer class_data)
 {
@@ -447,6 +2890,31 @@ gst_smfdec_class_init (gpointer g_class, gpointer class_data)
   gstelement_class->change_state = gst_smfdec_change_state;
 
   object_class->dispose = gst_smfdec_dispose;
+  object_class->set_property = gst_smfdec_set_property;
+  object_class->get_property = gst_smfdec_get_property;
+
+  g_object_class_install_property (object_class, ARG_THREADS,
+      g_param_spec_uint ("threads", "Threads", 
+	  "Number of threads to decode the tracks of format 1 files with when "
+	  "reading them in pull mode", 1, MAX_THREADS, 1, G_PARAM_READWRITE));
+  g_object_class_install_property (object_class, ARG_CACHE_DIR,
+      g_param_spec_string ("cache-dir", "Cache directory", 
+	  "Directory to keep decoded files in for playing them again, "
+	  "NULL to not keep them", NULL, G_PARAM_READWRITE));
+  g_object_class_install_property (object_class, ARG_SCAN,
+      g_param_spec_boolean ("scan", "Scan", 
+	  "Only read the tags and the duration of files, without pushing "
+	  "any midi", FALSE, G_PARAM_READWRITE));
+
+  gst_tag_register (GST_TAG_MIDI_TRACK_NAME, GST_TAG_FLAG_META, G_TYPE_STRING,
+      "track name", "names of the tracks of a midi file", 
+      gst_tag_merge_strings_with_comma);
+  gst_tag_register (GST_TAG_MIDI_TIME_SIGNATURE, GST_TAG_FLAG_META, 
+      G_TYPE_STRING, "time signature", "time signature a midi file starts "
+      "with", gst_tag_merge_use_first);
+  gst_tag_register (GST_TAG_MIDI_KEY_SIGNATURE, GST_TAG_FLAG_META, 
+      G_TYPE_STRING, "key signature", "key signature a midi file starts "
+      "with", gst_tag_merge_use_first);
 }
 
 static void
@@ -458,15 +2926,31 @@ gst_smfdec_init (GstSmfdec * smfdec)
 	gst_element_add_pad (GST_ELEMENT (smfdec), smfdec->sink);
 
 	gst_pad_set_chain_function (smfdec->sink, GST_DEBUG_FUNCPTR(gst_smfdec_chain) );
+	gst_pad_set_event_function (smfdec->sink, GST_DEBUG_FUNCPTR(gst_smfdec_sink_event) );
+	gst_pad_set_activate_function (smfdec->sink, GST_DEBUG_FUNCPTR(gst_smfdec_sink_activate) );
+	gst_pad_set_activatepull_function (smfdec->sink, GST_DEBUG_FUNCPTR(gst_smfdec_sink_activate_pull) );
 
 	smfdec->src = gst_pad_new_from_template (
 			gst_static_pad_template_get ( &gst_smfdec_src_template), "src");
 
 	gst_pad_set_setcaps_function ( smfdec->src, GST_DEBUG_FUNCPTR(gst_smfdec_src_setcaps));
+	gst_pad_set_fixatecaps_function (smfdec->src, GST_DEBUG_FUNCPTR(gst_smfdec_src_fixatecaps) );
+	gst_pad_set_event_function (smfdec->src, GST_DEBUG_FUNCPTR(gst_smfdec_src_event) );
+	gst_pad_set_query_function (smfdec->src, GST_DEBUG_FUNCPTR(gst_smfdec_src_query) );
 
 	gst_element_add_pad (GST_ELEMENT (smfdec), smfdec->src);
 
 	smfdec->adapter = gst_adapter_new ();
+	smfdec->pool = gst_midi_buffer_pool_new ();
+	smfdec->events = g_array_new (FALSE, FALSE, sizeof (GstSmfTrackEvent));
+	smfdec->tracks = g_ptr_array_new ();
+	smfdec->tempo_map = g_array_new (FALSE, FALSE, sizeof (GstSmfdecTempo));
+	smfdec->changes = g_array_new (FALSE, FALSE, sizeof (GstSmfdecChange));
+	smfdec->channels = g_array_new (FALSE, FALSE, sizeof (GstSmfdecChannels));
+	smfdec->duration = GST_CLOCK_TIME_NONE;
+	smfdec->threads = 1;
+	smfdec->jobs_lock = g_mutex_new ();
+	smfdec->jobs_done = g_cond_new ();
 }
 
 static void
@@ -521,7 +3005,9 @@ plugin_init (GstPlugin * plugin)
     return FALSE;
 #endif
   return gst_element_register (plugin, "smfdec", GST_RANK_SECONDARY,
-	GST_TYPE_SMFDEC);
+	GST_TYPE_SMFDEC) &&
+      gst_element_register (plugin, "smfenc", GST_RANK_NONE,
+	GST_TYPE_SMFENC);
 }
 
 GST_PLUGIN_DEFINE (
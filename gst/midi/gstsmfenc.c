@@ -0,0 +1,726 @@
+/* GStreamer
+ * Copyright (C) 2005 Benjamin Otte <otte@gnome.org>
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Library General Public
+ * License as published by the Free Software Foundation; either
+ * version 2 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Library General Public License for more details.
+ *
+ * You should have received a copy of the GNU Library General Public
+ * License along with this library; if not, write to the
+ * Free Software Foundation, Inc., 59 Temple Place - Suite 330,
+ * Boston, MA 02111-1307, USA.
+ */
+
+/* Writes midi events to a standard midi file. The tempo starts at one
+ * quarter note per second, so the division is the number of ticks per
+ * second that event times are rounded to until a tempo meta event changes
+ * it. Format 0 files have one track, format 1 files have a conductor track
+ * with the initial tempo and a track with the events, including later tempo
+ * changes. Events are written as they come in, so the length of the event
+ * track is only known at the end. It's fixed with a seek if downstream is
+ * seekable. Otherwise the file is written to a temporary file and pushed
+ * with the right length at the end. */
+
+#ifdef HAVE_CONFIG_H
+#  include "config.h"
+#endif
+
+#include <errno.h>
+#include <stdio.h>
+#include <string.h>
+#include <gst/gst.h>
+#include "gstmidibuffer.h"
+#include "gstsmfenc.h"
+
+struct _GstSmfenc {
+  GstElement		element;
+
+  GstPad *		sink;
+  GstPad *		src;
+
+  guint			format;		/* format of the file written */
+  guint			division;	/* ticks per quarter note */
+
+  gboolean		started;	/* if the header was written */
+  gboolean		seekable;	/* if downstream can seek back to fix the
+					   track length */
+  FILE *		spool;		/* file holding what was written until the
+					   end if downstream can't seek or NULL */
+  guint64		offset;		/* bytes written so far */
+  guint64		track_offset;	/* position of the event track's data */
+  guint64		tick;		/* tick of the last event written */
+  guint			tempo;		/* microseconds per quarter note */
+  guint64		tempo_tick;	/* tick of the last tempo change */
+  GstClockTime		tempo_time;	/* time of the last tempo change */
+  guint8		status;		/* running status */
+  GByteArray *		out;		/* data written but not pushed yet */
+};
+
+struct _GstSmfencClass {
+  GstElementClass	parent_class;
+};
+
+enum {
+  ARG_0,
+  ARG_FORMAT,
+  ARG_DIVISION
+};
+
+#define DEFAULT_FORMAT (0)
+#define DEFAULT_DIVISION (1000)
+
+/* largest delta time a varlen can hold */
+#define MAX_DELTA ((1 << 28) - 1)
+/* microseconds per quarter note */
+#define TEMPO (1000000)
+/* length of the event track until it's known */
+#define UNKNOWN_LENGTH (0xFFFFFFFF)
+/* size of the buffers a spooled file is pushed in */
+#define SPOOL_BUFFER_SIZE (65536)
+
+static GstElementClass *parent_class = NULL;
+
+static GstStaticPadTemplate gst_smfenc_sink_template =
+GST_STATIC_PAD_TEMPLATE ("sink",
+    GST_PAD_SINK,
+    GST_PAD_ALWAYS,
+    GST_STATIC_CAPS (GST_MIDI_CAPS)
+    );
+
+static GstStaticPadTemplate gst_smfenc_src_template =
+GST_STATIC_PAD_TEMPLATE ("src",
+    GST_PAD_SRC,
+    GST_PAD_ALWAYS,
+    GST_STATIC_CAPS ("audio/midi")
+    );
+
+static void
+gst_smfenc_put (GstSmfenc *enc, const guint8 *data, guint len)
+{
+  g_byte_array_append (enc->out, data, len);
+}
+
+static void
+gst_smfenc_put_byte (GstSmfenc *enc, guint8 byte)
+{
+  g_byte_array_append (enc->out, &byte, 1);
+}
+
+static void
+gst_smfenc_put_varlen (GstSmfenc *enc, guint32 value)
+{
+  guint8 data[4];
+
+  gst_smfenc_put (enc, data, gst_midi_data_write_varlen (data, value));
+}
+
+static void
+gst_smfenc_put_uint32 (GstSmfenc *enc, guint32 value)
+{
+  guint8 data[4];
+
+  GST_WRITE_UINT32_BE (data, value);
+  gst_smfenc_put (enc, data, 4);
+}
+
+/* writes the delta time of an event at tick. Gaps too long for a varlen
+ * are filled with empty text events. */
+static void
+gst_smfenc_put_delta (GstSmfenc *enc, guint64 tick)
+{
+  static const guint8 filler[] = { 0xFF, 0x01, 0x00 };
+
+  while (tick - enc->tick > MAX_DELTA) {
+    gst_smfenc_put_varlen (enc, MAX_DELTA);
+    gst_smfenc_put (enc, filler, sizeof (filler));
+    enc->tick += MAX_DELTA;
+    enc->status = 0;
+  }
+  gst_smfenc_put_varlen (enc, tick - enc->tick);
+  enc->tick = tick;
+}
+
+/* pushes buf as the next part of the file */
+static GstFlowReturn
+gst_smfenc_push_buffer (GstSmfenc *enc, GstBuffer *buf)
+{
+  GST_BUFFER_OFFSET (buf) = enc->offset;
+  enc->offset += GST_BUFFER_SIZE (buf);
+  GST_BUFFER_OFFSET_END (buf) = enc->offset;
+  gst_buffer_set_caps (buf, GST_PAD_CAPS (enc->src));
+  return gst_pad_push (enc->src, buf);
+}
+
+/* pushes what was written since the last push, or adds it to the spooled 
+ * file */
+static GstFlowReturn
+gst_smfenc_push (GstSmfenc *enc)
+{
+  GstBuffer *buf;
+
+  if (enc->out->len == 0)
+    return GST_FLOW_OK;
+  if (enc->spool) {
+    if (fwrite (enc->out->data, 1, enc->out->len, enc->spool) != 
+	enc->out->len) {
+      GST_ELEMENT_ERROR (enc, RESOURCE, WRITE, (NULL),
+	  ("could not write to the temporary file: %s", g_strerror (errno)));
+      return GST_FLOW_ERROR;
+    }
+    enc->offset += enc->out->len;
+    g_byte_array_set_size (enc->out, 0);
+    return GST_FLOW_OK;
+  }
+  buf = gst_buffer_new_and_alloc (enc->out->len);
+  memcpy (GST_BUFFER_DATA (buf), enc->out->data, enc->out->len);
+  g_byte_array_set_size (enc->out, 0);
+  return gst_smfenc_push_buffer (enc, buf);
+}
+
+static void
+gst_smfenc_close_spool (GstSmfenc *enc)
+{
+  if (enc->spool) {
+    fclose (enc->spool);
+    enc->spool = NULL;
+  }
+}
+
+/* pushes the spooled file with the length of the event track filled in */
+static gboolean
+gst_smfenc_push_spool (GstSmfenc *enc, guint32 length)
+{
+  GstBuffer *buf;
+  guint8 data[4];
+  guint64 size;
+  guint n;
+
+  if (gst_smfenc_push (enc) != GST_FLOW_OK)
+    return FALSE;
+  GST_WRITE_UINT32_BE (data, length);
+  if (fseek (enc->spool, enc->track_offset - 4, SEEK_SET) != 0 ||
+      fwrite (data, 1, 4, enc->spool) != 4 ||
+      fseek (enc->spool, 0, SEEK_SET) != 0)
+    goto error;
+
+  size = enc->offset;
+  enc->offset = 0;
+  while (enc->offset < size) {
+    n = MIN (size - enc->offset, SPOOL_BUFFER_SIZE);
+    buf = gst_buffer_new_and_alloc (n);
+    if (fread (GST_BUFFER_DATA (buf), 1, n, enc->spool) != n) {
+      gst_buffer_unref (buf);
+      goto error;
+    }
+    if (gst_smfenc_push_buffer (enc, buf) != GST_FLOW_OK)
+      return FALSE;
+  }
+  return TRUE;
+
+error:
+  GST_ELEMENT_ERROR (enc, RESOURCE, READ, (NULL),
+      ("could not finish the temporary file: %s", g_strerror (errno)));
+  return FALSE;
+}
+
+/* if downstream says it can seek in bytes */
+static gboolean
+gst_smfenc_peer_seekable (GstSmfenc *enc)
+{
+  GstQuery *query;
+  gboolean seekable = FALSE;
+
+  query = gst_query_new_seeking (GST_FORMAT_BYTES);
+  if (gst_pad_peer_query (enc->src, query))
+    gst_query_parse_seeking (query, NULL, &seekable, NULL, NULL);
+  gst_query_unref (query);
+  return seekable;
+}
+
+/* writes the header chunk, the conductor track of format 1 files and the
+ * start of the event track */
+static void
+gst_smfenc_start (GstSmfenc *enc)
+{
+  static const guint8 tempo[] = { 0x00, 0xFF, 0x51, 0x03,
+      (TEMPO >> 16) & 0xFF, (TEMPO >> 8) & 0xFF, TEMPO & 0xFF };
+  static const guint8 end_of_track[] = { 0x00, 0xFF, 0x2F, 0x00 };
+  GstCaps *caps;
+
+  /* a sink that doesn't answer counts as not seekable, so its file gets the
+   * right length too */
+  enc->seekable = gst_smfenc_peer_seekable (enc);
+  if (!enc->seekable) {
+    GST_DEBUG_OBJECT (enc, "downstream can't seek, keeping the file in a "
+	"temporary file until the end");
+    enc->spool = tmpfile ();
+    if (enc->spool == NULL)
+      GST_ELEMENT_WARNING (enc, RESOURCE, OPEN_WRITE, (NULL),
+	  ("could not create a temporary file, the length of the event "
+	   "track stays unknown: %s", g_strerror (errno)));
+  }
+
+  caps = gst_caps_new_simple ("audio/midi", NULL);
+  gst_pad_set_caps (enc->src, caps);
+  gst_caps_unref (caps);
+  gst_pad_push_event (enc->src, gst_event_new_new_segment (FALSE, 1.0,
+	GST_FORMAT_BYTES, 0, -1, 0));
+
+  gst_smfenc_put (enc, (const guint8 *) "MThd", 4);
+  gst_smfenc_put_uint32 (enc, 6);
+  gst_smfenc_put_byte (enc, 0);
+  gst_smfenc_put_byte (enc, enc->format);
+  gst_smfenc_put_byte (enc, 0);
+  gst_smfenc_put_byte (enc, enc->format == 0 ? 1 : 2);
+  gst_smfenc_put_byte (enc, enc->division >> 8);
+  gst_smfenc_put_byte (enc, enc->division & 0xFF);
+  if (enc->format == 1) {
+    gst_smfenc_put (enc, (const guint8 *) "MTrk", 4);
+    gst_smfenc_put_uint32 (enc, sizeof (tempo) + sizeof (end_of_track));
+    gst_smfenc_put (enc, tempo, sizeof (tempo));
+    gst_smfenc_put (enc, end_of_track, sizeof (end_of_track));
+  }
+  gst_smfenc_put (enc, (const guint8 *) "MTrk", 4);
+  gst_smfenc_put_uint32 (enc, UNKNOWN_LENGTH);
+  enc->track_offset = enc->offset + enc->out->len;
+  if (enc->format == 0)
+    gst_smfenc_put (enc, tempo, sizeof (tempo));
+
+  enc->tick = 0;
+  enc->status = 0;
+  enc->tempo = TEMPO;
+  enc->tempo_tick = 0;
+  enc->tempo_time = 0;
+  enc->started = TRUE;
+}
+
+/* real data bytes of system common and real-time messages, -1 for
+ * undefined ones */
+static gint
+gst_smfenc_system_length (guint8 status)
+{
+  switch (status) {
+    case 0xF1: /* time code quarter frame */
+    case 0xF3: /* song select */
+      return 1;
+    case 0xF2: /* song position */
+      return 2;
+    case 0xF6: /* tune request */
+    case 0xF8: /* timing clock */
+    case 0xFA: /* start */
+    case 0xFB: /* continue */
+    case 0xFC: /* stop */
+    case 0xFE: /* active sensing */
+      return 0;
+    default:
+      return -1;
+  }
+}
+
+/* writes a meta event, data follows the status byte. The end of track is 
+ * written by us, tempo changes change how later times map to ticks. */
+static void
+gst_smfenc_meta_event (GstSmfenc *enc, guint64 tick, GstClockTime time,
+    const guint8 *data, guint len)
+{
+  guint check, skip, tempo;
+
+  check = gst_midi_data_parse_varlen (data + 1, len - 1, &skip);
+  g_assert (check + skip + 1 == len);
+
+  switch (data[0]) {
+    case 0x2F:
+      /* end of track */
+      return;
+    case 0x51:
+      /* tempo change */
+      if (check != 3) {
+	GST_WARNING_OBJECT (enc, "dropping tempo meta event of %u bytes",
+	    check);
+	return;
+      }
+      tempo = (data[skip + 1] << 16) + (data[skip + 2] << 8) + data[skip + 3];
+      if (tempo == 0) {
+	GST_WARNING_OBJECT (enc, "dropping tempo meta event with tempo 0");
+	return;
+      }
+      enc->tempo = tempo;
+      enc->tempo_tick = tick;
+      enc->tempo_time = time;
+      break;
+    default:
+      break;
+  }
+  gst_smfenc_put_delta (enc, tick);
+  gst_smfenc_put_byte (enc, 0xFF);
+  gst_smfenc_put (enc, data, len);
+}
+
+/* writes one event of buf. Running status is used for channel events,
+ * system events cancel it like the standard says. */
+static void
+gst_smfenc_event (GstSmfenc *enc, GstBuffer *buf, GstClockTime time,
+    const GstMidiEvent *event)
+{
+  const guint8 *sysex;
+  guint64 tick, ns;
+  guint8 status;
+  guint len, skip;
+  gint n;
+
+  /* rounded to the nearest tick at the current tempo */
+  ns = (guint64) enc->tempo * 1000;
+  tick = enc->tempo_tick;
+  if (time > enc->tempo_time)
+    tick += gst_util_uint64_scale (time - enc->tempo_time + 
+	ns / (2 * enc->division), enc->division, ns);
+  status = event[0];
+
+  if (status < 0xF0) {
+    len = gst_midi_status_get_length (status);
+    gst_smfenc_put_delta (enc, MAX (tick, enc->tick));
+    /* a note on with velocity 0 means the same as a note off with velocity
+     * 64 and can share the running status with note ons */
+    if (gst_midi_event_get_type (event) == GST_MIDI_NOTE_OFF &&
+	event[2] == 0x40) {
+      status = 0x90 | (status & 0xF);
+      if (status != enc->status)
+	gst_smfenc_put_byte (enc, status);
+      gst_smfenc_put_byte (enc, event[1]);
+      gst_smfenc_put_byte (enc, 0);
+    } else {
+      if (status != enc->status)
+	gst_smfenc_put_byte (enc, status);
+      gst_smfenc_put (enc, event + 1, len);
+    }
+    enc->status = status;
+    return;
+  }
+
+  sysex = gst_midi_buffer_get_sysex (buf, event, &status, &len);
+  if (sysex) {
+    gst_smfenc_put_delta (enc, MAX (tick, enc->tick));
+    gst_smfenc_put_byte (enc, status);
+    gst_smfenc_put_varlen (enc, len);
+    gst_smfenc_put (enc, sysex, len);
+    enc->status = 0;
+    return;
+  }
+
+  /* other system events are stored like meta events: a type byte, a varlen
+   * length and the data, the buffer was validated already */
+  len = gst_midi_data_get_length (event + 1, 
+      GST_BUFFER_DATA (buf) + GST_BUFFER_SIZE (buf) - event - 1, status);
+  if (status == 0xFF) {
+    gst_smfenc_meta_event (enc, MAX (tick, enc->tick), time, event + 1, len);
+  } else {
+    /* system common and real-time messages can only be stored escaped, 
+     * their data bytes are the data of the event */
+    n = gst_midi_data_parse_varlen (event + 2, len - 1, &skip);
+    if (n != gst_smfenc_system_length (status)) {
+      GST_WARNING_OBJECT (enc, "dropping system event 0x%02X with %d data "
+	  "bytes", (guint) status, n);
+      return;
+    }
+    gst_smfenc_put_delta (enc, MAX (tick, enc->tick));
+    gst_smfenc_put_byte (enc, 0xF7);
+    gst_smfenc_put_varlen (enc, n + 1);
+    gst_smfenc_put_byte (enc, status);
+    gst_smfenc_put (enc, event + 2 + skip, n);
+  }
+  enc->status = 0;
+}
+
+static GstFlowReturn
+gst_smfenc_chain (GstPad *pad, GstBuffer *buf)
+{
+  GstSmfenc *enc = GST_SMFENC (gst_pad_get_parent (pad));
+  GstFlowReturn ret;
+  GstMidiIter iter;
+
+  if (!gst_midi_buffer_validate (buf)) {
+    GST_ELEMENT_ERROR (enc, STREAM, ENCODE, (NULL),
+	("invalid midi buffer"));
+    gst_buffer_unref (buf);
+    gst_object_unref (enc);
+    return GST_FLOW_ERROR;
+  }
+
+  if (!enc->started)
+    gst_smfenc_start (enc);
+  gst_midi_iter_init (&iter, buf);
+  while (gst_midi_iter_get_event (&iter)) {
+    gst_smfenc_event (enc, buf, gst_midi_iter_get_time (&iter),
+	gst_midi_iter_get_event (&iter));
+    gst_midi_iter_next (&iter);
+  }
+  gst_buffer_unref (buf);
+  ret = gst_smfenc_push (enc);
+
+  gst_object_unref (enc);
+  return ret;
+}
+
+/* ends the event track and writes its length, seeking back to it if the
+ * file was pushed already. Returns FALSE if the file couldn't be finished. */
+static gboolean
+gst_smfenc_finish (GstSmfenc *enc)
+{
+  static const guint8 end_of_track[] = { 0xFF, 0x2F, 0x00 };
+  GstEvent *event;
+  guint64 length;
+  gboolean ret;
+
+  if (!enc->started)
+    gst_smfenc_start (enc);
+  gst_smfenc_put_varlen (enc, 0);
+  gst_smfenc_put (enc, end_of_track, sizeof (end_of_track));
+
+  length = enc->offset + enc->out->len - enc->track_offset;
+  if (length >= UNKNOWN_LENGTH) {
+    GST_ELEMENT_ERROR (enc, STREAM, ENCODE, (NULL),
+	("event track too long for a track chunk"));
+    return FALSE;
+  }
+  if (enc->spool) {
+    ret = gst_smfenc_push_spool (enc, length);
+    gst_smfenc_close_spool (enc);
+    return ret;
+  }
+  if (!enc->seekable) {
+    /* without a temporary file, warned about at the start */
+    return gst_smfenc_push (enc) == GST_FLOW_OK;
+  }
+
+  if (gst_smfenc_push (enc) != GST_FLOW_OK)
+    return FALSE;
+  event = gst_event_new_new_segment (FALSE, 1.0, GST_FORMAT_BYTES,
+      enc->track_offset - 4, -1, enc->track_offset - 4);
+  if (!gst_pad_push_event (enc->src, event)) {
+    GST_ELEMENT_ERROR (enc, RESOURCE, SEEK, (NULL),
+	("could not seek back to write the length of the event track"));
+    return FALSE;
+  }
+  enc->offset = enc->track_offset - 4;
+  gst_smfenc_put_uint32 (enc, length);
+  return gst_smfenc_push (enc) == GST_FLOW_OK;
+}
+
+static gboolean
+gst_smfenc_sink_event (GstPad *pad, GstEvent *event)
+{
+  GstSmfenc *enc = GST_SMFENC (gst_pad_get_parent (pad));
+  gboolean ret;
+
+  switch (GST_EVENT_TYPE (event)) {
+    case GST_EVENT_NEWSEGMENT:
+      /* we send our own in bytes */
+      gst_event_unref (event);
+      ret = TRUE;
+      break;
+    case GST_EVENT_EOS:
+      if (gst_smfenc_finish (enc)) {
+	ret = gst_pad_push_event (enc->src, event);
+      } else {
+	gst_event_unref (event);
+	ret = FALSE;
+      }
+      break;
+    default:
+      ret = gst_pad_event_default (pad, event);
+      break;
+  }
+
+  gst_object_unref (enc);
+  return ret;
+}
+
+static void
+gst_smfenc_reset (GstSmfenc *enc)
+{
+  enc->started = FALSE;
+  enc->seekable = FALSE;
+  gst_smfenc_close_spool (enc);
+  enc->offset = 0;
+  enc->track_offset = 0;
+  enc->tick = 0;
+  enc->status = 0;
+  enc->tempo = TEMPO;
+  enc->tempo_tick = 0;
+  enc->tempo_time = 0;
+  g_byte_array_set_size (enc->out, 0);
+}
+
+static GstStateChangeReturn
+gst_smfenc_change_state (GstElement * element, GstStateChange transition)
+{
+  GstSmfenc *enc = GST_SMFENC (element);
+  GstStateChangeReturn ret = GST_STATE_CHANGE_SUCCESS;
+
+  switch (transition) {
+    case GST_STATE_CHANGE_READY_TO_PAUSED:
+      gst_smfenc_reset (enc);
+      break;
+    default:
+      break;
+  }
+
+  if (parent_class->change_state)
+    ret = parent_class->change_state (element, transition);
+
+  switch (transition) {
+    case GST_STATE_CHANGE_PAUSED_TO_READY:
+      /* drop the temporary file of an unfinished file */
+      gst_smfenc_close_spool (enc);
+      break;
+    default:
+      break;
+  }
+
+  return ret;
+}
+
+static void
+gst_smfenc_set_property (GObject * object, guint prop_id,
+    const GValue * value, GParamSpec * pspec)
+{
+  GstSmfenc *enc = GST_SMFENC (object);
+
+  switch (prop_id) {
+    case ARG_FORMAT:
+      enc->format = g_value_get_uint (value);
+      break;
+    case ARG_DIVISION:
+      enc->division = g_value_get_uint (value);
+      break;
+    default:
+      G_OBJECT_WARN_INVALID_PROPERTY_ID (object, prop_id, pspec);
+      break;
+  }
+}
+
+static void
+gst_smfenc_get_property (GObject * object, guint prop_id,
+    GValue * value, GParamSpec * pspec)
+{
+  GstSmfenc *enc = GST_SMFENC (object);
+
+  switch (prop_id) {
+    case ARG_FORMAT:
+      g_value_set_uint (value, enc->format);
+      break;
+    case ARG_DIVISION:
+      g_value_set_uint (value, enc->division);
+      break;
+    default:
+      G_OBJECT_WARN_INVALID_PROPERTY_ID (object, prop_id, pspec);
+      break;
+  }
+}
+
+static void
+gst_smfenc_dispose (GObject *object)
+{
+  GstSmfenc *enc = GST_SMFENC (object);
+
+  if (enc->out) {
+    g_byte_array_free (enc->out, TRUE);
+    enc->out = NULL;
+  }
+  gst_smfenc_close_spool (enc);
+
+  G_OBJECT_CLASS (parent_class)->dispose (object);
+}
+
+static void
+gst_smfenc_class_init (gpointer g_class, gpointer class_data)
+{
+  GObjectClass *object_class = G_OBJECT_CLASS (g_class);
+  GstElementClass *gstelement_class = GST_ELEMENT_CLASS (g_class);
+
+  parent_class = g_type_class_peek_parent (g_class);
+
+  gstelement_class->change_state = gst_smfenc_change_state;
+
+  object_class->dispose = gst_smfenc_dispose;
+  object_class->set_property = gst_smfenc_set_property;
+  object_class->get_property = gst_smfenc_get_property;
+
+  g_object_class_install_property (object_class, ARG_FORMAT,
+      g_param_spec_uint ("format", "Format",
+	  "Format of the file, 0 for one track, 1 for a conductor track and "
+	  "an event track", 0, 1, DEFAULT_FORMAT, G_PARAM_READWRITE));
+  g_object_class_install_property (object_class, ARG_DIVISION,
+      g_param_spec_uint ("division", "Division",
+	  "Ticks per quarter note event times are rounded to, that is per "
+	  "second until a tempo event changes it", 1, 0x7FFF,
+	  DEFAULT_DIVISION, G_PARAM_READWRITE));
+}
+
+static void
+gst_smfenc_init (GstSmfenc * enc)
+{
+  enc->sink = gst_pad_new_from_template (
+      gst_static_pad_template_get (&gst_smfenc_sink_template), "sink");
+  gst_pad_set_chain_function (enc->sink, GST_DEBUG_FUNCPTR (gst_smfenc_chain));
+  gst_pad_set_event_function (enc->sink,
+      GST_DEBUG_FUNCPTR (gst_smfenc_sink_event));
+  gst_element_add_pad (GST_ELEMENT (enc), enc->sink);
+
+  enc->src = gst_pad_new_from_template (
+      gst_static_pad_template_get (&gst_smfenc_src_template), "src");
+  gst_element_add_pad (GST_ELEMENT (enc), enc->src);
+
+  enc->format = DEFAULT_FORMAT;
+  enc->division = DEFAULT_DIVISION;
+  enc->out = g_byte_array_new ();
+}
+
+static void
+gst_smfenc_base_init (gpointer g_class)
+{
+  static GstElementDetails gst_smfenc_details =
+  GST_ELEMENT_DETAILS ("midi to standard midi file converter",
+      "Codec/Muxer/Audio",
+      "Write GStreamer midi representation to a midi file",
+      "Benjamin Otte <otte@gnome.org>");
+
+  GstElementClass *element_class = GST_ELEMENT_CLASS (g_class);
+
+  gst_element_class_add_pad_template (element_class,
+      gst_static_pad_template_get (&gst_smfenc_sink_template));
+  gst_element_class_add_pad_template (element_class,
+      gst_static_pad_template_get (&gst_smfenc_src_template));
+  gst_element_class_set_details (element_class, &gst_smfenc_details);
+}
+
+GType
+gst_smfenc_get_type (void)
+{
+  static GType smfenc_type = 0;
+
+  if (!smfenc_type) {
+    static const GTypeInfo smfenc_info = {
+      sizeof (GstSmfencClass),
+      gst_smfenc_base_init,
+      NULL,
+      (GClassInitFunc) gst_smfenc_class_init,
+      NULL,
+      NULL,
+      sizeof (GstSmfenc),
+      0,
+      (GInstanceInitFunc) gst_smfenc_init,
+    };
+
+    smfenc_type =
+        g_type_register_static (GST_TYPE_ELEMENT, "GstSmfenc", &smfenc_info,
+        0);
+  }
+  return smfenc_type;
+}
@@ -0,0 +1,38 @@
+/* GStreamer
+ * Copyright (C) 2005 Benjamin Otte <otte@gnome.org>
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Library General Public
+ * License as published by the Free Software Foundation; either
+ * version 2 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Library General Public License for more details.
+ *
+ * You should have received a copy of the GNU Library General Public
+ * License along with this library; if not, write to the
+ * Free Software Foundation, Inc., 59 Temple Place - Suite 330,
+ * Boston, MA 02111-1307, USA.
+ */
+
+#include <gst/gst.h>
+
+#ifndef __GST_SMFENC_H__
+#define __GST_SMFENC_H__
+
+G_BEGIN_DECLS
+
+#define GST_TYPE_SMFENC (gst_smfenc_get_type())
+#define GST_SMFENC(obj) (G_TYPE_CHECK_INSTANCE_CAST((obj),GST_TYPE_SMFENC,GstSmfenc))
+#define GST_IS_SMFENC(obj) (G_TYPE_CHECK_INSTANCE_TYPE((obj),GST_TYPE_SMFENC))
+
+typedef struct _GstSmfenc GstSmfenc;
+typedef struct _GstSmfencClass GstSmfencClass;
+
+GType		gst_smfenc_get_type		(void);
+
+G_END_DECLS
+
+#endif /* __GST_SMFENC_H__ */
@@ -0,0 +1,234 @@
+/* 
+ * Copyright (C) 2005 Benjamin Otte <otte@gnome.org>
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Library General Public
+ * License as published by the Free Software Foundation; either
+ * version 2 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Library General Public License for more details.
+ *
+ * You should have received a copy of the GNU Library General Public
+ * License along with this library; if not, write to the
+ * Free Software Foundation, Inc., 59 Temple Place - Suite 330,
+ * Boston, MA 02111-1307, USA.
+ */
+
+#ifdef HAVE_CONFIG_H
+#  include "config.h"
+#endif
+
+#include "gstsmftrack.h"
+#include "gstmidibuffer.h"
+
+/* number of bytes read at once when decoding delta times */
+#define WORD_SIZE (8)
+
+/* Decodes a delta time from WORD_SIZE bytes of data. All bytes of the varlen 
+ * are found with one look at the continuation bits and are merged without 
+ * looping. Returns the length of the varlen or 0 if it is longer than 4 
+ * bytes. */
+static inline guint
+read_delta (const guint8 *data, guint32 *delta)
+{
+  guint64 word, last;
+  guint32 value;
+  guint n;
+
+  word = GST_READ_UINT64_LE (data);
+  /* the lowest byte without continuation bit ends the varlen */
+  last = ~word & G_GUINT64_CONSTANT (0x8080808080808080);
+  if (G_UNLIKELY ((guint32) last == 0))
+    return 0;
+#ifdef __GNUC__
+  n = __builtin_ctz ((guint32) last) / 8 + 1;
+#else
+  n = g_bit_nth_lsf ((guint32) last, -1) / 8 + 1;
+#endif
+  value = GUINT32_SWAP_LE_BE ((guint32) word) >> (32 - 8 * n);
+  value &= 0x7F7F7F7F;
+  *delta = (value & 0x7F) | ((value >> 1) & 0x3F80) | 
+      ((value >> 2) & 0x1FC000) | ((value >> 3) & 0xFE00000);
+  return n;
+}
+
+/**
+ * gst_smf_track_scan:
+ * @data: contents of a track chunk
+ * @size: size of @data
+ * @tick: tick before the first event, set to the tick of the last event
+ *	  that was scanned
+ * @status: running status before the first event, set to the running 
+ *	    status after the last event that was scanned
+ * @events: #GArray of #GstSmfTrackEvent the found events are appended to
+ *
+ * Scans all complete events in @data in one go, so that they can be 
+ * processed without parsing afterwards. Offsets of the events are relative 
+ * to @data.
+ *
+ * Returns: number of bytes scanned or -1 if @data is not a valid track
+ **/
+gint
+gst_smf_track_scan (const guint8 *data, guint size, guint64 *tick, 
+    guint8 *status, GArray *events)
+{
+  const guint8 *cur, *end;
+  GstSmfTrackEvent *event, *last;
+  guint64 t;
+  guint start;
+  guint32 delta;
+  guint n, len, needed, n_events;
+  gint value;
+  guint8 s, es;
+
+  g_return_val_if_fail (data != NULL || size == 0, -1);
+  g_return_val_if_fail (tick != NULL, -1);
+  g_return_val_if_fail (status != NULL, -1);
+  g_return_val_if_fail (events != NULL, -1);
+
+  /* channel events with running status take 3 bytes usually */
+  start = events->len;
+  g_array_set_size (events, start + size / 3 + 1);
+  event = &g_array_index (events, GstSmfTrackEvent, start);
+  last = &g_array_index (events, GstSmfTrackEvent, events->len);
+
+  t = *tick;
+  s = *status;
+  cur = data;
+  end = data + size;
+  while (cur < end) {
+    if (G_LIKELY (end - cur >= WORD_SIZE)) {
+      n = read_delta (cur, &delta);
+      if (n == 0)
+	goto error;
+    } else {
+      value = gst_midi_data_parse_varlen (cur, end - cur, &n);
+      if (value == -1)
+	break;
+      if (value < 0)
+	goto error;
+      delta = value;
+    }
+    if (G_UNLIKELY ((guint) (end - cur) <= n))
+      break;
+
+    /* event: optional status and data, system events don't change the
+     * running status */
+    len = cur[n] >> 7;
+    if (len)
+      es = cur[n];
+    else if (G_UNLIKELY (s == 0))
+      goto error;
+    else
+      es = s;
+    needed = gst_midi_status_get_length (es);
+    if (G_UNLIKELY (needed > 2)) {
+      needed = gst_midi_data_get_length (cur + n, end - cur - n, es);
+      if (needed == 0)
+	break;
+    } else {
+      s = es;
+      needed += len;
+      if (G_UNLIKELY ((guint) (end - cur - n) < needed))
+	break;
+    }
+
+    if (G_UNLIKELY (event == last)) {
+      n_events = events->len;
+      g_array_set_size (events, n_events * 2);
+      event = &g_array_index (events, GstSmfTrackEvent, n_events);
+      last = &g_array_index (events, GstSmfTrackEvent, events->len);
+    }
+    t += delta;
+    event->tick = t;
+    event->offset = cur + n - data;
+    event->length = needed;
+    event++;
+    cur += n + needed;
+  }
+
+  g_array_set_size (events, event - &g_array_index (events, GstSmfTrackEvent, 0));
+  *tick = t;
+  *status = s;
+  return cur - data;
+
+error:
+  g_array_set_size (events, start);
+  return -1;
+}
+
+/**
+ * gst_smf_track_cursor_init:
+ * @cursor: cursor to initialize
+ * @data: contents of a complete track chunk
+ * @size: size of @data
+ *
+ * Sets up @cursor to read the events in @data, starting at tick 0 without a 
+ * running status. @data must stay around while @cursor is used.
+ **/
+void
+gst_smf_track_cursor_init (GstSmfTrackCursor *cursor, const guint8 *data, 
+    guint size)
+{
+  g_return_if_fail (cursor != NULL);
+  g_return_if_fail (data != NULL || size == 0);
+
+  cursor->data = data;
+  cursor->end = data + size;
+  cursor->tick = 0;
+  cursor->status = 0;
+  cursor->event_status = 0;
+  cursor->event = NULL;
+  cursor->length = 0;
+}
+
+/**
+ * gst_smf_track_cursor_next:
+ * @cursor: a cursor
+ *
+ * Reads the next event of the track. Its tick, status and data are put 
+ * into @cursor.
+ *
+ * Returns: 1 if an event was read, 0 at the end of the track and -1 if the
+ *	    track is invalid
+ **/
+gint
+gst_smf_track_cursor_next (GstSmfTrackCursor *cursor)
+{
+  const guint8 *data;
+  guint n, len;
+  gint delta;
+
+  g_return_val_if_fail (cursor != NULL, -1);
+
+  if (cursor->data >= cursor->end)
+    return 0;
+  delta = gst_midi_data_parse_varlen (cursor->data, cursor->end - cursor->data, &n);
+  if (delta < 0)
+    return -1;
+  data = cursor->data + n;
+  if (data >= cursor->end)
+    return -1;
+  len = gst_midi_data_get_length (data, cursor->end - data, cursor->status);
+  if (len == 0)
+    return -1;
+
+  cursor->data = data + len;
+  cursor->tick += delta;
+  if (data[0] & 0x80) {
+    cursor->event_status = data[0];
+    data++;
+    len--;
+    /* system events don't change the running status */
+    if (cursor->event_status < 0xF0)
+      cursor->status = cursor->event_status;
+  } else {
+    cursor->event_status = cursor->status;
+  }
+  cursor->event = data;
+  cursor->length = len;
+  return 1;
+}
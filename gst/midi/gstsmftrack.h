@@ -0,0 +1,66 @@
+/* 
+ * Copyright (C) 2005 Benjamin Otte <otte@gnome.org>
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Library General Public
+ * License as published by the Free Software Foundation; either
+ * version 2 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Library General Public License for more details.
+ *
+ * You should have received a copy of the GNU Library General Public
+ * License along with this library; if not, write to the
+ * Free Software Foundation, Inc., 59 Temple Place - Suite 330,
+ * Boston, MA 02111-1307, USA.
+ */
+
+#include <gst/gst.h>
+
+#ifndef __GST_SMFTRACK_H__
+#define __GST_SMFTRACK_H__
+
+G_BEGIN_DECLS
+
+
+typedef struct _GstSmfTrackEvent GstSmfTrackEvent;
+
+/* one event of a track chunk as found by gst_smf_track_scan() */
+struct _GstSmfTrackEvent {
+  guint64		tick;		/* tick of the event */
+  guint32		offset;		/* offset of the event after its delta time */
+  guint32		length;		/* length of the event including status */
+};
+
+typedef struct _GstSmfTrackCursor GstSmfTrackCursor;
+
+/* reads the events of a track one after another */
+struct _GstSmfTrackCursor {
+  const guint8 *	data;		/* delta time of the next event */
+  const guint8 *	end;		/* end of the track */
+  guint64		tick;		/* tick of the current event */
+  guint8		status;		/* running status */
+
+  /* the current event */
+  guint8		event_status;	/* its status, running or not */
+  const guint8 *	event;		/* its data after the status byte */
+  guint			length;		/* length of event */
+};
+
+gint		gst_smf_track_scan		(const guint8 *		data,
+						 guint			size,
+						 guint64 *		tick,
+						 guint8 *		status,
+						 GArray *		events);
+
+void		gst_smf_track_cursor_init	(GstSmfTrackCursor *	cursor,
+						 const guint8 *		data,
+						 guint			size);
+gint		gst_smf_track_cursor_next	(GstSmfTrackCursor *	cursor);
+
+
+G_END_DECLS
+
+#endif /* __GST_SMFTRACK_H__ */